@@ -0,0 +1,103 @@
+/* Rayleigh and Compton directions: uniform versus DCS importance sampling.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_dcs
+ *   ./bench_dcs [calls] > bench_dcs.json
+ *
+ * For lead at a few energies, we estimate the scattered weight over 4PI, as
+ * done in TRACE: either the direction is uniform, as randvec_target_circle
+ * without focus, with the weight solid_angle*DCS/xs, or it is drawn by
+ * fluo_dcs_sample with the same weight expression. The components only use
+ * DCS sampling for 4PI scattering. Within a focus area, uniform directions
+ * gave the better figure of merit: DCS sampling restricted to disks of 2 and
+ * 30 deg radius reached 0.15-0.5x of it.
+ *
+ * For each case we give the time per call, the mean weight with its standard
+ * error, and the figure of merit 1/(err^2 time). For DCS sampling,
+ * 'z' is the difference to uniform sampling in standard errors, which should
+ * stay within a few units, and 'fom_gain' the ratio of the figures of merit.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 2
+
+static int    bench_first = 1;
+static FILE  *bench_out;
+
+/* bench_uniform: uniform direction in 4PI, returns the solid angle */
+static double bench_uniform(double *kf) {
+  double c = 1-2*rand01(), s = sqrt(1-c*c), phi = 2*PI*rand01();
+
+  kf[0] = s*cos(phi); kf[1] = s*sin(phi); kf[2] = c;
+  return 4*PI;
+}
+
+static void bench_case(struct fluo_dcs_struct *dcs, int type, int Z, double E, long calls) {
+  double xs, t[2], sum[2]={0,0}, sum2[2]={0,0};
+  double mean[2], err[2], fom[2];
+  char   params[256];
+  long   n;
+  int    mode;
+
+  xs = type == RAYLEIGH ? CSb_Rayl(Z, E, NULL) : CSb_Compt(Z, E, NULL);
+  for (mode=0; mode<2; mode++) {
+    double t0 = bench_time();
+    for (n=0; n<calls; n++) {
+      double kf[3], sa, theta, w;
+      if (!mode) sa = bench_uniform(kf);
+      else fluo_dcs_sample(dcs, type, 0, E, 0,0,1, &kf[0],&kf[1],&kf[2], &sa, NULL);
+      theta = acos(fmax(-1, fmin(1, kf[2])));
+      w = sa*(type == RAYLEIGH ? DCSb_Rayl(Z, E, theta, NULL) : DCSb_Compt(Z, E, theta, NULL))/xs;
+      sum[mode] += w; sum2[mode] += w*w;
+    }
+    t[mode]    = bench_time()-t0;
+    mean[mode] = sum[mode]/calls;
+    err[mode]  = sqrt(fmax(sum2[mode]/calls - mean[mode]*mean[mode], 0)/calls);
+    fom[mode]  = err[mode] > 0 && t[mode] > 0 ? 1/(err[mode]*err[mode]*t[mode]) : 0;
+    snprintf(params, sizeof(params), "\"process\": \"%s\", \"Z\": %d, \"E\": %g, "
+      "\"weight\": %.6g, \"weight_err\": %.3g, \"fom\": %.4g",
+      type == RAYLEIGH ? "Rayleigh" : "Compton", Z, E, mean[mode], err[mode], fom[mode]);
+    if (mode)
+      snprintf(params+strlen(params), sizeof(params)-strlen(params),
+        ", \"z\": %.2f, \"fom_gain\": %.3g",
+        (mean[1]-mean[0])/sqrt(err[0]*err[0] + err[1]*err[1] + 1e-300),
+        fom[0] > 0 ? fom[1]/fom[0] : 0);
+    fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+      bench_first ? "" : ",\n", mode ? "dcs" : "uniform", params, calls,
+      1e9*t[mode]/calls, t[mode] > 0 ? calls/t[mode] : 0);
+    bench_first = 0;
+  }
+  fflush(bench_out);
+}
+
+int main(int argc, char *argv[]) {
+  struct compoundData   *compound;
+  struct fluo_dcs_struct dcs;
+  double energies[] = { 10, 30, 90 }; /* [keV] */
+  long   calls = argc > 1 ? atol(argv[1]) : 200000;
+  int    e, type;
+
+  if (calls <= 0) calls = 200000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  XRayInit();
+  compound = CompoundParser("Pb", NULL);
+  if (!compound) { fprintf(stderr, "bench_dcs: can not parse Pb\n"); return 1; }
+  fluo_dcs_init(&dcs, compound, 5, 100);
+
+  fprintf(bench_out,"{\n  \"benchmark\": \"dcs\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"results\": [\n", BENCH_VERSION, calls);
+  for (type=RAYLEIGH; type<=COMPTON; type++)
+    for (e=0; e<BENCH_COUNT(energies); e++)
+      bench_case(&dcs, type, compound->Elements[0], energies[e], calls);
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+
+  fluo_dcs_free(&dcs);
+  FreeCompoundData(compound);
+  return 0;
+}
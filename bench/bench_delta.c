@@ -0,0 +1,209 @@
+/* Multiple scattering chains: analog tracking versus delta (Woodcock) tracking.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_delta
+ *   ./bench_delta [photons] > bench_delta.json
+ *
+ * A pencil beam at 30 keV enters a thick, strongly fluorescing sample (iron, as
+ * a box and as a hollow cylinder, a few mean free paths in size). The photon
+ * chain of the TRACE loop is replayed with the library kernels, up to a given
+ * scattering order: analog mode solves the sample surfaces and draws the path
+ * in the remaining length for each event, delta mode tracks the chain after
+ * the first event with the majorant cross section. Processes are fluorescence and Rayleigh, with isotropic
+ * emission, as the angular weights do not depend on the tracking.
+ *
+ * For each mode and order we give the time per photon, the mean weight of the
+ * photons leaving the sample with its standard error, and for delta mode the
+ * difference to analog mode in standard errors ('z'), which should stay within
+ * a few units.
+ *
+ * The 'low_majorant' cases check the handling of majorant violations: before
+ * each photon, the majorant is reset to half its value, so that every flight
+ * finds it too low ('violations'). Their times are not meaningful.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 2
+#define BENCH_CHUNKS  10 /* modes alternate by chunks of photons */
+
+static int    bench_first = 1;
+static FILE  *bench_out;
+
+struct bench_sample {
+  struct compoundData         *compound;
+  struct fluo_xs_table_struct  table;
+  struct fluo_processes_struct processes;
+  struct fluo_majorant_struct  majorant;
+  struct fluo_shape_struct     shape;
+  struct fluo_lines_struct    *lines;
+  struct fluo_cache_struct     cache;
+  struct fluo_tally_struct     tally;
+  double rho;                  /* [atoms/AA^3] */
+  double *low;                 /* halved majorant, restored before each photon when set */
+};
+
+/* bench_photon: weight of one photon leaving the sample, as in TRACE (p_interact=0) */
+static double bench_photon(struct bench_sample *s, int delta_mode, int order, double E0) {
+  double x=0, y=0, z=-0.01, kx=0, ky=0, kz=E0*E2K, Ei=E0, p=1;
+  int    event_counter=0, force_transmit=0;
+
+  for (;;) {
+    struct fluo_xs_cache_entry *entry = NULL;
+    double dl=0, sigma, xs[FLUO_PROCESS_MAX], c, phi, k;
+    int    delta=0, type, index, hit;
+
+    if (delta_mode && event_counter && !force_transmit) {
+      delta = fluo_delta_track(&s->majorant, &s->shape, &s->cache, &s->tally, s->rho, Ei,
+        x,y,z, kx,ky,kz, &dl, &entry, NULL);
+      if (!delta) return p;
+    }
+    if (delta <= 0) {
+      double l0, l1, l2, l3, dl0, dl1, dl2, my_s, d_path, p_trans;
+      if (!s->shape.intersect(&s->shape, &l0, &l1, &l2, &l3, x,y,z, kx,ky,kz)) return p;
+      k = sqrt(kx*kx+ky*ky+kz*kz);
+      if (l0 > 0) { x += kx/k*l0; y += ky/k*l0; z += kz/k*l0; l1 -= l0; l2 -= l0; l3 -= l0; l0 = 0; }
+      else if (!(l1 > 0 && l1 > l0) && l2 > 0 && l2 > l1) {
+        x += kx/k*l2; y += ky/k*l2; z += kz/k*l2; l1 = l0 = 0; l3 -= l2; l2 = 0;
+      }
+      dl0 = l1-(l0 > 0 ? l0 : 0); dl1 = l2-(l1 > 0 ? l1 : 0); dl2 = l3-(l2 > 0 ? l2 : 0);
+      if (dl0 < 0) dl0 = 0;
+      if (dl1 < 0) dl1 = 0;
+      if (dl2 < 0) dl2 = 0;
+      if (!dl0 && !dl2) return p;
+      entry = fluo_cache_xs(&s->cache, Ei, &hit);
+      if (!hit) fluo_processes_xsect(&s->processes, &s->table, Ei, entry);
+      my_s    = s->rho*100*entry->sigma;
+      d_path  = dl0+dl2;
+      p_trans = exp(-my_s*d_path);
+      if (force_transmit) return p*p_trans;
+      if (rand01() >= 1-p_trans) return p; /* transmitted, with probability p_trans */
+      dl = -log(1 - rand0max(1 - p_trans))/my_s;
+      if (dl1 > 0 && dl0 > 0 && dl > dl0) dl += dl1;
+    }
+    // move to the collision and scatter
+    k  = sqrt(kx*kx+ky*ky+kz*kz);
+    x += kx/k*dl; y += ky/k*dl; z += kz/k*dl;
+    memcpy(xs, entry->xs, sizeof(xs));
+    sigma = entry->sigma;
+    p    *= (xs[FLUORESCENCE]+xs[RAYLEIGH])/sigma;
+    type  = fluo_processes_select(&s->processes, xs, NULL);
+    index = type < 0 ? -1 : s->processes.process[type].sample(&s->processes.process[type], entry, NULL);
+    if (index < 0) return 0;
+    if (type == FLUORESCENCE) {
+      double dE;
+      Ei = fluo_lines_select(&s->lines[index], Ei, &dE, NULL);
+      if (Ei <= 0) return 0;
+    }
+    c   = randpm1(); phi = 2*PI*rand01();
+    k   = Ei*E2K;
+    kx  = k*sqrt(1-c*c)*cos(phi); ky = k*sqrt(1-c*c)*sin(phi); kz = k*c;
+    event_counter++;
+    if (event_counter >= order || p < 1e-7) force_transmit = 1;
+  }
+}
+
+/* bench_run: both modes, interleaved in chunks so that clock drifts affect both */
+static void bench_run(struct bench_sample *s, const char *shape, int order, long photons) {
+  double E0 = 30, t[2]={0,0}, sum[2]={0,0}, sum2[2]={0,0}, mean[2], err[2], t0; /* [keV] */
+  long   virtual=0, real=0, violations=0, n;
+  char   params[256];
+  int    mode, chunk;
+
+  for (chunk=0; chunk<BENCH_CHUNKS; chunk++)
+    for (mode=0; mode<2; mode++) {
+      memset(&s->tally, 0, sizeof(s->tally));
+      t0 = bench_time();
+      for (n=0; n<photons/BENCH_CHUNKS; n++) {
+        double w;
+        if (s->low) memcpy(s->majorant.sigma, s->low, s->majorant.nb*sizeof(double));
+        w = bench_photon(s, mode, order, E0);
+        sum[mode] += w; sum2[mode] += w*w;
+      }
+      t[mode] += bench_time()-t0;
+      virtual    += s->tally.delta_virtual;
+      real       += s->tally.delta_real;
+      violations += s->tally.delta_violations;
+    }
+  photons = BENCH_CHUNKS*(photons/BENCH_CHUNKS);
+  for (mode=0; mode<2; mode++) {
+    mean[mode] = sum[mode]/photons;
+    err[mode]  = sqrt(fmax(sum2[mode]/photons - mean[mode]*mean[mode], 0)/photons);
+    snprintf(params, sizeof(params), "\"shape\": \"%s\", \"order\": %d, \"weight\": %.6g, "
+      "\"weight_err\": %.3g", shape, order, mean[mode], err[mode]);
+    if (mode)
+      snprintf(params+strlen(params), sizeof(params)-strlen(params),
+        ", \"z\": %.2f, \"virtual_per_real\": %.3g, \"violations\": %ld",
+        (mean[1]-mean[0])/sqrt(err[0]*err[0] + err[1]*err[1] + 1e-300),
+        real ? (double)virtual/real : 0, violations);
+    fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+      bench_first ? "" : ",\n", mode ? "delta" : "analog", params, photons,
+      1e9*t[mode]/photons, t[mode] > 0 ? photons/t[mode] : 0);
+    bench_first = 0;
+  }
+  fflush(bench_out);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_sample s;
+  int    orders[] = { 1, 2, 4, 8 };
+  long   photons  = argc > 1 ? atol(argv[1]) : 200000;
+  double mfp;
+  int    i, o, h;
+
+  if (photons <= 0) photons = 200000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  XRayInit();
+  memset(&s, 0, sizeof(s));
+  s.compound = CompoundParser("Fe", NULL);
+  if (!s.compound) { fprintf(stderr, "bench_delta: can not parse Fe\n"); return 1; }
+  s.rho   = 7.874/55.845*6.02214e23/1e24; /* [atoms/AA^3] */
+  s.lines = calloc(s.compound->nElements, sizeof(struct fluo_lines_struct));
+  for (i=0; i<s.compound->nElements; i++) fluo_lines_init(&s.lines[i], s.compound->Elements[i]);
+  fluo_xs_table_init(&s.table, s.compound, 1, 40, 1e-3, 0);
+  fluo_processes_init(&s.processes);
+  fluo_process_register(&s.processes, FLUORESCENCE, "fluorescence", 1, 1,
+    s.compound->nElements, fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_process_register(&s.processes, RAYLEIGH, "Rayleigh", 1, 1,
+    s.compound->nElements, fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_majorant_init(&s.majorant, &s.processes, &s.table, 1, 40);
+  fluo_cache_init(&s.cache, s.compound->nElements);
+
+  fprintf(bench_out,"{\n  \"benchmark\": \"delta\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"results\": [\n", BENCH_VERSION, photons);
+  // sample sizes in units of the incoming mean free path
+  {
+    struct fluo_xs_cache_entry *entry;
+    int    hit;
+    entry = fluo_cache_xs(&s.cache, 30, &hit);
+    fluo_processes_xsect(&s.processes, &s.table, 30, entry);
+    mfp = 1/(s.rho*100*entry->sigma);
+  }
+  for (h=0; h<2; h++) {
+    /* 4x4x2 mfp box, and a hollow cylinder of 3 mfp radius with a 1 mfp wall */
+    if (!h) fluo_shape_init(&s.shape, FLUO_SHAPE_BOX, 0, 4*mfp, 4*mfp, 2*mfp, 0);
+    else    fluo_shape_init(&s.shape, FLUO_SHAPE_CYLINDER, 3*mfp, 0, 6*mfp, 0, mfp);
+    for (o=0; o<BENCH_COUNT(orders); o++)
+      bench_run(&s, h ? "hollow_cylinder" : "box", orders[o], photons);
+  }
+  // majorant violations on every flight, as if it were a tight bound (hollow cylinder)
+  s.low = malloc(s.majorant.nb*sizeof(double));
+  for (i=0; i<s.majorant.nb; i++) s.low[i] = s.majorant.sigma[i]/2;
+  for (o=1; o<BENCH_COUNT(orders); o++)
+    bench_run(&s, "hollow_cylinder_low_majorant", orders[o], photons);
+  free(s.low);
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+
+  fluo_cache_free(&s.cache);
+  fluo_majorant_free(&s.majorant);
+  fluo_xs_table_free(&s.table);
+  for (i=0; i<s.compound->nElements; i++) fluo_lines_free(&s.lines[i]);
+  free(s.lines);
+  FreeCompoundData(s.compound);
+  return 0;
+}
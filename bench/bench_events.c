@@ -0,0 +1,203 @@
+/* Event log: cost of logging scattering events, and read-back.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_events
+ *   ./bench_events [photons] [file] > bench_events.json
+ *
+ * The photon chain of the TRACE loop (analog tracking, fluorescence and
+ * Rayleigh, up to order 4) is replayed in an iron box, as in bench_delta, with
+ * the event log off, on, and on with a decimation of 10. Modes alternate by
+ * chunks of photons so that clock drifts affect them all, and each chunk waits
+ * for the writer to empty the ring. 'overhead' is the relative increase of the
+ * time per photon over the 'off' mode, and 'stalls' the waits of the tracing
+ * thread on a full ring.
+ *
+ * Each log is then mapped back with fluo_event_map: 'missing' counts records
+ * which were logged but not found in the file (or differ from their copy in
+ * memory), and must be 0. The log file (default /tmp/bench_events.dat) is kept
+ * for bench/fluo_events.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+#define BENCH_CHUNKS  10 /* modes alternate by chunks of photons */
+#define BENCH_ORDER   4
+#define BENCH_MODES   3
+
+static int    bench_first = 1;
+static double bench_sink  = 0;
+static FILE  *bench_out;
+
+struct bench_sample {
+  struct compoundData         *compound;
+  struct fluo_xs_table_struct  table;
+  struct fluo_processes_struct processes;
+  struct fluo_shape_struct     shape;
+  struct fluo_lines_struct    *lines;
+  struct fluo_cache_struct     cache;
+  double rho;                  /* [atoms/AA^3] */
+};
+
+/* bench_photon: weight of one photon leaving the sample, as in TRACE (p_interact=0),
+ * with its events logged when 'event_log' is set. 'sum' gets the sum of Ef over the
+ * logged events, for the read-back check. */
+static double bench_photon(struct bench_sample *s, struct fluo_event_log *event_log,
+  unsigned long long photon, double E0, long *events, double *sum) {
+  double x=0, y=0, z=-0.01, kx=0, ky=0, kz=E0*E2K, Ei=E0, p=1;
+  int    event_counter=0, force_transmit=0;
+
+  for (;;) {
+    struct fluo_xs_cache_entry *entry;
+    double l0, l1, l2, l3, dl0, dl1, dl2, my_s, d_path, p_trans, dl, c, phi, k, Ef, ki;
+    int    type, index, hit;
+
+    if (!s->shape.intersect(&s->shape, &l0, &l1, &l2, &l3, x,y,z, kx,ky,kz)) return p;
+    k = sqrt(kx*kx+ky*ky+kz*kz);
+    if (l0 > 0) { x += kx/k*l0; y += ky/k*l0; z += kz/k*l0; l1 -= l0; l2 -= l0; l3 -= l0; l0 = 0; }
+    dl0 = l1-(l0 > 0 ? l0 : 0); dl1 = l2-(l1 > 0 ? l1 : 0); dl2 = l3-(l2 > 0 ? l2 : 0);
+    if (dl0 < 0) dl0 = 0;
+    if (dl1 < 0) dl1 = 0;
+    if (dl2 < 0) dl2 = 0;
+    if (!dl0 && !dl2) return p;
+    entry = fluo_cache_xs(&s->cache, Ei, &hit);
+    if (!hit) fluo_processes_xsect(&s->processes, &s->table, Ei, entry);
+    my_s    = s->rho*100*entry->sigma;
+    d_path  = dl0+dl2;
+    p_trans = exp(-my_s*d_path);
+    if (force_transmit) return p*p_trans;
+    if (rand01() >= 1-p_trans) return p; /* transmitted, with probability p_trans */
+    dl = -log(1 - rand0max(1 - p_trans))/my_s;
+    if (dl1 > 0 && dl0 > 0 && dl > dl0) dl += dl1;
+    // move to the collision and scatter
+    x += kx/k*dl; y += ky/k*dl; z += kz/k*dl;
+    p    *= (entry->xs[FLUORESCENCE]+entry->xs[RAYLEIGH])/entry->sigma;
+    type  = fluo_processes_select(&s->processes, entry->xs, NULL);
+    index = type < 0 ? -1 : s->processes.process[type].sample(&s->processes.process[type], entry, NULL);
+    if (index < 0) return 0;
+    Ef = Ei;
+    if (type == FLUORESCENCE) {
+      double dE;
+      Ef = fluo_lines_select(&s->lines[index], Ei, &dE, NULL);
+      if (Ef <= 0) return 0;
+    }
+    ki  = k;
+    c   = randpm1(); phi = 2*PI*rand01();
+    k   = Ef*E2K;
+    kx  = k*sqrt(1-c*c)*cos(phi); ky = k*sqrt(1-c*c)*sin(phi); kz = k*c;
+    if (event_log) {
+      fluo_event_scatter(event_log, 0, photon, type, index, s->compound->Elements[index],
+        event_counter+1, Ei, Ef, scalar_prod(kx,ky,kz, 0,0,ki)/k/ki, p, x,y,z);
+      if (fluo_event_keep(event_log, photon)) { (*events)++; *sum += Ef; }
+    }
+    Ei = Ef;
+    event_counter++;
+    if (event_counter >= BENCH_ORDER || p < 1e-7) force_transmit = 1;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_sample s;
+  struct fluo_event_log *log[BENCH_MODES];
+  const char *names[BENCH_MODES] = { "off", "on", "decimated" };
+  int    decimation[BENCH_MODES] = { 0, 1, 10 };
+  long   photons = argc > 1 ? atol(argv[1]) : 500000, n, events[BENCH_MODES]={0,0,0};
+  char  *file    = argc > 2 ? argv[2] : "/tmp/bench_events.dat";
+  char   filename[1024], params[512];
+  double t[BENCH_MODES]={0,0,0}, sum[BENCH_MODES]={0,0,0}, t0, mfp, E0 = 30; /* [keV] */
+  unsigned long long photon = 0;
+  int    i, mode, chunk;
+
+  if (photons <= 0) photons = 500000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  XRayInit();
+  memset(&s, 0, sizeof(s));
+  s.compound = CompoundParser("Fe", NULL);
+  if (!s.compound) { fprintf(stderr, "bench_events: can not parse Fe\n"); return 1; }
+  s.rho   = 7.874/55.845*6.02214e23/1e24; /* [atoms/AA^3] */
+  s.lines = calloc(s.compound->nElements, sizeof(struct fluo_lines_struct));
+  for (i=0; i<s.compound->nElements; i++) fluo_lines_init(&s.lines[i], s.compound->Elements[i]);
+  fluo_xs_table_init(&s.table, s.compound, 1, 40, 1e-3, 0);
+  fluo_processes_init(&s.processes);
+  fluo_process_register(&s.processes, FLUORESCENCE, "fluorescence", 1, 1,
+    s.compound->nElements, fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_process_register(&s.processes, RAYLEIGH, "Rayleigh", 1, 1,
+    s.compound->nElements, fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_cache_init(&s.cache, s.compound->nElements);
+  {
+    struct fluo_xs_cache_entry *entry;
+    int    hit;
+    entry = fluo_cache_xs(&s.cache, E0, &hit);
+    fluo_processes_xsect(&s.processes, &s.table, E0, entry);
+    mfp = 1/(s.rho*100*entry->sigma);
+  }
+  fluo_shape_init(&s.shape, FLUO_SHAPE_BOX, 0, 4*mfp, 4*mfp, 2*mfp, 0);
+
+  for (mode=0; mode<BENCH_MODES; mode++) {
+    log[mode] = NULL;
+    if (!decimation[mode]) continue;
+    snprintf(filename, sizeof(filename), "%s%s", file, decimation[mode] > 1 ? ".decimated" : "");
+    log[mode] = fluo_event_open(filename, 1, decimation[mode], "bench_events");
+    if (!log[mode]) return 1;
+  }
+  fprintf(bench_out,"{\n  \"benchmark\": \"events\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"threaded\": %d,\n  \"results\": [\n", BENCH_VERSION, photons, log[1]->threaded);
+
+  for (chunk=0; chunk<BENCH_CHUNKS; chunk++)
+    for (i=0; i<BENCH_MODES; i++) {
+      mode = (chunk+i) % BENCH_MODES; // rotate, so that no mode always comes last
+      t0 = bench_time();
+      for (n=0; n<photons/BENCH_CHUNKS; n++)
+        bench_sink += bench_photon(&s, log[mode], photon++, E0, &events[mode], &sum[mode]);
+      // the writer work belongs to this mode, also on a single core
+      while (log[mode] && log[mode]->threaded
+        && __atomic_load_n(&log[mode]->ring[0].tail, __ATOMIC_ACQUIRE) != log[mode]->ring[0].head)
+        sched_yield();
+      t[mode] += bench_time()-t0;
+    }
+  photons = BENCH_CHUNKS*(photons/BENCH_CHUNKS);
+
+  for (mode=0; mode<BENCH_MODES; mode++) {
+    struct fluo_event_header *header;
+    struct fluo_event_record *records;
+    long long count = 0, missing = 0;
+    size_t mapped;
+    long   stalls = 0;
+    double read = 0;
+
+    snprintf(params, sizeof(params), "\"mode\": \"%s\", \"decimation\": %d, \"overhead\": %.3f",
+      names[mode], decimation[mode], t[mode]/t[0]-1);
+    if (log[mode]) {
+      snprintf(filename, sizeof(filename), "%s", log[mode]->filename);
+      stalls = log[mode]->ring[0].stalls;
+      fluo_event_close(log[mode], "bench_events");
+      count = fluo_event_map(filename, &header, &records, &mapped);
+      if (count >= 0) {
+        for (n=0; n<count; n++) read += records[n].Ef;
+        fluo_event_unmap(header, mapped);
+      }
+      missing = events[mode] - count;
+      if (!missing && fabs(read - sum[mode]) > 1e-9*sum[mode]) missing = events[mode];
+      snprintf(params+strlen(params), sizeof(params)-strlen(params),
+        ", \"events\": %ld, \"records\": %lld, \"missing\": %lld, \"stalls\": %ld, \"file\": \"%.*s\"",
+        events[mode], count, missing, stalls, 256, filename);
+    }
+    fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+      bench_first ? "" : ",\n", "bench_photon", params, photons,
+      1e9*t[mode]/photons, t[mode] > 0 ? photons/t[mode] : 0);
+    bench_first = 0;
+  }
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+
+  fluo_cache_free(&s.cache);
+  fluo_xs_table_free(&s.table);
+  for (i=0; i<s.compound->nElements; i++) fluo_lines_free(&s.lines[i]);
+  free(s.lines);
+  FreeCompoundData(s.compound);
+  return bench_sink < 0;
+}
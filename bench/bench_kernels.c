@@ -0,0 +1,201 @@
+/* Micro-benchmarks of the fluorescence.c kernels, with JSON output.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make run                      # writes bench_kernels.json
+ *   ./bench_kernels [calls] > bench_kernels.json
+ *
+ * We sweep the compound complexity and the incoming energy for the cross
+ * sections and the interaction/element/line selections, and the reflection
+ * count for the powder kernels. Each result gives ns/call and calls/s. The
+ * 'event' kernel chains what a fluorescence event costs in TRACE: tabulated
+ * cross sections, process, element and line selection.
+ *
+ * The output is one JSON object on stdout, with a fixed key order, so that runs
+ * can be compared with e.g. jq or a diff. Library messages go to stderr.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+
+static int    bench_first = 1;
+static double bench_sink  = 0; /* keeps the timed loops alive */
+static FILE  *bench_out;       /* JSON output, the library messages go to stderr */
+
+/* bench_result: print one result as a JSON object, 'params' is a JSON fragment */
+static void bench_result(const char *kernel, const char *params, long calls, double seconds) {
+  fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+    bench_first ? "" : ",\n", kernel, params, calls,
+    1e9*seconds/calls, seconds > 0 ? calls/seconds : 0);
+  bench_first = 0;
+  fflush(bench_out);
+}
+
+/* compound cross sections and selections, for one compound and energy */
+static void bench_compound(char *formula, double E, long calls) {
+  struct compoundData *compound = CompoundParser(formula, NULL);
+  struct fluo_xs_table_struct table;
+  struct fluo_lines_struct   *lines;
+  struct fluo_processes_struct processes;
+  double *cum_fluo, *cum_Rayleigh, *cum_Compton, xs[FLUO_PROCESS_MAX];
+  char    params[256];
+  double  t0, dE;
+  long    n;
+  int     i, N;
+
+  if (!compound) {
+    fprintf(stderr, "bench_kernels: can not parse compound %s\n", formula);
+    return;
+  }
+  N = compound->nElements;
+  snprintf(params, sizeof(params),
+    "\"compound\": \"%s\", \"elements\": %d, \"energy_keV\": %g", formula, N, E);
+
+  cum_fluo     = calloc(N+1, sizeof(double));
+  cum_Rayleigh = calloc(N+1, sizeof(double));
+  cum_Compton  = calloc(N+1, sizeof(double));
+  lines        = calloc(N, sizeof(struct fluo_lines_struct));
+  for (i=0; i<N; i++) fluo_lines_init(&lines[i], compound->Elements[i]);
+  fluo_xs_table_init(&table, compound, 1, 100, 1e-3, 0);
+  fluo_processes_init(&processes);
+  fluo_process_register(&processes, FLUORESCENCE, "fluorescence", 1, 1, N,
+    fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_process_register(&processes, RAYLEIGH, "Rayleigh", 1, 1, N,
+    fluo_xsect_element, fluo_sample_element, NULL);
+  fluo_process_register(&processes, COMPTON, "Compton", 1, 1, N,
+    fluo_xsect_element, fluo_sample_element, NULL);
+
+  // energies are jittered by 1%, so that nothing is constant
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += XRMC_CrossSections(compound->Elements[n % N], E*(1+0.01*rand01()), xs);
+  bench_result("XRMC_CrossSections", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += fluo_xs_compound(&table, E*(1+0.01*rand01()), xs, cum_fluo, cum_Rayleigh, cum_Compton);
+  bench_result("fluo_xs_compound", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += fluo_xs_table_eval(&table, E*(1+0.01*rand01()), xs, cum_fluo, cum_Rayleigh, cum_Compton);
+  bench_result("fluo_xs_table_eval", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += XRMC_SelectFromDistribution(cum_fluo, N+1, NULL);
+  bench_result("XRMC_SelectFromDistribution", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += XRMC_SelectFluorescenceEnergy(compound->Elements[n % N], E, &dE, NULL);
+  bench_result("XRMC_SelectFluorescenceEnergy", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += fluo_lines_select(&lines[n % N], E, &dE, NULL);
+  bench_result("fluo_lines_select", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    double Ei = E*(1+0.01*rand01());
+    int    i_Z;
+    bench_sink += fluo_xs_table_eval(&table, Ei, xs, cum_fluo, cum_Rayleigh, cum_Compton);
+    bench_sink += fluo_processes_select(&processes, xs, NULL);
+    i_Z         = XRMC_SelectFromDistribution(cum_fluo, N+1, NULL);
+    bench_sink += fluo_lines_select(&lines[i_Z], Ei, &dE, NULL);
+  }
+  bench_result("event", params, calls, bench_time()-t0);
+
+  fluo_xs_table_free(&table);
+  for (i=0; i<N; i++) fluo_lines_free(&lines[i]);
+  free(lines);
+  free(cum_fluo); free(cum_Rayleigh); free(cum_Compton);
+  FreeCompoundData(compound);
+}
+
+/* powder kernels, for synthetic lines with the q^2 density of a real cell */
+static void bench_powder(int count, long calls) {
+  struct fluo_line_info_struct info;
+  struct fluo_line_data *list = calloc(count, sizeof(struct fluo_line_data));
+  double k_min = 2, k_max = 12; /* [Angs-1] i.e. 4-24 keV */
+  double t0, sum, kf_x, kf_y, kf_z, w;
+  struct fluo_powder_focus_struct focus;
+  char   params[64];
+  long   n;
+  int    i;
+
+  memset(&info, 0, sizeof(info));
+  for (i=0; i<count; i++) {
+    list[i].q        = 4*k_max*cbrt((i+1.0)/count);
+    list[i].j        = 1 + (i % 48);
+    list[i].F2       = 1 + 10*rand01();
+    list[i].DWfactor = 1;
+    list[i].w        = 1e-3;
+  }
+  info.V_0 = 100;
+  fluo_line_store_init(&info, list, count);
+  fluo_line_store_weights(&info, 0.6);
+  free(list);
+  snprintf(params, sizeof(params), "\"lines\": %d", count);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += fluo_calc_xsect(&info, k_min+(k_max-k_min)*rand01(), &sum);
+  bench_result("fluo_calc_xsect", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += XRMC_SelectPowderLineQ(&info, 1+n % count, NULL, NULL);
+  bench_result("XRMC_SelectPowderLineQ", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++)
+    bench_sink += fluo_line_sample_q(&info, n % count, NULL);
+  bench_result("fluo_line_sample_q", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    double k = k_min+(k_max-k_min)*rand01();
+    bench_sink += fluo_powder_cone(0, 0, k, info.q[n % count] < 2*k ? info.q[n % count] : k,
+      NULL, 0,0,0, &kf_x, &kf_y, &kf_z, &w, NULL);
+  }
+  bench_result("fluo_powder_cone", params, calls, bench_time()-t0);
+
+  // focused on a 1x1 cm^2 area at 10 cm, 2theta=30 deg
+  fluo_powder_focus_init(&focus, 0, 0, 0.01, 0.01, 0, 0);
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    double k = k_min+(k_max-k_min)*rand01();
+    bench_sink += fluo_powder_cone(0, 0, k, info.q[n % count] < 2*k ? info.q[n % count] : k,
+      &focus, 0.05,0,0.0866, &kf_x, &kf_y, &kf_z, &w, NULL) + w;
+  }
+  bench_result("fluo_powder_cone_target", params, calls, bench_time()-t0);
+
+  fluo_line_store_free(&info);
+}
+
+int main(int argc, char *argv[]) {
+  char  *compounds[] = { "Fe", "SiO2", "CaCO3", "Pb2SnO4", "Ca5(PO4)3F", "KMg3AlSi3O10(OH)2" };
+  double energies[]  = { 8, 17.5, 30, 60 }; /* [keV] */
+  int    counts[]    = { 100, 1000, 10000, 100000 };
+  long   calls       = argc > 1 ? atol(argv[1]) : 200000;
+  int    c, e;
+
+  if (calls <= 0) calls = 200000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  XRayInit();
+  fprintf(bench_out,"{\n  \"benchmark\": \"fluorescence\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"results\": [\n", BENCH_VERSION, calls);
+  for (c=0; c<BENCH_COUNT(compounds); c++)
+    for (e=0; e<BENCH_COUNT(energies); e++)
+      bench_compound(compounds[c], energies[e], calls);
+  for (c=0; c<BENCH_COUNT(counts); c++)
+    bench_powder(counts[c], calls);
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+  if (bench_sink == 0.5) fprintf(stderr, "#\n");
+  return 0;
+}
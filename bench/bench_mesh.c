@@ -0,0 +1,175 @@
+/* Line/mesh intersection throughput, with the BVH and with a face scan.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_mesh
+ *   ./bench_mesh [calls] > bench_mesh.json
+ *
+ * The meshes are icospheres of unit radius, from 80 to 327680 triangles, as a
+ * stand-in for OFF/PLY sample geometries. Lines start outside the sphere, and
+ * half of them aim at it. The reference is the linear scan of all triangles
+ * done by interoff-lib off_x_intersect, which we reproduce here; its number of
+ * calls is scaled down with the mesh size. Both give the first two intersection
+ * distances, and the disagreements are counted as 'mismatches'.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+
+static int    bench_first = 1;
+static double bench_sink  = 0;
+static FILE  *bench_out;
+
+static void bench_result(const char *kernel, const char *params, long calls, double seconds) {
+  fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+    bench_first ? "" : ",\n", kernel, params, calls,
+    1e9*seconds/calls, seconds > 0 ? calls/seconds : 0);
+  bench_first = 0;
+  fflush(bench_out);
+}
+
+/* bench_icosphere: unit sphere as 20*4^level triangles (vertices not shared) */
+static long bench_icosphere(int level, double **vertices, unsigned long **faces) {
+  const double a = (1+sqrt(5))/2;
+  double ico[12][3] = { {-1,a,0},{1,a,0},{-1,-a,0},{1,-a,0},{0,-1,a},{0,1,a},
+                        {0,-1,-a},{0,1,-a},{a,0,-1},{a,0,1},{-a,0,-1},{-a,0,1} };
+  int    tri[20][3] = { {0,11,5},{0,5,1},{0,1,7},{0,7,10},{0,10,11},{1,5,9},{5,11,4},
+                        {11,10,2},{10,7,6},{7,1,8},{3,9,4},{3,4,2},{3,2,6},{3,6,8},
+                        {3,8,9},{4,9,5},{2,4,11},{6,2,10},{8,6,7},{9,8,1} };
+  long   nb = 20, i, l;
+  double *v = malloc(9*nb*sizeof(double));
+
+  for (i=0; i<20; i++) {
+    int c, a_;
+    for (c=0; c<3; c++) for (a_=0; a_<3; a_++) v[9*i+3*c+a_] = ico[tri[i][c]][a_];
+  }
+  for (i=0; i<3*nb; i++) NORM(v[3*i], v[3*i+1], v[3*i+2]);
+  // split each triangle in 4 with the normalized edge midpoints
+  for (l=0; l<level; l++) {
+    double *w = malloc(36*nb*sizeof(double));
+    for (i=0; i<nb; i++) {
+      double *p = v+9*i, m[3][3], *t = w+36*i;
+      int c, a_;
+      for (c=0; c<3; c++) {
+        for (a_=0; a_<3; a_++) m[c][a_] = (p[3*c+a_]+p[3*((c+1)%3)+a_])/2;
+        NORM(m[c][0], m[c][1], m[c][2]);
+      }
+      for (a_=0; a_<3; a_++) {
+        t[a_]    = p[a_];   t[3+a_]  = m[0][a_]; t[6+a_]  = m[2][a_];
+        t[9+a_]  = m[0][a_]; t[12+a_] = p[3+a_];  t[15+a_] = m[1][a_];
+        t[18+a_] = m[2][a_]; t[21+a_] = m[1][a_]; t[24+a_] = p[6+a_];
+        t[27+a_] = m[0][a_]; t[30+a_] = m[1][a_]; t[33+a_] = m[2][a_];
+      }
+    }
+    free(v); v = w; nb *= 4;
+  }
+  *faces = malloc(4*nb*sizeof(unsigned long));
+  for (i=0; i<nb; i++) {
+    (*faces)[4*i] = 3;
+    (*faces)[4*i+1] = 3*i; (*faces)[4*i+2] = 3*i+1; (*faces)[4*i+3] = 3*i+2;
+  }
+  *vertices = v;
+  return nb;
+}
+
+/* bench_scan: all intersections of the line, sorted, as in off_x_intersect */
+static int bench_scan(double *vertices, long nb, double *l0, double *l3,
+  double x, double y, double z, double kx, double ky, double kz) {
+  double hit[FLUO_BVH_HITS], o[3]={x,y,z}, d[3]={kx,ky,kz};
+  long   t;
+  int    n=0, i, j;
+
+  NORM(d[0], d[1], d[2]);
+  for (t=0; t<nb; t++) {
+    double *v0 = vertices+9*t, e1[3], e2[3], p[3], s[3], q[3], det, u, v;
+    for (i=0; i<3; i++) { e1[i] = v0[3+i]-v0[i]; e2[i] = v0[6+i]-v0[i]; s[i] = o[i]-v0[i]; }
+    vec_prod(p[0],p[1],p[2], d[0],d[1],d[2], e2[0],e2[1],e2[2]);
+    det = scalar_prod(e1[0],e1[1],e1[2], p[0],p[1],p[2]);
+    if (!det) continue;
+    u = scalar_prod(s[0],s[1],s[2], p[0],p[1],p[2])/det;
+    if (u < 0 || u > 1) continue;
+    vec_prod(q[0],q[1],q[2], s[0],s[1],s[2], e1[0],e1[1],e1[2]);
+    v = scalar_prod(d[0],d[1],d[2], q[0],q[1],q[2])/det;
+    if (v < 0 || u+v > 1 || n >= FLUO_BVH_HITS) continue;
+    hit[n++] = scalar_prod(e2[0],e2[1],e2[2], q[0],q[1],q[2])/det;
+  }
+  for (i=1; i<n; i++) {
+    double h = hit[i];
+    for (j=i; j>0 && hit[j-1] > h; j--) hit[j] = hit[j-1];
+    hit[j] = h;
+  }
+  if (n) { *l0 = hit[0]; *l3 = hit[1]; }
+  return n;
+}
+
+/* random line from a sphere of radius 3, half of them towards the unit sphere */
+static void bench_line(double *o, double *k, long n) {
+  double c = randpm1(), phi = 2*PI*rand01(), s = sqrt(1-c*c);
+  int    i;
+  o[0] = 3*s*cos(phi); o[1] = 3*s*sin(phi); o[2] = 3*c;
+  for (i=0; i<3; i++) k[i] = (n % 2 ? 0.9 : 3)*randpm1() - o[i];
+}
+
+static void bench_mesh(int level, long calls) {
+  struct fluo_bvh_struct bvh;
+  unsigned long *faces;
+  double *vertices, t0, l0, l3, r0, r3, o[3], k[3];
+  long    nb = bench_icosphere(level, &vertices, &faces), n, mismatch=0, ambiguous=0;
+  long    scan_calls = calls*80/nb > 100 ? calls*80/nb : 100;
+  char    params[256];
+
+  t0 = bench_time();
+  fluo_bvh_init(&bvh, vertices, 3*nb, faces, 4*nb);
+  snprintf(params, sizeof(params), "\"triangles\": %ld, \"nodes\": %ld, \"depth\": %d, \"build_s\": %.4g",
+    nb, bvh.nb_nodes, bvh.depth, bench_time()-t0);
+
+  // agreement with the face scan, on the scan calls
+  for (n=0; n<scan_calls; n++) {
+    int a, b;
+    bench_line(o, k, n);
+    a = fluo_bvh_intersect(&bvh, &l0, &l3, o[0],o[1],o[2], k[0],k[1],k[2]);
+    b = bench_scan(vertices, nb, &r0, &r3, o[0],o[1],o[2], k[0],k[1],k[2]);
+    if (a < 0) ambiguous++;
+    else if (a != b || (a && (fabs(l0-r0) > 1e-9 || fabs(l3-r3) > 1e-9))) mismatch++;
+  }
+  snprintf(params+strlen(params), sizeof(params)-strlen(params),
+    ", \"mismatches\": %ld, \"ambiguous\": %ld", mismatch, ambiguous);
+
+  t0 = bench_time();
+  for (n=0; n<scan_calls; n++) {
+    bench_line(o, k, n);
+    bench_sink += bench_scan(vertices, nb, &l0, &l3, o[0],o[1],o[2], k[0],k[1],k[2]);
+  }
+  bench_result("face_scan", params, scan_calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    bench_line(o, k, n);
+    bench_sink += fluo_bvh_intersect(&bvh, &l0, &l3, o[0],o[1],o[2], k[0],k[1],k[2]);
+  }
+  bench_result("fluo_bvh_intersect", params, calls, bench_time()-t0);
+
+  fluo_bvh_free(&bvh);
+  free(vertices);
+  free(faces);
+}
+
+int main(int argc, char *argv[]) {
+  long calls = argc > 1 ? atol(argv[1]) : 200000;
+  int  level;
+
+  if (calls <= 0) calls = 200000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  fprintf(bench_out,"{\n  \"benchmark\": \"mesh\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"results\": [\n", BENCH_VERSION, calls);
+  for (level=1; level<=7; level++)
+    bench_mesh(level, calls);
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+  if (bench_sink == 0.5) fprintf(stderr, "#\n");
+  return 0;
+}
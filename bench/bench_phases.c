@@ -0,0 +1,141 @@
+/* Phase mixtures: line and element weights versus single-phase materials.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_phases
+ *   ./bench_phases > bench_phases.json
+ *
+ * Two phases, LaB6 and Al2O3 with synthetic reflections, are mixed by
+ * fluo_phases_mix for a few volume fractions and packing factors. A phase alone,
+ * as FluoPowder computes a single material, attenuates with rho*my_s_k2 per
+ * powder line and rho*massFraction per element cross section, with
+ * rho = packing*density/weight. In the mixture, each line and element must get
+ * the sum over the phases of their volume fraction times these single-phase
+ * values (fractions summing above 1 are scaled down). 'lines_rel_diff' and
+ * 'elements_rel_diff' are the largest relative deviations, which should stay at
+ * rounding level; the merged lines must also all be there, sorted by q.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels. The exit
+ * status is 1 when a check fails.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+#define BENCH_LINES   200   /* reflections per phase */
+#define BENCH_TOL     1e-9  /* allowed relative deviation */
+
+static int    bench_first = 1;
+static FILE  *bench_out;
+
+/* bench_phase: compound and synthetic lines of a phase, weighted as a single material */
+static void bench_phase(struct fluo_phase_struct *phase, char *formula, double V_0,
+  double density, double q_shift) {
+  struct fluo_line_data list[BENCH_LINES];
+  xrl_error *error = NULL;
+  int        i;
+
+  phase->compound = CompoundParser(formula, &error);
+  if (error || !phase->compound)
+    exit(fprintf(stderr, "bench_phases: can not parse %s\n", formula));
+  strncpy(phase->material, formula, sizeof(phase->material)-1);
+  phase->density = density;
+  phase->weight  = phase->compound->molarMass;
+  memset(list, 0, sizeof(list));
+  for (i=0; i<BENCH_LINES; i++) {
+    /* distinct q for both phases, so that merged lines can be matched */
+    list[i].q        = 48*cbrt((i+1.0)/BENCH_LINES) + q_shift;
+    list[i].j        = 1 + (i % 48);
+    list[i].F2       = 1 + 10*rand01();
+    list[i].DWfactor = 1;
+    list[i].w        = 1e-3;
+  }
+  memset(&phase->line_info, 0, sizeof(phase->line_info));
+  phase->line_info.V_0 = V_0;
+  fluo_line_store_init(&phase->line_info, list, BENCH_LINES);
+  fluo_line_store_weights(&phase->line_info, phase->packing);
+}
+
+/* bench_compare_q: order of {q, value} pairs */
+static int bench_compare_q(const void *a, const void *b) {
+  double d = ((double*)a)[0] - ((double*)b)[0];
+  return d < 0 ? -1 : (d > 0);
+}
+
+static int bench_case(double f0, double f1, double p0, double p1) {
+  struct fluo_phase_struct    phase[2];
+  struct fluo_material_struct material;
+  double fraction[2] = { f0, f1 }, packing[2] = { p0, p1 }, scale = f0+f1 > 1 ? f0+f1 : 1;
+  double expected[2*BENCH_LINES][2], rho_mix, diff_lines = 0, diff_elements = 0;
+  int    j, i, k, n = 0, sorted = 1, fail;
+
+  memset(phase, 0, sizeof(phase));
+  memset(&material, 0, sizeof(material));
+  for (j=0; j<2; j++) {
+    phase[j].fraction = fraction[j];
+    phase[j].packing  = packing[j];
+  }
+  bench_phase(&phase[0], "LaB6",  71.9, 4.71, 0);
+  bench_phase(&phase[1], "Al2O3", 254.8, 3.95, 1e-4);
+
+  // single-phase attenuation of each line, times the (scaled) volume fraction
+  for (j=0; j<2; j++) {
+    double rho = phase[j].packing*phase[j].density/phase[j].weight;
+    for (i=0; i<phase[j].line_info.count; i++, n++) {
+      expected[n][0] = phase[j].line_info.q[i];
+      expected[n][1] = fraction[j]/scale*rho*phase[j].line_info.my_s_k2[i];
+    }
+  }
+  qsort(expected, n, sizeof(expected[0]), bench_compare_q);
+
+  fluo_phases_mix(phase, 2, &material, "bench_phases");
+  rho_mix = material.density/material.weight;
+  for (i=0; i<material.line_info.count; i++) {
+    double mix = rho_mix*material.line_info.my_s_k2[i];
+    if (i && material.line_info.q[i] < material.line_info.q[i-1]) sorted = 0;
+    if (i < n && expected[i][1] > 0 && fabs(mix/expected[i][1]-1) > diff_lines)
+      diff_lines = fabs(mix/expected[i][1]-1);
+  }
+
+  // element weights: sum of the single-phase rho*massFraction
+  for (k=0; k<material.compound->nElements; k++) {
+    int    Z   = material.compound->Elements[k];
+    double ref = 0, mix = rho_mix*material.compound->massFractions[k];
+    for (j=0; j<2; j++)
+      for (i=0; i<phase[j].compound->nElements; i++)
+        if (phase[j].compound->Elements[i] == Z)
+          ref += fraction[j]/scale*phase[j].packing*phase[j].density/phase[j].weight
+               * phase[j].compound->massFractions[i];
+    if (ref > 0 && fabs(mix/ref-1) > diff_elements) diff_elements = fabs(mix/ref-1);
+    if (ref <= 0) diff_elements = 1;
+  }
+
+  fail = material.line_info.count != n || !sorted
+      || diff_lines > BENCH_TOL || diff_elements > BENCH_TOL;
+  fprintf(bench_out, "%s    {\"fractions\": [%g, %g], \"packing\": [%g, %g], \"lines\": %d, "
+    "\"lines_expected\": %d, \"sorted\": %d, \"lines_rel_diff\": %.3g, \"elements_rel_diff\": %.3g, "
+    "\"fail\": %s}", bench_first ? "" : ",\n", f0, f1, p0, p1, material.line_info.count, n,
+    sorted, diff_lines, diff_elements, fail ? "true" : "false");
+  bench_first = 0;
+
+  fluo_line_store_free(&material.line_info);
+  FreeCompoundData(material.compound);
+  for (j=0; j<2; j++) fluo_phase_free(&phase[j]);
+  return fail;
+}
+
+int main(void) {
+  int failures = 0;
+
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  fprintf(bench_out, "{\n  \"benchmark\": \"phases\",\n  \"version\": %d,\n  \"results\": [\n",
+    BENCH_VERSION);
+  failures += bench_case(0.5, 0.5, 1,   1);
+  failures += bench_case(0.4, 0.2, 0.6, 0.6);
+  failures += bench_case(0.1, 0.3, 0.5, 0.8);
+  failures += bench_case(0.7, 0.6, 1,   0.5); /* scaled down to 1 */
+  fprintf(bench_out, "\n  ],\n  \"failures\": %d\n}\n", failures);
+  fclose(bench_out);
+  return failures > 0;
+}
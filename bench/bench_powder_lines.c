@@ -0,0 +1,101 @@
+/* Throughput of the powder line kernels versus the number of reflections.
+ *
+ * Build and run from this directory with make, or (xraylib is only needed to link):
+ *   cc -O2 -march=native -I.. bench_powder_lines.c -o bench_powder_lines -lxrl -lm
+ *   ./bench_powder_lines [events] > bench_powder_lines.json
+ *
+ * For each reflection count, synthetic lines are generated with the q^2 density
+ * of a real cell, and we time per event: the cut-off and cross section
+ * (fluo_calc_xsect), the line selection (XRMC_SelectPowderLineQ) and the
+ * line-width sampling (fluo_line_sample_q). The former linear scan is given as
+ * reference ('linear_scan').
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+
+static int    bench_first = 1;
+static double bench_sink  = 0; /* keeps the timed loops alive */
+static FILE  *bench_out;       /* JSON output, the library messages go to stderr */
+
+/* bench_result: print one result as a JSON object, as in bench_kernels */
+static void bench_result(const char *kernel, int lines, long events, double seconds) {
+  fprintf(bench_out, "%s    {\"kernel\": \"%s\", \"lines\": %d, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+    bench_first ? "" : ",\n", kernel, lines, events,
+    1e9*seconds/events, seconds > 0 ? events/seconds : 0);
+  bench_first = 0;
+  fflush(bench_out);
+}
+
+/* the per-event scan of the reflection list, as done before the line index */
+static int bench_linear_scan(struct fluo_line_info_struct *info, double k, double *sum) {
+  int i_q;
+  *sum = 0;
+  for (i_q=0; i_q<info->count && info->q[i_q]<2*k; i_q++)
+    *sum += info->my_s_k2[i_q]*k*k;
+  return i_q;
+}
+
+int main(int argc, char *argv[]) {
+  int    counts[] = { 100, 1000, 10000, 100000 };
+  long   events   = argc > 1 ? atol(argv[1]) : 1000000;
+  double k_min = 2, k_max = 12; /* [Angs-1] i.e. 4-24 keV */
+  int    n;
+
+  if (events <= 0) events = 1000000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  fprintf(bench_out,"{\n  \"benchmark\": \"powder_lines\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"results\": [\n", BENCH_VERSION, events);
+  for (n=0; n<BENCH_COUNT(counts); n++) {
+    struct fluo_line_info_struct info;
+    struct fluo_line_data *list = calloc(counts[n], sizeof(struct fluo_line_data));
+    double t0, sum;
+    long   ev;
+    int    i;
+
+    memset(&info, 0, sizeof(info));
+    for (i=0; i<counts[n]; i++) {
+      /* number of lines below q grows as q^3: uniform in q^3 up to 4*k_max */
+      list[i].q        = 4*k_max*cbrt((i+1.0)/counts[n]);
+      list[i].j        = 1 + (i % 48);
+      list[i].F2       = 1 + 10*rand01();
+      list[i].DWfactor = 1;
+      list[i].w        = 1e-3;
+    }
+    info.V_0 = 100;
+    fluo_line_store_init(&info, list, counts[n]);
+    fluo_line_store_weights(&info, 0.6);
+    free(list);
+
+    t0 = bench_time();
+    for (ev=0; ev<events; ev++)
+      bench_sink += bench_linear_scan(&info, k_min+(k_max-k_min)*rand01(), &sum);
+    bench_result("linear_scan", counts[n], events, bench_time()-t0);
+
+    t0 = bench_time();
+    for (ev=0; ev<events; ev++)
+      bench_sink -= fluo_calc_xsect(&info, k_min+(k_max-k_min)*rand01(), &sum);
+    bench_result("fluo_calc_xsect", counts[n], events, bench_time()-t0);
+
+    t0 = bench_time();
+    for (ev=0; ev<events; ev++)
+      bench_sink += XRMC_SelectPowderLineQ(&info, 1+ev % counts[n], NULL, NULL);
+    bench_result("XRMC_SelectPowderLineQ", counts[n], events, bench_time()-t0);
+
+    t0 = bench_time();
+    for (ev=0; ev<events; ev++)
+      bench_sink += fluo_line_sample_q(&info, ev % counts[n], NULL);
+    bench_result("fluo_line_sample_q", counts[n], events, bench_time()-t0);
+
+    fluo_line_store_free(&info);
+  }
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+  if (bench_sink == 0.5) fprintf(stderr, "#\n");
+  return 0;
+}
@@ -0,0 +1,125 @@
+/* Counter-based random streams: cost and reproducibility.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_rng
+ *   ./bench_rng [calls] > bench_rng.json
+ *
+ * The Philox4x32-10 kernel is checked against the known-answer vectors of
+ * Random123 ('kat_failures'). We then time single draws from the McCode
+ * generator (here the xorshift of bench_stub.h) and from a stream, bulk draws
+ * (fluo_rng_uniform_n), and the switch to a new photon
+ * followed by 8 draws, as in TRACE.
+ *
+ * Photon streams are replayed in reverse order, spread over 4 thread streams:
+ * 'replay_mismatches' counts draws which differ from the first pass, and
+ * 'bulk_mismatches' bulk draws which differ from single ones. Both must be 0.
+ * 'z' is the mean of the uniform draws minus 1/2, in standard errors.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+#define BENCH_DRAWS   8   /* draws per photon */
+#define BENCH_BULK    256 /* draws per bulk call */
+
+static int    bench_first = 1;
+static double bench_sink  = 0;
+static FILE  *bench_out;
+
+/* bench_result: print one result as a JSON object, 'params' is a JSON fragment */
+static void bench_result(const char *kernel, const char *params, long calls, double seconds) {
+  fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+    bench_first ? "" : ",\n", kernel, params, calls,
+    1e9*seconds/calls, seconds > 0 ? calls/seconds : 0);
+  bench_first = 0;
+  fflush(bench_out);
+}
+
+/* bench_kat: Philox4x32-10 known answers (counter, key, output) */
+static int bench_kat(void) {
+  unsigned int kat[3][10] = {
+    { 0,0,0,0, 0,0, 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 },
+    { ~0U,~0U,~0U,~0U, ~0U,~0U, 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd },
+    { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344, 0xa4093822, 0x299f31d0,
+      0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 } };
+  unsigned int out[4];
+  int i, j, failures = 0;
+
+  for (i=0; i<3; i++) {
+    fluo_philox(kat[i][0], kat[i][1], kat[i][2], kat[i][3], kat[i][4], kat[i][5], out);
+    for (j=0; j<4; j++) failures += out[j] != kat[i][6+j];
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  struct fluo_rng_struct rng, threads[4];
+  long   calls = argc > 1 ? atol(argv[1]) : 2000000, n, photons, replay = 0, bulk = 0;
+  double t0, sum = 0, *first, r[BENCH_BULK], s[BENCH_BULK];
+  char   params[256];
+  int    kat, i;
+
+  if (calls <= 0) calls = 2000000;
+  photons = calls/BENCH_DRAWS;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  kat = bench_kat();
+  fprintf(bench_out,"{\n  \"benchmark\": \"rng\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"kat_failures\": %d,\n  \"results\": [\n", BENCH_VERSION, calls, kat);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) bench_sink += rand01();
+  bench_result("rand01", "\"generator\": \"xorshift64*\"", calls, bench_time()-t0);
+
+  fluo_rng_init(&rng, 1234, 0, 1, 0);
+  t0 = bench_time();
+  for (n=0; n<calls; n++) sum += fluo_rng_uniform(&rng);
+  snprintf(params, sizeof(params), "\"generator\": \"philox4x32-10\", \"z\": %.2f", (sum/calls-0.5)/sqrt(1.0/12/calls));
+  bench_result("fluo_rng_uniform", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls/BENCH_BULK; n++) {
+    fluo_rng_uniform_n(&rng, r, BENCH_BULK);
+    bench_sink += r[n % BENCH_BULK];
+  }
+  snprintf(params, sizeof(params), "\"generator\": \"philox4x32-10\", \"bulk\": %d", BENCH_BULK);
+  bench_result("fluo_rng_uniform_n", params, n*BENCH_BULK, bench_time()-t0);
+
+  // photon streams, in order
+  first = malloc(photons*BENCH_DRAWS*sizeof(double));
+  if (!first) { fprintf(stderr, "bench_rng: ERROR allocating memory\n"); return 1; }
+  t0 = bench_time();
+  for (n=0; n<photons; n++) {
+    fluo_rng_photon(&rng, n);
+    for (i=0; i<BENCH_DRAWS; i++) first[n*BENCH_DRAWS+i] = fluo_rng_uniform(&rng);
+  }
+  snprintf(params, sizeof(params), "\"generator\": \"philox4x32-10\", \"draws\": %d", BENCH_DRAWS);
+  bench_result("fluo_rng_photon", params, photons, bench_time()-t0);
+
+  // replay in reverse order on 4 thread streams of the same instance
+  for (i=0; i<4; i++) fluo_rng_init(&threads[i], 1234, 0, 1, i);
+  for (n=photons-1; n>=0; n--) {
+    struct fluo_rng_struct *thread = &threads[n % 4];
+    fluo_rng_photon(thread, n);
+    for (i=0; i<BENCH_DRAWS; i++) replay += fluo_rng_uniform(thread) != first[n*BENCH_DRAWS+i];
+  }
+  // bulk draws versus single draws, with an odd start
+  fluo_rng_init(&threads[0], 1234, 0, 1, 0);
+  for (n=0; n<1000; n++) {
+    fluo_rng_photon(&rng, n);
+    fluo_rng_photon(&threads[0], n);
+    for (i=0; i<(int)(n % 3); i++) fluo_rng_uniform(&rng), fluo_rng_uniform(&threads[0]);
+    fluo_rng_uniform_n(&rng, r, 1+n % BENCH_BULK);
+    for (i=0; i<1+n % BENCH_BULK; i++) s[i] = fluo_rng_uniform(&threads[0]);
+    for (i=0; i<1+n % BENCH_BULK; i++) bulk += r[i] != s[i];
+    bulk += fluo_rng_uniform(&rng) != fluo_rng_uniform(&threads[0]);
+  }
+  fprintf(bench_out, "\n  ],\n  \"replay_mismatches\": %ld,\n  \"bulk_mismatches\": %ld\n}\n",
+    replay, bulk);
+  fclose(bench_out);
+  free(first);
+  return bench_sink < 0;
+}
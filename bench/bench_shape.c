@@ -0,0 +1,154 @@
+/* Sample shape kernels: equivalence with the historical geometry block, and
+ * throughput.
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make bench_shape
+ *   ./bench_shape [calls] > bench_shape.json
+ *
+ * For cylinder, box and sphere, solid and hollow (thickness > 0 and < 0), we
+ * trace random lines starting inside and outside of the sample. The reference
+ * is the TRACE code that the descriptor replaces: the outer surface, then the
+ * hole with a second intersect call and the per-event derived dimensions. All
+ * four distances l0..l3 must agree; disagreements are counted as 'mismatches'.
+ * The reference calls sphere/box/cylinder_intersect from the McXtrace run-time
+ * (mcxtrace-r.c) when the Makefile finds it (RUNTIME), else the copies in
+ * bench_stub.h; 'reference' in the output tells which.
+ *
+ * The output is one JSON object on stdout, as for bench_kernels.
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define BENCH_VERSION 1
+
+static int    bench_first = 1;
+static double bench_sink  = 0;
+static FILE  *bench_out;
+
+static void bench_result(const char *kernel, const char *params, long calls, double seconds) {
+  fprintf(bench_out, "%s    {\"kernel\": \"%s\", %s, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_s\": %.4g}",
+    bench_first ? "" : ",\n", kernel, params, calls,
+    1e9*seconds/calls, seconds > 0 ? calls/seconds : 0);
+  bench_first = 0;
+  fflush(bench_out);
+}
+
+/* the former geometry block of Fluorescence/FluoPowder TRACE */
+static int bench_reference(int shape, double radius, double xwidth, double yheight,
+  double zdepth, double thickness, double *l0, double *l1, double *l2, double *l3,
+  double x, double y, double z, double kx, double ky, double kz) {
+  int intersect=0, flag_ishollow=0;
+
+  if (thickness >= 0) {
+    if (shape==0)
+      intersect=cylinder_intersect(l0,l3, x,y,z,kx,ky,kz, radius,yheight);
+    else if (shape==1)
+      intersect=box_intersect     (l0,l3, x,y,z,kx,ky,kz, xwidth,yheight,zdepth);
+    else if (shape==2)
+      intersect=sphere_intersect  (l0,l3, x,y,z,kx,ky,kz, radius);
+  } else {
+    if (shape==0)
+      intersect=cylinder_intersect(l0,l3, x,y,z,kx,ky,kz, radius-thickness,
+        yheight-2*thickness > 0 ? yheight-2*thickness : yheight);
+    else if (shape==1)
+      intersect=box_intersect     (l0,l3, x,y,z,kx,ky,kz,
+        xwidth-2*thickness > 0 ?  xwidth-2*thickness : xwidth,
+        yheight-2*thickness > 0 ? yheight-2*thickness : yheight,
+        zdepth-2*thickness > 0 ?  zdepth-2*thickness : zdepth);
+    else if (shape==2)
+      intersect=sphere_intersect  (l0,l3, x,y,z,kx,ky,kz, radius-thickness);
+  }
+  if (intersect) {
+    if (thickness > 0) {
+      if (shape==0 && cylinder_intersect(l1,l2, x,y,z,kx,ky,kz, radius-thickness,
+        yheight-2*thickness > 0 ? yheight-2*thickness : yheight))
+        flag_ishollow=1;
+      else if (shape==2 && sphere_intersect   (l1,l2, x,y,z,kx,ky,kz, radius-thickness))
+        flag_ishollow=1;
+      else if (shape==1 && box_intersect(l1,l2, x,y,z,kx,ky,kz,
+        xwidth-2*thickness > 0 ? xwidth-2*thickness : xwidth,
+        yheight-2*thickness > 0 ? yheight-2*thickness : yheight,
+        zdepth-2*thickness > 0 ? zdepth-2*thickness : zdepth))
+        flag_ishollow=1;
+    } else if (thickness<0) {
+      if (shape==0 && cylinder_intersect(l1,l2, x,y,z,kx,ky,kz, radius,yheight))
+        flag_ishollow=1;
+      else if (shape==2 && sphere_intersect   (l1,l2, x,y,z,kx,ky,kz, radius))
+        flag_ishollow=1;
+      else if (shape==1 && box_intersect(l1,l2, x,y,z,kx,ky,kz, xwidth, yheight, zdepth))
+        flag_ishollow=1;
+    }
+    if (!flag_ishollow) *l1 = *l2 = *l3;
+  }
+  return intersect;
+}
+
+/* random line within a 2 cm cube, in any direction */
+static void bench_line(double *o, double *k) {
+  double c = randpm1(), phi = 2*PI*rand01(), s = sqrt(1-c*c);
+  int    i;
+  for (i=0; i<3; i++) o[i] = 0.01*randpm1();
+  k[0] = 10*s*cos(phi); k[1] = 10*s*sin(phi); k[2] = 10*c;
+}
+
+static void bench_shape(int shape, double thickness, long calls) {
+  char  *names[] = { "cylinder", "box", "sphere" };
+  double radius = 0.005, xwidth = 0.01, yheight = 0.008, zdepth = 0.006;
+  double l[4], r[4], o[3], k[3], t0;
+  struct fluo_shape_struct desc;
+  char   params[256];
+  long   n, mismatch = 0;
+  int    a, b, i;
+
+  if (shape == FLUO_SHAPE_SPHERE) yheight = 0;
+  fluo_shape_init(&desc, shape, radius, xwidth, yheight, zdepth, thickness);
+  for (n=0; n<calls; n++) {
+    bench_line(o, k);
+    a = desc.intersect(&desc, &l[0], &l[1], &l[2], &l[3], o[0],o[1],o[2], k[0],k[1],k[2]);
+    b = bench_reference(shape, radius, xwidth, yheight, zdepth, thickness,
+      &r[0], &r[1], &r[2], &r[3], o[0],o[1],o[2], k[0],k[1],k[2]);
+    if (a != b) mismatch++;
+    else if (a) for (i=0; i<4; i++)
+      if (fabs(l[i]-r[i]) > 1e-12) { mismatch++; break; }
+  }
+  snprintf(params, sizeof(params), "\"shape\": \"%s\", \"thickness\": %g, \"mismatches\": %ld",
+    names[shape], thickness, mismatch);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    bench_line(o, k);
+    bench_sink += bench_reference(shape, radius, xwidth, yheight, zdepth, thickness,
+      &r[0], &r[1], &r[2], &r[3], o[0],o[1],o[2], k[0],k[1],k[2]) + r[1];
+  }
+  bench_result("reference", params, calls, bench_time()-t0);
+
+  t0 = bench_time();
+  for (n=0; n<calls; n++) {
+    bench_line(o, k);
+    bench_sink += desc.intersect(&desc, &l[0], &l[1], &l[2], &l[3],
+      o[0],o[1],o[2], k[0],k[1],k[2]) + l[1];
+  }
+  bench_result("fluo_shape", params, calls, bench_time()-t0);
+}
+
+int main(int argc, char *argv[]) {
+  double thickness[] = { 0, 0.001, -0.001 };
+  long   calls = argc > 1 ? atol(argv[1]) : 1000000;
+  int    shape, t;
+
+  if (calls <= 0) calls = 1000000;
+  bench_out = fdopen(dup(1), "w");
+  dup2(2, 1);
+  fprintf(bench_out,"{\n  \"benchmark\": \"shape\",\n  \"version\": %d,\n  \"calls\": %ld,\n"
+    "  \"reference\": \"%s\",\n  \"results\": [\n", BENCH_VERSION, calls, BENCH_SHAPE_REFERENCE);
+  if (strcmp(BENCH_SHAPE_REFERENCE, "mcxtrace-r.c"))
+    fprintf(stderr, "bench_shape: mcxtrace-r.c not found (RUNTIME), comparing with the copies in bench_stub.h\n");
+  for (shape=FLUO_SHAPE_CYLINDER; shape<=FLUO_SHAPE_SPHERE; shape++)
+    for (t=0; t<BENCH_COUNT(thickness); t++)
+      bench_shape(shape, thickness[t], calls);
+  fprintf(bench_out, "\n  ]\n}\n");
+  fclose(bench_out);
+  if (bench_sink == 0.5) fprintf(stderr, "#\n");
+  return 0;
+}
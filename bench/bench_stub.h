@@ -0,0 +1,188 @@
+/* Minimal stand-in for the McCode run-time, to build fluorescence.c outside of
+ * an instrument. Only what the library uses is provided: constants, random
+ * numbers, vector macros, shape intersections, MPI_MASTER and the table header
+ * parser.
+ */
+#ifndef BENCH_STUB_H
+#define BENCH_STUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+#include <xraylib/xraylib.h>
+
+#define PI      3.14159265358979323846
+#define DEG2RAD (PI/180)
+#define RAD2DEG (180/PI)
+#define K2E     1.973269718
+#define E2K     0.506773075
+#define CHAR_BUF_LENGTH 1024
+#define FLAVOR_UPPER "MCXTRACE"
+#define MCXTRACE     "/usr/share/mcxtrace"
+#define MC_PATHSEP_C '/'
+#define MPI_MASTER(statement) statement
+
+/* number of elements of a static array, as an int for loop counters */
+#define BENCH_COUNT(a) ((int)(sizeof(a)/sizeof((a)[0])))
+
+/* as in the FluoPowder SHARE block */
+#define XRAYLIB_LINES_MAX 383
+
+/* vector macros, as in mccode-r.h */
+#define scalar_prod(x1, y1, z1, x2, y2, z2) ((x1)*(x2) + (y1)*(y2) + (z1)*(z2))
+#define vec_prod(x, y, z, x1, y1, z1, x2, y2, z2) do { \
+    double bench_vx = (y1)*(z2) - (z1)*(y2), bench_vy = (z1)*(x2) - (x1)*(z2), \
+           bench_vz = (x1)*(y2) - (y1)*(x2); \
+    (x) = bench_vx; (y) = bench_vy; (z) = bench_vz; } while (0)
+#define NORM(x, y, z) do { double bench_n = sqrt((x)*(x) + (y)*(y) + (z)*(z)); \
+    if (bench_n != 0) { (x) /= bench_n; (y) /= bench_n; (z) /= bench_n; } } while (0)
+/* rotate v by phi around a (Rodrigues formula) */
+#define rotate(x, y, z, vx, vy, vz, phi, ax, ay, az) do { \
+    double bench_ax = (ax), bench_ay = (ay), bench_az = (az), bench_c = cos(phi), bench_s = sin(phi); \
+    double bench_px = (vx), bench_py = (vy), bench_pz = (vz), bench_d, bench_cx, bench_cy, bench_cz; \
+    NORM(bench_ax, bench_ay, bench_az); \
+    bench_d = scalar_prod(bench_px, bench_py, bench_pz, bench_ax, bench_ay, bench_az); \
+    vec_prod(bench_cx, bench_cy, bench_cz, bench_ax, bench_ay, bench_az, bench_px, bench_py, bench_pz); \
+    (x) = bench_px*bench_c + bench_cx*bench_s + bench_ax*bench_d*(1-bench_c); \
+    (y) = bench_py*bench_c + bench_cy*bench_s + bench_ay*bench_d*(1-bench_c); \
+    (z) = bench_pz*bench_c + bench_cz*bench_s + bench_az*bench_d*(1-bench_c); } while (0)
+
+/* xorshift64*, good enough for timing purposes */
+static unsigned long long bench_seed = 88172645463325252ULL;
+double rand01(void) {
+  bench_seed ^= bench_seed >> 12; bench_seed ^= bench_seed << 25; bench_seed ^= bench_seed >> 27;
+  return ((bench_seed*2685821657736338717ULL) >> 11)*(1.0/9007199254740992.0);
+}
+double randpm1(void)          { return 2*rand01()-1; }
+double rand0max(double max)   { return max*rand01(); }
+double randnorm(void)         { return sqrt(-2*log(1-rand01()))*cos(2*PI*rand01()); }
+
+typedef struct {
+  char   filename[CHAR_BUF_LENGTH];
+  char  *header;
+  double *data;
+  long   rows, columns;
+} t_Table;
+
+FILE *Open_File(char *name, const char *mode, char *path) {
+  if (path) snprintf(path, CHAR_BUF_LENGTH, "%s", name); /* no search path here */
+  return fopen(name, mode);
+}
+
+/* bench_find_key: first whole-word occurrence of 'key' in 'header', or NULL,
+ * so that "DW" does not match "column_DW" */
+static char *bench_find_key(char *header, char *key) {
+  size_t len = strlen(key);
+  char  *pos;
+
+  if (!header || !len) return NULL;
+  for (pos = header; (pos = strstr(pos, key)); pos++) {
+    int word_start = isalnum((unsigned char)key[0]) || key[0] == '_';
+    int word_end   = isalnum((unsigned char)key[len-1]) || key[len-1] == '_';
+    if (word_start && pos > header && (isalnum((unsigned char)pos[-1]) || pos[-1] == '_')) continue;
+    if (word_end && (isalnum((unsigned char)pos[len]) || pos[len] == '_')) continue;
+    return pos;
+  }
+  return NULL;
+}
+
+/* value following each NULL terminated keyword in the header, or NULL.
+ * The caller frees the values and the array, as with the McCode run-time. */
+char **Table_ParseHeader_backend(char *header, ...) {
+  char  **ret = calloc(64, sizeof(char*));
+  char   *key;
+  int     n = 0;
+  va_list ap;
+
+  if (!ret) return NULL;
+  va_start(ap, header);
+  while ((key = va_arg(ap, char*)) && n < 64) {
+    char *pos = bench_find_key(header, key);
+    if (pos) {
+      pos += strlen(key);
+      pos += strspn(pos, " \t:=");
+      ret[n] = strndup(pos, strcspn(pos, " \t\n\r;,"));
+    }
+    n++;
+  }
+  va_end(ap);
+  return ret;
+}
+#define Table_ParseHeader(header, ...) Table_ParseHeader_backend(header, __VA_ARGS__, NULL)
+
+#ifdef BENCH_RUNTIME
+/* solid shape intersections, taken from mcxtrace-r.c by the Makefile */
+#define BENCH_SHAPE_REFERENCE "mcxtrace-r.c"
+#include "bench_runtime.h"
+#else
+/* solid shape intersections, copies of those in mcxtrace-r.c: distances along k */
+#define BENCH_SHAPE_REFERENCE "bench_stub.h"
+int sphere_intersect(double *l0, double *l1, double x, double y, double z,
+  double kx, double ky, double kz, double r) {
+  double k2 = kx*kx + ky*ky + kz*kz, B = x*kx + y*ky + z*kz, C = x*x + y*y + z*z - r*r;
+  double D = B*B - k2*C;
+  if (D < 0 || !k2) return 0;
+  D = sqrt(D);
+  *l0 = (-B - D)/sqrt(k2);
+  *l1 = (-B + D)/sqrt(k2);
+  return 1;
+}
+
+int box_intersect(double *l0, double *l1, double x, double y, double z,
+  double kx, double ky, double kz, double dx, double dy, double dz) {
+  double k = sqrt(kx*kx + ky*ky + kz*kz), t0 = -HUGE_VAL, t1 = HUGE_VAL, o[3], d[3], h[3];
+  int    a;
+  if (!k) return 0;
+  o[0] = x; o[1] = y; o[2] = z; d[0] = kx/k; d[1] = ky/k; d[2] = kz/k;
+  h[0] = dx/2; h[1] = dy/2; h[2] = dz/2;
+  for (a=0; a<3; a++) {
+    if (d[a] == 0) { if (o[a] < -h[a] || o[a] > h[a]) return 0; continue; }
+    double s0 = (-h[a] - o[a])/d[a], s1 = (h[a] - o[a])/d[a];
+    if (s0 > s1) { double s = s0; s0 = s1; s1 = s; }
+    if (s0 > t0) t0 = s0;
+    if (s1 < t1) t1 = s1;
+  }
+  if (t0 >= t1) return 0;
+  *l0 = t0; *l1 = t1;
+  return 1;
+}
+
+int cylinder_intersect(double *l0, double *l1, double x, double y, double z,
+  double kx, double ky, double kz, double r, double h) {
+  double k = sqrt(kx*kx + ky*ky + kz*kz), A, B, C, D, t0, t1;
+  if (!k) return 0;
+  kx /= k; ky /= k; kz /= k;
+  A = kx*kx + kz*kz; B = 2*(x*kx + z*kz); C = x*x + z*z - r*r;
+  if (A) {
+    D = B*B - 4*A*C;
+    if (D < 0) return 0;
+    t0 = (-B - sqrt(D))/(2*A);
+    t1 = (-B + sqrt(D))/(2*A);
+  } else if (C > 0) return 0;
+  else { t0 = -HUGE_VAL; t1 = HUGE_VAL; }
+  if (ky) {
+    double c0 = (-h/2 - y)/ky, c1 = (h/2 - y)/ky;
+    if (c0 > c1) { double c = c0; c0 = c1; c1 = c; }
+    if (c0 > t0) t0 = c0;
+    if (c1 < t1) t1 = c1;
+  } else if (y < -h/2 || y > h/2) return 0;
+  if (t0 >= t1) return 0;
+  *l0 = t0; *l1 = t1;
+  return 1;
+}
+#endif
+
+/* bench_time: monotonic wall-clock time [s] */
+static inline double bench_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/* Reader for the event logs of FluoPowder/Fluorescence (parameter 'events').
+ *
+ * Build and run from this directory (see the Makefile):
+ *   make fluo_events
+ *   ./fluo_events file           summary per process, element/line and order
+ *   ./fluo_events file dump [n]  the first n records (all by default), as text
+ *
+ * The file is mapped, not read. Intensities in the summary are the sums of the
+ * weights multiplied by the decimation of the log, so that they estimate the
+ * scattered intensity of the simulation. Records hold the cosine of the
+ * scattering angle, which the dump converts to the angle theta [rad].
+ */
+#include "bench_stub.h"
+#include "fluorescence.h"
+#include "fluorescence.c"
+
+#define EVENTS_ORDER_MAX 8
+
+struct events_summary {
+  int    type, index, Z;
+  long   n;
+  double p, Ef;                 /* sums of p and p*Ef */
+  long   order[EVENTS_ORDER_MAX];
+};
+
+/* events_find: summary entry of a (type, index) pair, added when new */
+static struct events_summary *events_find(struct events_summary **list, int *nb, int *size,
+  struct fluo_event_record *r) {
+  int i;
+
+  for (i=0; i<*nb; i++)
+    if ((*list)[i].type == r->type && (*list)[i].index == r->index) return &(*list)[i];
+  if (*nb >= *size) {
+    *size = *size ? 2*(*size) : 64;
+    *list = realloc(*list, *size*sizeof(struct events_summary));
+    if (!*list) { fprintf(stderr, "fluo_events: ERROR allocating memory\n"); exit(1); }
+  }
+  memset(&(*list)[*nb], 0, sizeof(struct events_summary));
+  (*list)[*nb].type  = r->type;
+  (*list)[*nb].index = r->index;
+  (*list)[*nb].Z     = r->Z;
+  return &(*list)[(*nb)++];
+}
+
+int main(int argc, char *argv[]) {
+  const char *types[] = { "fluorescence", "Rayleigh", "Compton", "powder" };
+  struct fluo_event_header *header;
+  struct fluo_event_record *records;
+  struct events_summary    *list = NULL;
+  long long count, n, dump;
+  size_t mapped;
+  int    nb = 0, size = 0, i, o;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file [dump [n]]\n", argv[0]);
+    return 1;
+  }
+  count = fluo_event_map(argv[1], &header, &records, &mapped);
+  if (count < 0) {
+    fprintf(stderr, "fluo_events: %s is not an event log (version %d)\n", argv[1], FLUO_EVENT_VERSION);
+    return 1;
+  }
+  printf("# %s: %lld events from %s, decimation %d\n", argv[1], count, header->compname,
+    header->decimation);
+
+  if (argc > 2 && !strcmp(argv[2], "dump")) {
+    dump = argc > 3 ? atoll(argv[3]) : count;
+    printf("# photon thread order type index Z Ei Ef theta p x y z\n");
+    for (n=0; n<count && n<dump; n++) {
+      struct fluo_event_record *r = &records[n];
+      double c = r->cos_theta > 1 ? 1 : (r->cos_theta < -1 ? -1 : r->cos_theta);
+      printf("%llu %d %d %d %d %d %.6g %.6g %.6g %.6g %.6g %.6g %.6g\n", r->photon, r->thread,
+        r->order, r->type, r->index, r->Z, r->Ei, r->Ef, acos(c), r->p, r->x, r->y, r->z);
+    }
+  } else {
+    for (n=0; n<count; n++) {
+      struct events_summary *e = events_find(&list, &nb, &size, &records[n]);
+      e->n++;
+      e->p  += records[n].p;
+      e->Ef += records[n].p*records[n].Ef;
+      e->order[records[n].order < EVENTS_ORDER_MAX ? records[n].order : EVENTS_ORDER_MAX-1]++;
+    }
+    printf("# process index Z events intensity mean_Ef[keV] order1 order2 ...\n");
+    for (i=0; i<nb; i++) {
+      printf("%s %d %d %ld %.6g %.6g", list[i].type < 4 ? types[list[i].type] : "unknown",
+        list[i].index, list[i].Z, list[i].n, list[i].p*header->decimation,
+        list[i].p > 0 ? list[i].Ef/list[i].p : 0);
+      for (o=1; o<EVENTS_ORDER_MAX; o++) printf(" %ld", list[i].order[o]);
+      printf("\n");
+    }
+    free(list);
+  }
+  fluo_event_unmap(header, mapped);
+  return 0;
+}
@@ -0,0 +1,381 @@
+#!/usr/bin/env python3
+"""End-to-end performance and physics regression suite for FluoPowder.
+
+Run from this directory, with McXtrace in the path (see the Makefile):
+  make regress
+  ./regress.py [--quick] [--baseline baselines/HOST.json] [--update] > regress.json
+
+Performance cases run Debug_FluoPowder.instr (FluoPowder alone) with a fixed
+seed, across ncount, SPLIT count (with and without split=1), scattering order,
+material (LaB6 with its reflections, and the Pb2SnO4 oxide with fluorescence,
+Rayleigh and Compton) and MPI node count. Each case is run once with a few
+photons, which gives the initialisation time (compilation excluded), and then
+'--repeat' times with its ncount: 'photons_per_s' is the best rate over the
+extra photons, and 'peak_rss_mb' the largest resident size of the run and its
+children (per MPI process).
+
+The physics case runs Test_FluoPowder.instr with PowderN (index=1) and with
+FluoPowder (index=3) on the same LaB6 reflections, and compares the peaks of
+the 'det_angle' monitor. Peaks are found in the PowderN pattern, above a
+running median background; for each peak we compare the fraction of the total
+peak intensity ('z', in standard errors, failing beyond --zmax when the
+relative difference also exceeds --rel-tol) and the centroid (failing beyond
+--shift degrees). The ratio of the total peak intensities is reported only, as
+the two components do not model absorption in the same way.
+
+The split case runs Debug_FluoPowder.instr with SPLITS=4, with and without
+split=1, and compares the intensities on the 'Sphere' monitor: the total, and
+the scattered part (pixels below half the brightest one, which holds the direct
+beam). Both must agree within --zmax standard errors, as split=1 only shares
+the first leg between the SPLIT copies.
+
+A case fails when its rate drops by more than --threshold (relative) below the
+rate of the baseline file, and when the baseline has no rate for it: a missing
+baseline file is an error. Rates depend on the machine, so baselines are per
+machine: by default bench/baselines/HOST.json, HOST being the short host name.
+A baseline is written with '--update' on a reference machine, from a clean
+build of the reference revision, and committed; it also records the CPU model,
+core count and compiler, and a warning is printed when they differ from the
+current machine. MPI cases are skipped when mpirun is not found.
+
+The output is one JSON object on stdout, as for the C benchmarks; progress is
+printed on stderr. The exit status is 1 when a case fails.
+"""
+import argparse
+import glob
+import json
+import os
+import platform
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+VERSION = 1
+SEED    = 1000
+HERE    = os.path.dirname(os.path.abspath(__file__))
+INSTR_PERF    = os.path.join(HERE, "..", "Debug_FluoPowder.instr")
+INSTR_PHYSICS = os.path.join(HERE, "..", "Test_FluoPowder.instr")
+
+# name: instrument parameters and ncount (scaled by --scale), 'mpi' nodes
+LAB6  = {"material": "LaB6", "reflections": "LaB6_test.hkl"}
+OXIDE = {"material": "Pb2SnO4", "reflections": "NULL", "flag_compton": 1, "flag_rayleigh": 1}
+CASES = [
+    ("lab6_n1e5",         dict(LAB6), 1e5, 1),
+    ("lab6_n1e6",         dict(LAB6), 1e6, 1),
+    ("lab6_order2",       dict(LAB6, order=2), 1e5, 1),
+    ("lab6_order4",       dict(LAB6, order=4), 1e5, 1),
+    ("lab6_splits10",     dict(LAB6, SPLITS=10), 1e5, 1),
+    ("lab6_splits10_split", dict(LAB6, SPLITS=10, split=1), 1e5, 1),
+    ("lab6_splits100_split", dict(LAB6, SPLITS=100, split=1), 1e4, 1),
+    ("oxide_n1e5",        dict(OXIDE), 1e5, 1),
+    ("oxide_order2",      dict(OXIDE, order=2), 1e5, 1),
+    ("lab6_mpi2",         dict(LAB6), 1e6, 2),
+    ("lab6_mpi4",         dict(LAB6), 1e6, 4),
+]
+QUICK = ("lab6_n1e5", "lab6_splits10_split", "oxide_n1e5")
+BASELINES = os.path.join(HERE, "baselines")
+
+
+def log(*args):
+    print("regress:", *args, file=sys.stderr, flush=True)
+
+
+def machine():
+    """Host, CPU model, core count and compiler, which the rates depend on."""
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as f:
+            cpu = next((l.split(":", 1)[1].strip() for l in f if l.startswith("model name")), cpu)
+    except OSError:
+        pass
+    try:
+        cc = subprocess.run([os.environ.get("CC", "gcc"), "--version"], capture_output=True,
+                            text=True).stdout.split("\n")[0]
+    except OSError:
+        cc = ""
+    return {"host": socket.gethostname().split(".")[0], "cpu": cpu, "cores": os.cpu_count(),
+            "compiler": cc}
+
+
+def run(cmd, cwd):
+    """Run a command, return its wall time [s] and peak RSS [MB] (it and its children)."""
+    t0   = time.perf_counter()
+    proc = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    output = proc.stdout.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    seconds = time.perf_counter()-t0
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode:
+        sys.stderr.write(output.decode(errors="replace"))
+        raise RuntimeError("%s failed (status %d)" % (" ".join(cmd), proc.returncode))
+    return seconds, usage.ru_maxrss/1024.0  # ru_maxrss is in kB on Linux
+
+
+def mxrun(args, instr, params, ncount, mpi, workdir, name, compile=False):
+    """One simulation into workdir/name, return (seconds, peak RSS [MB], data directory)."""
+    directory = os.path.join(workdir, name)
+    cmd = [args.mxrun, os.path.basename(instr), "-n", "%d" % ncount, "-s", "%d" % SEED,
+           "-d", directory]
+    if compile:
+        cmd.append("-c")
+    if mpi > 1:
+        cmd.append("--mpi=%d" % mpi)
+    cmd += ["%s=%s" % (k, v) for k, v in params.items()]
+    seconds, rss = run(cmd, workdir)
+    return seconds, rss, directory
+
+
+def perf_case(args, workdir, name, params, ncount, mpi, compiled):
+    """Initialisation time, photon rate and peak RSS of one case."""
+    ncount = max(int(ncount*args.scale), 10*args.init_ncount)
+    key    = ("mpi" if mpi > 1 else "serial")
+    result = {"case": name, "ncount": ncount, "mpi": mpi, "params": params}
+    if mpi > 1 and not shutil.which("mpirun"):
+        result["skipped"] = "mpirun not found"
+        return result
+    if key not in compiled:  # the first run of each flavour compiles, and is not timed
+        mxrun(args, INSTR_PERF, params, args.init_ncount, mpi, workdir, name+"_compile", compile=True)
+        compiled.add(key)
+    init, rss, _ = mxrun(args, INSTR_PERF, params, args.init_ncount, mpi, workdir, name+"_init")
+    best = None
+    for r in range(args.repeat):
+        seconds, peak, _ = mxrun(args, INSTR_PERF, params, ncount, mpi, workdir, "%s_%d" % (name, r))
+        rss  = max(rss, peak)
+        rate = (ncount-args.init_ncount)/max(seconds-init, 1e-9)
+        best = rate if best is None else max(best, rate)
+    result.update({"init_s": round(init, 3), "photons_per_s": round(best, 1),
+                   "peak_rss_mb": round(rss, 1)})
+    return result
+
+
+def read_1d(directory, monitor):
+    """McCode 1D monitor file: lists of x, I, I_err."""
+    files = sorted(glob.glob(os.path.join(directory, monitor+"*")))
+    if not files:
+        raise RuntimeError("no %s monitor file in %s" % (monitor, directory))
+    x, I, E = [], [], []
+    with open(files[0]) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            columns = line.split()
+            x.append(float(columns[0])); I.append(float(columns[1])); E.append(float(columns[2]))
+    return x, I, E
+
+
+def background(I, width):
+    """Running median of I over 2*width+1 bins."""
+    bg = []
+    for i in range(len(I)):
+        window = sorted(I[max(0, i-width):i+width+1])
+        bg.append(window[len(window)//2])
+    return bg
+
+
+def find_peaks(I, E, bg, zpeak, gap=3, margin=3):
+    """Bin windows [first, last] of the peaks above background."""
+    peaks = []
+    for i in range(len(I)):
+        if E[i] > 0 and I[i]-bg[i] > zpeak*E[i]:
+            if peaks and i-peaks[-1][1] <= gap:
+                peaks[-1][1] = i
+            else:
+                peaks.append([i, i])
+    return [(max(0, a-margin), min(len(I)-1, b+margin)) for a, b in peaks if b > a]
+
+
+def peak_areas(x, I, E, bg, peaks):
+    """Area above background, its variance, and centroid of each peak."""
+    areas = []
+    for a, b in peaks:
+        s  = sum(I[i]-bg[i] for i in range(a, b+1))
+        v  = sum(E[i]**2 for i in range(a, b+1))
+        c  = sum(x[i]*(I[i]-bg[i]) for i in range(a, b+1))/s if s > 0 else 0.5*(x[a]+x[b])
+        areas.append((s, v, c))
+    return areas
+
+
+def physics_case(args, workdir):
+    """PowderN versus FluoPowder peaks on the det_angle monitor."""
+    params = {"E0": 15, "dE": 0.01, "d_phi": 3, "frac_i": 0, "frac_t": 0.1, "frac_c": 0.9,
+              "directbeam": 0, "reflections": args.reflections}
+    ncount = int(args.physics_ncount*args.scale)
+    result = {"case": "physics_powder", "ncount": ncount, "params": params}
+    data   = {}
+    for index, name in ((1, "PowderN"), (3, "FluoPowder")):
+        _, _, directory = mxrun(args, INSTR_PHYSICS, dict(params, index=index), ncount, 1,
+                                workdir, "physics_"+name, compile=(index == 1))
+        x, I, E = read_1d(directory, "det_angle")
+        data[name] = (x, I, E, background(I, 25))
+    x, I, E, bg = data["PowderN"]
+    peaks = find_peaks(I, E, bg, args.zpeak)
+    ref   = peak_areas(x, I, E, bg, peaks)
+    test  = peak_areas(*data["FluoPowder"][0:3], data["FluoPowder"][3], peaks)
+    total_r, total_t = sum(a[0] for a in ref), sum(a[0] for a in test)
+    failures, lines = 0, []
+    for (a, b), r, t in zip(peaks, ref, test):
+        fr = r[0]/total_r if total_r > 0 else 0
+        ft = t[0]/total_t if total_t > 0 else 0
+        er = fr*(r[1]**0.5/abs(r[0])) if r[0] else 0
+        et = ft*(t[1]**0.5/abs(t[0])) if t[0] else 0
+        z  = (ft-fr)/max((er*er+et*et)**0.5, 1e-300)
+        fail = (abs(z) > args.zmax and abs(ft-fr) > args.rel_tol*fr) \
+            or (fr > 0.01 and abs(t[2]-r[2]) > args.shift)
+        failures += fail
+        lines.append({"theta": round(r[2], 4), "fraction_ref": round(fr, 5),
+                      "fraction": round(ft, 5), "z": round(z, 2),
+                      "shift_deg": round(t[2]-r[2], 4), "fail": bool(fail)})
+    result.update({"peaks": lines, "intensity_ratio": total_t/total_r if total_r > 0 else 0,
+                   "failures": failures + (not peaks)})
+    if not peaks:
+        result["error"] = "no peak found in the PowderN pattern"
+    return result
+
+
+def read_2d(directory, monitor):
+    """McCode 2D monitor file: flat lists of I and I_err."""
+    files = sorted(glob.glob(os.path.join(directory, monitor+"*")))
+    if not files:
+        raise RuntimeError("no %s monitor file in %s" % (monitor, directory))
+    blocks, block = {}, None
+    with open(files[0]) as f:
+        for line in f:
+            if line.startswith("# Data"):
+                block = blocks.setdefault("I", [])
+            elif line.startswith("# Errors"):
+                block = blocks.setdefault("E", [])
+            elif line.startswith("#"):
+                block = None
+            elif block is not None:
+                block.extend(float(v) for v in line.split())
+    return blocks.get("I", []), blocks.get("E", [])
+
+
+def split_case(args, workdir):
+    """Sphere monitor intensities with SPLIT copies, without and with split=1."""
+    params = dict(OXIDE, order=2, SPLITS=4)
+    ncount = int(args.split_ncount*args.scale)
+    result = {"case": "physics_split", "ncount": ncount, "params": params}
+    sums   = {}
+    for split in (0, 1):
+        _, _, directory = mxrun(args, INSTR_PERF, dict(params, split=split), ncount, 1,
+                                workdir, "split_%d" % split, compile=(split == 0))
+        I, E = read_2d(directory, "Sphere")
+        top  = 0.5*max(I) if I else 0
+        sums[split] = {"total": (sum(I), sum(e*e for e in E)),
+                       "scattered": (sum(i for i in I if i < top),
+                                     sum(e*e for i, e in zip(I, E) if i < top))}
+    failures = 0
+    for part in ("total", "scattered"):
+        (a, va), (b, vb) = sums[0][part], sums[1][part]
+        z    = (b-a)/max((va+vb)**0.5, 1e-300)
+        fail = abs(z) > args.zmax
+        failures += fail
+        result[part] = {"split0": a, "split1": b, "z": round(z, 2), "fail": bool(fail)}
+    result["failures"] = failures
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--mxrun", default=os.environ.get("MXRUN", "mxrun"), help="McXtrace run command")
+    parser.add_argument("--baseline", default=os.path.join(BASELINES, machine()["host"]+".json"),
+                        help="baseline rates (JSON), default baselines/HOST.json")
+    parser.add_argument("--update", action="store_true", help="write the rates as the new baseline")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed relative rate drop")
+    parser.add_argument("--repeat", type=int, default=3, help="timed runs per case, the best is kept")
+    parser.add_argument("--scale", type=float, default=1.0, help="ncount multiplier")
+    parser.add_argument("--init-ncount", type=int, default=100, help="ncount of the initialisation run")
+    parser.add_argument("--quick", action="store_true", help="only %s and the physics cases" % ", ".join(QUICK))
+    parser.add_argument("--cases", default="", help="comma separated case names, 'none' for physics only")
+    parser.add_argument("--no-physics", action="store_true", help="skip the PowderN and split comparisons")
+    parser.add_argument("--physics-ncount", type=float, default=1e7, help="ncount of the physics runs")
+    parser.add_argument("--split-ncount", type=float, default=1e6, help="ncount of the split runs")
+    parser.add_argument("--reflections", default="LaB6_660b_AVID2.hkl", help="LaB6 reflections for the physics case")
+    parser.add_argument("--zpeak", type=float, default=5, help="peak detection level, in standard errors")
+    parser.add_argument("--zmax", type=float, default=5, help="allowed peak fraction difference, in standard errors")
+    parser.add_argument("--rel-tol", type=float, default=0.10, help="allowed relative peak fraction difference")
+    parser.add_argument("--shift", type=float, default=0.05, help="allowed peak centroid shift [deg]")
+    parser.add_argument("--keep", action="store_true", help="keep the simulation directories")
+    args = parser.parse_args()
+
+    if not shutil.which(args.mxrun):
+        log("%s not found (set MXRUN or --mxrun)" % args.mxrun)
+        return 2
+    names = [c for c in args.cases.split(",") if c] if args.cases else \
+        (list(QUICK) if args.quick else [c[0] for c in CASES])
+    baseline, here = {}, machine()
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            data = json.load(f)
+        baseline = {r["case"]: r for r in data.get("results", []) if "photons_per_s" in r}
+        for key in ("cpu", "cores", "compiler"):
+            if key in data.get("machine", {}) and data["machine"][key] != here[key]:
+                log("baseline %s %s differs from this machine (%s): rates may not compare"
+                    % (key, data["machine"][key], here[key]))
+    elif not args.update:
+        log("no baseline %s: write it with --update on the reference build first" % args.baseline)
+        return 2
+
+    workdir = tempfile.mkdtemp(prefix="fluo_regress_")
+    for instr in (INSTR_PERF, INSTR_PHYSICS, os.path.join(HERE, "..", "LaB6_test.hkl")):
+        shutil.copy(instr, workdir)
+    for comp in glob.glob(os.path.join(HERE, "..", "*.comp")) + glob.glob(os.path.join(HERE, "..", "fluorescence*.[ch]")):
+        shutil.copy(comp, workdir)
+
+    results, failures, compiled = [], 0, set()
+    try:
+        for name, params, ncount, mpi in CASES:
+            if name not in names:
+                continue
+            log("running", name)
+            r = perf_case(args, workdir, name, params, ncount, mpi, compiled)
+            if name in baseline and "photons_per_s" in r:
+                ref = baseline[name]["photons_per_s"]
+                r["baseline_photons_per_s"] = ref
+                r["change"] = round(r["photons_per_s"]/ref-1, 4)
+                r["fail"] = r["change"] < -args.threshold
+                failures += r["fail"]
+            elif "photons_per_s" in r and not args.update:
+                r["error"] = "no baseline rate"
+                r["fail"] = True
+                failures += 1
+            results.append(r)
+        if not args.no_physics:
+            log("running physics_powder")
+            r = physics_case(args, workdir)
+            failures += r["failures"]
+            results.append(r)
+            log("running physics_split")
+            r = split_case(args, workdir)
+            failures += r["failures"]
+            results.append(r)
+    finally:
+        if args.keep:
+            log("simulations kept in", workdir)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    report = {"benchmark": "regress", "version": VERSION, "seed": SEED, "machine": here,
+              "baseline": os.path.relpath(args.baseline),
+              "threshold": args.threshold, "failures": failures, "results": results}
+    json.dump(report, sys.stdout, indent=2)
+    print()
+    if args.update:  # the cases which did not run keep their former rates
+        baseline.update({r["case"]: r for r in results if "photons_per_s" in r})
+        if os.path.dirname(args.baseline):
+            os.makedirs(os.path.dirname(args.baseline), exist_ok=True)
+        with open(args.baseline, "w") as f:
+            json.dump({"benchmark": "regress", "version": VERSION, "machine": here,
+                       "results": [baseline[c[0]] for c in CASES if c[0] in baseline]}, f, indent=2)
+        log("baseline written into", args.baseline)
+    if failures:
+        log("%d failure(s)" % failures)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
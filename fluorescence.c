@@ -7,6 +7,137 @@
  * https://github.com/golosio/xrmc src/photon/photon.cpp (c) Bruno Golosio
  */
 
+/* Random number streams ==================================================== */
+
+#define FLUO_PHILOX_M0 0xD2511F53U
+#define FLUO_PHILOX_M1 0xCD9E8D57U
+#define FLUO_PHILOX_W0 0x9E3779B9U /* golden ratio */
+#define FLUO_PHILOX_W1 0xBB67AE85U /* sqrt(3)-1 */
+
+/* fluo_philox: 10 rounds of Philox4x32 on counter c with key k */
+static inline void fluo_philox(unsigned int c0, unsigned int c1, unsigned int c2, unsigned int c3,
+  unsigned int k0, unsigned int k1, unsigned int *out)
+{
+  int r;
+
+  for (r=0; r<10; r++) {
+    unsigned long long p0 = (unsigned long long)FLUO_PHILOX_M0*c0;
+    unsigned long long p1 = (unsigned long long)FLUO_PHILOX_M1*c2;
+    c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+    c1 = (unsigned int)p1;
+    c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+    c3 = (unsigned int)p0;
+    k0 += FLUO_PHILOX_W0; k1 += FLUO_PHILOX_W1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+} // fluo_philox
+
+/* blocks computed together in bulk draws. 4 lanes fit 128-bit vectors: wider
+ * ones end up in ymm16-31 with AVX-512, without vzeroupper before the SSE libm
+ * calls of the caller, which then run several times slower. */
+#define FLUO_RNG_LANES 4
+
+/* 53 bits from two words, in [0,1) */
+#define FLUO_RNG_DOUBLE(a, b) \
+  (((double)((a) >> 5)*67108864.0 + (double)((b) >> 6))*(1.0/9007199254740992.0))
+
+void fluo_rng_init(struct fluo_rng_struct *rng, unsigned long long seed, int rank,
+  int instance, int thread)
+{
+  memset(rng, 0, sizeof(struct fluo_rng_struct));
+  rng->key[0] = (unsigned int)seed;
+  rng->key[1] = (unsigned int)(seed >> 32) ^ ((unsigned int)rank*FLUO_PHILOX_W0);
+  // high half: component instance, low half: 0 for photon streams, else thread+1
+  rng->stream = ((unsigned int)instance << 16) | (((unsigned int)thread+1) & 0xFFFF);
+  rng->ctr[3] = rng->stream;
+} // fluo_rng_init
+
+struct fluo_rng_struct *fluo_rng_create(unsigned long long seed, int instance, int nb)
+{
+  struct fluo_rng_struct *rng = calloc(nb, sizeof(struct fluo_rng_struct));
+  int rank = 0, i;
+
+  if (!rng) return NULL;
+#ifdef USE_MPI
+  rank = mpi_node_rank;
+#endif
+  for (i=0; i<nb; i++) fluo_rng_init(&rng[i], seed, rank, instance, i);
+  return rng;
+} // fluo_rng_create
+
+void fluo_rng_photon(struct fluo_rng_struct *rng, unsigned long long id)
+{
+  unsigned int stream = rng->stream & 0xFFFF0000U;
+
+  if (rng->ctr[3] == stream && rng->ctr[0] == (unsigned int)id
+    && rng->ctr[1] == (unsigned int)(id >> 32)) return; // same photon: go on
+  rng->ctr[0] = (unsigned int)id;
+  rng->ctr[1] = (unsigned int)(id >> 32);
+  rng->ctr[2] = 0;
+  rng->ctr[3] = stream;
+  rng->left   = 0;
+} // fluo_rng_photon
+
+double fluo_rng_uniform(struct fluo_rng_struct *rng)
+{
+  if (!rng->left) {
+    fluo_philox(rng->ctr[0], rng->ctr[1], rng->ctr[2]++, rng->ctr[3], rng->key[0], rng->key[1], rng->out);
+    rng->left = 2;
+  }
+  rng->left--;
+  return rng->left ? FLUO_RNG_DOUBLE(rng->out[0], rng->out[1]) : FLUO_RNG_DOUBLE(rng->out[2], rng->out[3]);
+} // fluo_rng_uniform
+
+void fluo_rng_uniform_n(struct fluo_rng_struct *rng, double *r, long n)
+{
+  unsigned int c2 = rng->ctr[2];
+  long i = 0, j, nb;
+
+  // first use the numbers left in the current block
+  while (rng->left && i < n) r[i++] = fluo_rng_uniform(rng);
+  // independent blocks, in the same order as fluo_rng_uniform, by groups of
+  // FLUO_RNG_LANES so that the rounds run on vector lanes
+  nb = (n-i)/2;
+  for (j=0; j+FLUO_RNG_LANES <= nb; j+=FLUO_RNG_LANES) {
+    unsigned int x0[FLUO_RNG_LANES], x1[FLUO_RNG_LANES], x2[FLUO_RNG_LANES], x3[FLUO_RNG_LANES];
+    unsigned int k0 = rng->key[0], k1 = rng->key[1];
+    int l, round;
+    for (l=0; l<FLUO_RNG_LANES; l++) {
+      x0[l] = rng->ctr[0]; x1[l] = rng->ctr[1]; x2[l] = c2+(unsigned int)(j+l); x3[l] = rng->ctr[3];
+    }
+    for (round=0; round<10; round++) {
+      for (l=0; l<FLUO_RNG_LANES; l++) {
+        unsigned long long p0 = (unsigned long long)FLUO_PHILOX_M0*x0[l];
+        unsigned long long p1 = (unsigned long long)FLUO_PHILOX_M1*x2[l];
+        x0[l] = (unsigned int)(p1 >> 32) ^ x1[l] ^ k0;
+        x1[l] = (unsigned int)p1;
+        x2[l] = (unsigned int)(p0 >> 32) ^ x3[l] ^ k1;
+        x3[l] = (unsigned int)p0;
+      }
+      k0 += FLUO_PHILOX_W0; k1 += FLUO_PHILOX_W1;
+    }
+    for (l=0; l<FLUO_RNG_LANES; l++) {
+      r[i+2*(j+l)]   = FLUO_RNG_DOUBLE(x0[l], x1[l]);
+      r[i+2*(j+l)+1] = FLUO_RNG_DOUBLE(x2[l], x3[l]);
+    }
+  }
+  for (; j<nb; j++) {
+    unsigned int out[4];
+    fluo_philox(rng->ctr[0], rng->ctr[1], c2+(unsigned int)j, rng->ctr[3], rng->key[0], rng->key[1], out);
+    r[i+2*j]   = FLUO_RNG_DOUBLE(out[0], out[1]);
+    r[i+2*j+1] = FLUO_RNG_DOUBLE(out[2], out[3]);
+  }
+  rng->ctr[2] = c2 + (unsigned int)nb;
+  for (i += 2*nb; i<n; i++) r[i] = fluo_rng_uniform(rng);
+} // fluo_rng_uniform_n
+
+double fluo_rng_normal(struct fluo_rng_struct *rng)
+{
+  double u = fluo_rng_uniform(rng);
+
+  return sqrt(-2*log(1-u))*cos(2*PI*fluo_rng_uniform(rng));
+} // fluo_rng_normal
+
 /* XRMC_CrossSections: Compute interaction cross sections in [barn/atom]
  * Return total cross section, given Z and E0:
  *   total_xs = XRMC_CrossSections(Z, E0, xs[3]);
@@ -16,8 +147,9 @@ double XRMC_CrossSections(int Z, double E0, double *xs) {
 
   if (xs == NULL) return 0;
 
-  // loop on possible fluorescence lines
-  for (i_line=0; i_line<XRAYLIB_LINES_MAX; i_line++) {
+  // loop on possible fluorescence lines (line 0 is KA_LINE, sum of KL1..KL3)
+  xs[FLUORESCENCE] = 0;
+  for (i_line=1; i_line<=XRAYLIB_LINES_MAX; i_line++) {
     // cumulative sum of the line cross sections
     xs[FLUORESCENCE] += CSb_FluorLine(Z, -i_line, E0, NULL); /* XRayLib */
   }
@@ -35,9 +167,9 @@ double XRMC_CrossSections(int Z, double E0, double *xs) {
  * index is returned within 0 and N-1
  * The x_arr must be a continuously increasing cumulated sum, which last element is the max
  */
-int XRMC_SelectFromDistribution(double x_arr[], int N)
+int XRMC_SelectFromDistribution(double x_arr[], int N, struct fluo_rng_struct *rng)
 {
-  double x=rand01()*x_arr[N-1];
+  double x=fluo_rand01(rng)*x_arr[N-1];
   if (x<x_arr[0]) {    // x is smaller than lower limit
     return 0;
   }
@@ -55,49 +187,766 @@ int XRMC_SelectFromDistribution(double x_arr[], int N)
   return id;
 } // XRMC_SelectFromDistribution
 
-/* XRMC_SelectInteraction: select interaction type Fluo/Compton/Rayleigh/powder
- * Return the interaction type from a random choice within cross sections 'xs'
- *   type = XRMC_SelectInteraction(xs[3]);
- * 'xs' is computed with XRMC_CrossSections.
- * type is one of FLUORESCENCE | RAYLEIGH | COMPTON | POWDER
- */
-int XRMC_SelectInteraction(double *xs)
-{
-  double sum_xs, cum_xs[5];
-  int    i;
-
-  cum_xs[0]=sum_xs=0;
-  for (i=0; i< 4; i++) {
-    sum_xs += xs[i];
-    cum_xs[i+1]= sum_xs;
-  }
-  return XRMC_SelectFromDistribution(cum_xs, 5);
-} // XRMC_SelectInteraction
-
 /* XRMC_SelectFluorescenceEnergy: select outgoing fluo photon energy, when incoming with 'E0'
  *   Ef = XRMC_SelectFluorescenceEnergy(Z, E0, &dE);
  */
-double XRMC_SelectFluorescenceEnergy(int Z, double E0, double *dE)
+double XRMC_SelectFluorescenceEnergy(int Z, double E0, double *dE, struct fluo_rng_struct *rng)
 {
   int i_line;
   double sum_xs, cum_xs_lines[XRAYLIB_LINES_MAX+1];
 
-  // compute cumulated XS for all fluo lines
+  // compute cumulated XS for all fluo lines (line 0 is KA_LINE, sum of KL1..KL3)
   cum_xs_lines[0] = sum_xs = 0;
-  for (i_line=0; i_line<XRAYLIB_LINES_MAX; i_line++) { // loop on fluorescent lines
+  for (i_line=1; i_line<=XRAYLIB_LINES_MAX; i_line++) { // loop on fluorescent lines
     double xs = CSb_FluorLine(Z, -i_line, E0, NULL); /* XRayLib */
     // when a line is inactive: E=xs=0
     sum_xs += xs;
-    cum_xs_lines[i_line+1] = sum_xs; // cumulative sum of their cross sections
+    cum_xs_lines[i_line] = sum_xs; // cumulative sum of their cross sections
   }
   // select randomly one of these lines
-  i_line = XRMC_SelectFromDistribution(cum_xs_lines, XRAYLIB_LINES_MAX); // extract a line
+  i_line = 1+XRMC_SelectFromDistribution(cum_xs_lines, XRAYLIB_LINES_MAX+1, rng); // extract a line
   // get the K shell line width as approximation of fluorescence line width
   if (dE) *dE = AtomicLevelWidth(Z, K_SHELL, NULL); // keV
 
   return LineEnergy(Z, -i_line, NULL); // fluorescent line energy
 } // XRMC_SelectFluorescenceEnergy
 
+int fluo_double_compare(void const *a, void const *b)
+{
+  double s = *(double const*)a - *(double const*)b;
+
+  if (!s) return 0;
+  else    return (s < 0 ? -1 : 1);
+} // fluo_double_compare
+
+/* fluo_get_edges: get the sorted absorption edge energies of element Z [keV]
+ *   nb = fluo_get_edges(Z, edges[FLUO_SHELL_MAX]);
+ */
+int fluo_get_edges(int Z, double *edges)
+{
+  int shell, i, nb=0;
+
+  for (shell=K_SHELL; shell<FLUO_SHELL_MAX; shell++) {
+    double e = EdgeEnergy(Z, shell, NULL); /* XRayLib, 0 when not defined */
+    if (e > 0) edges[nb++] = e;
+  }
+  qsort(edges, nb, sizeof(double), fluo_double_compare);
+  // remove duplicates
+  for (i=1, shell=1; i<nb; i++)
+    if (edges[i] != edges[shell-1]) edges[shell++] = edges[i];
+
+  return nb ? shell : 0;
+} // fluo_get_edges
+
+/* Threads ================================================================== */
+
+#ifdef _OPENMP
+#include <omp.h>
+
+static int fluo_thread_slots = 0; /* per-thread slots, set by fluo_thread_max */
+#endif
+
+/* fluo_thread_max: number of per-thread slots to allocate, 1 without OpenMP */
+int fluo_thread_max(void)
+{
+#ifdef _OPENMP
+  if (!fluo_thread_slots) {
+    int limit = omp_get_thread_limit();
+    fluo_thread_slots = omp_get_max_threads();
+    if (omp_get_num_procs() > fluo_thread_slots) fluo_thread_slots = omp_get_num_procs();
+    if (limit > fluo_thread_slots && limit <= FLUO_THREAD_LIMIT) fluo_thread_slots = limit;
+  }
+  return fluo_thread_slots;
+#else
+  return 1;
+#endif
+} // fluo_thread_max
+
+/* fluo_thread_id: index of the calling thread, 0 without OpenMP */
+int fluo_thread_id(void)
+{
+#ifdef _OPENMP
+  int id = omp_get_thread_num();
+  if (id >= fluo_thread_max())
+    exit(fprintf(stderr, "%s: ERROR: thread %d has no state slot (%d allocated at initialisation)\n",
+      __FILE__, id, fluo_thread_slots));
+  return id;
+#else
+  return 0;
+#endif
+} // fluo_thread_id
+
+/* Tabulated compound cross sections ======================================== */
+
+#define FLUO_XS_ROW(table, j) ((table)->data + (long)(j)*(table)->stride)
+
+/* fluo_xs_compound: direct xraylib computation, same output as fluo_xs_table_eval */
+double fluo_xs_compound(struct fluo_xs_table_struct *table, double E, double *xs,
+  double *cum_fluo, double *cum_Rayleigh, double *cum_Compton)
+{
+  int    i_Z;
+  double sigma=0;
+
+  cum_fluo[0] = cum_Rayleigh[0] = cum_Compton[0] = 0;
+  for (i_Z=0; i_Z< table->nElements; i_Z++) {
+    int    Z   = table->Z[i_Z];
+    double frac= table->frac[i_Z];
+    double xs_Z[3];
+
+    XRMC_CrossSections(Z, E, xs_Z); // [barn/atom]
+    sigma              += frac*CSb_Total(Z, E, NULL); // Photo+Compton+Rayleigh
+    cum_fluo[i_Z+1]     = cum_fluo[i_Z]    +frac*xs_Z[FLUORESCENCE];
+    cum_Rayleigh[i_Z+1] = cum_Rayleigh[i_Z]+frac*xs_Z[RAYLEIGH];
+    cum_Compton[i_Z+1]  = cum_Compton[i_Z] +frac*xs_Z[COMPTON];
+  }
+  if (xs) {
+    xs[FLUORESCENCE] = cum_fluo[table->nElements];
+    xs[RAYLEIGH]     = cum_Rayleigh[table->nElements];
+    xs[COMPTON]      = cum_Compton[table->nElements];
+  }
+  return sigma;
+} // fluo_xs_compound
+
+/* fluo_xs_table_row: compute a table row at energy E (fluo|Rayleigh|Compton|total) */
+void fluo_xs_table_row(struct fluo_xs_table_struct *table, double E, double *row)
+{
+  int n1 = table->nElements+1;
+  row[3*n1] = fluo_xs_compound(table, E, NULL, row, row+n1, row+2*n1);
+} // fluo_xs_table_row
+
+/* fluo_xs_table_deviation: max relative difference between two rows.
+ * Cumulated values are compared relative to their process total.
+ */
+double fluo_xs_table_deviation(struct fluo_xs_table_struct *table, double *ref, double *val)
+{
+  int    n1 = table->nElements+1, k, i;
+  double dev= 0;
+
+  for (k=0; k<=3; k++) {
+    int    last = (k < 3 ? (k+1)*n1-1 : 3*n1);
+    double norm = ref[last];
+    if (norm <= 0) continue;
+    for (i=(k < 3 ? k*n1+1 : last); i<=last; i++) {
+      double d = fabs(val[i]-ref[i])/norm;
+      if (d > dev) dev = d;
+    }
+  }
+  return dev;
+} // fluo_xs_table_deviation
+
+/* fluo_xs_table_flag: tells if interval j must be computed directly */
+char fluo_xs_table_flag(struct fluo_xs_table_struct *table, long j)
+{
+  double E0 = exp((table->i_min+j)  *table->dlogE);
+  double E1 = exp((table->i_min+j+1)*table->dlogE);
+  double *ref = table->check_row, *val = table->check_row+table->stride;
+  double *r0  = FLUO_XS_ROW(table, j), *r1 = r0+table->stride;
+  int    i;
+
+  // intervals containing an absorption edge are not interpolated
+  for (i=0; i<table->nb_edges; i++)
+    if (table->edges[i] >= E0 && table->edges[i] <= E1) return 1;
+
+  // compare interpolation at the interval mid-point with the direct value
+  fluo_xs_table_row(table, exp((table->i_min+j+0.5)*table->dlogE), ref);
+  for (i=0; i<table->stride; i++) val[i] = (r0[i]+r1[i])/2;
+
+  return (fluo_xs_table_deviation(table, ref, val) > table->tolerance);
+} // fluo_xs_table_flag
+
+/* fluo_xs_table_extend: make the table cover [Emin:Emax], keeping existing points.
+ * Return the number of added points.
+ */
+long fluo_xs_table_extend(struct fluo_xs_table_struct *table, double Emin, double Emax)
+{
+  long   i_min, i_max, nE, shift=0, j;
+  long   old_nE = table->nE;
+  double *data;
+  char   *exact;
+
+  if (Emin < FLUO_XS_TABLE_EMIN) Emin = FLUO_XS_TABLE_EMIN;
+  if (Emax > FLUO_XS_TABLE_EMAX) Emax = FLUO_XS_TABLE_EMAX;
+  if (Emin >= Emax || table->mapped) return 0; // a shared table is read-only
+
+  i_min = (long)floor(log(Emin)/table->dlogE);
+  i_max = (long)ceil (log(Emax)/table->dlogE);
+  if (old_nE) {
+    if (table->i_min < i_min)          i_min = table->i_min;
+    if (table->i_min+old_nE-1 > i_max) i_max = table->i_min+old_nE-1;
+    shift = table->i_min - i_min;
+  }
+  nE = i_max - i_min + 1;
+  if (nE <= old_nE) return 0;
+
+  data  = calloc(nE*table->stride, sizeof(double));
+  exact = calloc(nE, sizeof(char));
+  if (!data || !exact)
+    exit(fprintf(stderr, "%s: ERROR: can not allocate cross-section table (%ld points)\n",
+      __FILE__, nE));
+  if (old_nE) {
+    memcpy(data+shift*table->stride, table->data, old_nE*table->stride*sizeof(double));
+    memcpy(exact+shift, table->exact, old_nE-1);
+    free(table->data);
+    free(table->exact);
+  }
+  table->data  = data;
+  table->exact = exact;
+  table->i_min = i_min;
+  table->nE    = nE;
+
+  // compute new points, then flag new intervals
+  for (j=0; j<nE; j++) {
+    if (old_nE && j >= shift && j < shift+old_nE) continue;
+    fluo_xs_table_row(table, exp((i_min+j)*table->dlogE), FLUO_XS_ROW(table, j));
+  }
+  for (j=0; j<nE-1; j++) {
+    if (old_nE && j >= shift && j < shift+old_nE-1) continue;
+    exact[j] = fluo_xs_table_flag(table, j);
+  }
+  table->nb_extend++;
+
+  return nE-old_nE;
+} // fluo_xs_table_extend
+
+/* fluo_xs_table_init: set-up cross-section table for a compound.
+ * When Emin<Emax the table is built for that range [keV], else it is built and
+ * extended lazily around looked-up energies. tolerance<=0 disables the table.
+ */
+int fluo_xs_table_init(struct fluo_xs_table_struct *table, struct compoundData *compound,
+  double Emin, double Emax, double tolerance, int check)
+{
+  int    i_Z, i;
+  double edges[FLUO_SHELL_MAX];
+
+  memset(table, 0, sizeof(struct fluo_xs_table_struct));
+  table->nElements = compound->nElements;
+  table->stride    = 3*(table->nElements+1)+1;
+  table->tolerance = tolerance;
+  table->check     = check;
+  table->Z         = calloc(table->nElements, sizeof(int));
+  table->frac      = calloc(table->nElements, sizeof(double));
+  table->check_row = calloc(2*table->stride,  sizeof(double));
+  table->edges     = calloc(table->nElements*FLUO_SHELL_MAX, sizeof(double));
+  table->nb_threads= fluo_thread_max();
+  table->thread    = calloc(table->nb_threads, sizeof(struct fluo_xs_table_thread));
+  if (!table->Z || !table->frac || !table->check_row || !table->edges || !table->thread)
+    exit(fprintf(stderr, "%s: ERROR: can not allocate cross-section table\n", __FILE__));
+  for (i=0; i<table->nb_threads; i++) {
+    table->thread[i].check_row = calloc(2*table->stride, sizeof(double));
+    if (!table->thread[i].check_row)
+      exit(fprintf(stderr, "%s: ERROR: can not allocate cross-section table\n", __FILE__));
+  }
+
+  // gather elements and all their absorption edges
+  for (i_Z=0; i_Z< table->nElements; i_Z++) {
+    int nb;
+    table->Z[i_Z]    = compound->Elements[i_Z];
+    table->frac[i_Z] = compound->massFractions[i_Z];
+    nb = fluo_get_edges(table->Z[i_Z], edges);
+    for (i=0; i<nb; i++) table->edges[table->nb_edges++] = edges[i];
+  }
+  qsort(table->edges, table->nb_edges, sizeof(double), fluo_double_compare);
+
+  if (tolerance <= 0) return 0;
+
+  // step from the linear interpolation error of a E^-3 law: 9/8*dlogE^2, with margin
+  table->dlogE = sqrt(8*tolerance/9)/2;
+  if (table->dlogE > FLUO_XS_TABLE_DLOGE_MAX) table->dlogE = FLUO_XS_TABLE_DLOGE_MAX;
+  if (table->dlogE < FLUO_XS_TABLE_DLOGE_MIN) table->dlogE = FLUO_XS_TABLE_DLOGE_MIN;
+
+#ifdef _OPENMP
+  // no lazy extension when threads share the table: build it all now
+  if (!(Emin > 0 && Emax > Emin)) {
+    Emin = FLUO_XS_TABLE_EMIN;
+    Emax = FLUO_XS_TABLE_EMAX;
+  }
+#endif
+  // under MPI, the node leader builds the table and the other ranks map it
+  if (Emin > 0 && Emax > Emin) {
+    if (!fluo_node_rank(NULL)) fluo_xs_table_extend(table, Emin, Emax);
+    if (!fluo_xs_table_share(table)) fluo_xs_table_extend(table, Emin, Emax);
+  }
+
+  return table->nE;
+} // fluo_xs_table_init
+
+/* fluo_xs_table_eval: get cross sections for energy E [keV]
+ *   sigma = fluo_xs_table_eval(table, E, xs, cum_fluo, cum_Rayleigh, cum_Compton);
+ * fills xs[FLUORESCENCE|RAYLEIGH|COMPTON] and cumulated arrays [nElements+1].
+ * Returns the total cross section (photo+Rayleigh+Compton) [barn/atom].
+ */
+double fluo_xs_table_eval(struct fluo_xs_table_struct *table, double E, double *xs,
+  double *cum_fluo, double *cum_Rayleigh, double *cum_Compton)
+{
+  int    n1 = table->nElements+1, i;
+  long   j;
+  double u, t, sigma, *r0, *r1;
+  struct fluo_xs_table_thread *thread = &table->thread[fluo_thread_id()];
+
+  thread->nb_lookup++;
+  if (table->tolerance <= 0 || E <= 0)
+    return fluo_xs_compound(table, E, xs, cum_fluo, cum_Rayleigh, cum_Compton);
+
+  u = log(E)/table->dlogE - table->i_min;
+  j = (long)floor(u);
+#ifndef _OPENMP
+  if (!table->nE || j < 0 || j >= table->nE-1) {
+    // lazy extension of the table around E
+    fluo_xs_table_extend(table, E/FLUO_XS_TABLE_MARGIN, E*FLUO_XS_TABLE_MARGIN);
+    u = log(E)/table->dlogE - table->i_min;
+    j = (long)floor(u);
+  }
+#endif
+  if (j < 0 || j >= table->nE-1 || table->exact[j]) {
+    // out of range or close to an edge
+    thread->nb_direct++;
+    return fluo_xs_compound(table, E, xs, cum_fluo, cum_Rayleigh, cum_Compton);
+  }
+
+  // linear interpolation in log-energy
+  t  = u - j;
+  r0 = FLUO_XS_ROW(table, j);
+  r1 = r0 + table->stride;
+  for (i=0; i<n1; i++) {
+    cum_fluo[i]     = r0[i]      + t*(r1[i]     -r0[i]);
+    cum_Rayleigh[i] = r0[n1+i]   + t*(r1[n1+i]  -r0[n1+i]);
+    cum_Compton[i]  = r0[2*n1+i] + t*(r1[2*n1+i]-r0[2*n1+i]);
+  }
+  sigma = r0[3*n1] + t*(r1[3*n1]-r0[3*n1]);
+  if (xs) {
+    xs[FLUORESCENCE] = cum_fluo[n1-1];
+    xs[RAYLEIGH]     = cum_Rayleigh[n1-1];
+    xs[COMPTON]      = cum_Compton[n1-1];
+  }
+
+  if (table->check) {
+    // compare with direct xraylib values
+    double *ref = thread->check_row, *val = thread->check_row+table->stride, dev;
+    fluo_xs_table_row(table, E, ref);
+    for (i=0; i<n1; i++) {
+      val[i] = cum_fluo[i]; val[n1+i] = cum_Rayleigh[i]; val[2*n1+i] = cum_Compton[i];
+    }
+    val[3*n1] = sigma;
+    dev = fluo_xs_table_deviation(table, ref, val);
+    if (dev > thread->check_maxdev) thread->check_maxdev = dev;
+    if (dev > table->tolerance)     thread->nb_check_fail++;
+  }
+
+  return sigma;
+} // fluo_xs_table_eval
+
+void fluo_xs_table_report(struct fluo_xs_table_struct *table, char *compname)
+{
+  long   nb_lookup=0, nb_direct=0, nb_check_fail=0;
+  double check_maxdev=0;
+  int    i;
+
+  if (!table || table->tolerance <= 0) return;
+  // sum per-thread counters
+  for (i=0; i<table->nb_threads; i++) {
+    nb_lookup     += table->thread[i].nb_lookup;
+    nb_direct     += table->thread[i].nb_direct;
+    nb_check_fail += table->thread[i].nb_check_fail;
+    if (table->thread[i].check_maxdev > check_maxdev)
+      check_maxdev = table->thread[i].check_maxdev;
+  }
+  if (!nb_lookup) return;
+  MPI_MASTER(
+    printf("%s: cross-section table: %ld points in [%g:%g] keV (%ld extensions), "
+      "%ld lookups, %.3g %% computed directly\n",
+      compname, table->nE,
+      table->nE ? exp(table->i_min*table->dlogE) : 0,
+      table->nE ? exp((table->i_min+table->nE-1)*table->dlogE) : 0,
+      table->nb_extend, nb_lookup, 100.0*nb_direct/nb_lookup);
+    if (table->check)
+      printf("%s: cross-section table: max deviation %g, %ld lookups above tolerance %g\n",
+        compname, check_maxdev, nb_check_fail, table->tolerance);
+  );
+} // fluo_xs_table_report
+
+void fluo_xs_table_free(struct fluo_xs_table_struct *table)
+{
+  if (!table) return;
+  free(table->Z);     free(table->frac);
+  if (table->mapped) fluo_node_unmap(table->map, table->mapped);
+  else { free(table->data); free(table->exact); }
+  free(table->edges); free(table->check_row);
+  if (table->thread) {
+    int i;
+    for (i=0; i<table->nb_threads; i++) free(table->thread[i].check_row);
+    free(table->thread);
+  }
+  memset(table, 0, sizeof(struct fluo_xs_table_struct));
+} // fluo_xs_table_free
+
+/* Alias sampling of discrete distributions (Walker/Vose) =================== */
+
+/* fluo_alias_init: build alias table from 'n' (un-normalised) weights 'w'
+ *   fluo_alias_init(n, w[n], prob[n], alias[n]);
+ */
+void fluo_alias_init(int n, double *w, double *prob, int *alias)
+{
+  int    *small, *large;
+  int    i, nb_small=0, nb_large=0;
+  double sum=0;
+
+  if (n <= 0) return;
+  small = malloc(n*sizeof(int));
+  large = malloc(n*sizeof(int));
+  if (!small || !large)
+    exit(fprintf(stderr, "%s: ERROR: can not allocate alias table (%i)\n", __FILE__, n));
+
+  for (i=0; i<n; i++) sum += w[i];
+  // scaled probabilities, with mean 1
+  for (i=0; i<n; i++) {
+    prob[i]  = (sum > 0 ? w[i]*n/sum : 1);
+    alias[i] = i;
+    if (prob[i] < 1) small[nb_small++] = i;
+    else             large[nb_large++] = i;
+  }
+  // fill each under-populated column with an over-populated one
+  while (nb_small && nb_large) {
+    int s = small[--nb_small];
+    int l = large[--nb_large];
+    alias[s] = l;
+    prob[l] -= 1-prob[s];
+    if (prob[l] < 1) small[nb_small++] = l;
+    else             large[nb_large++] = l;
+  }
+  // remaining columns are full (up to rounding errors)
+  while (nb_large) prob[large[--nb_large]] = 1;
+  while (nb_small) prob[small[--nb_small]] = 1;
+
+  free(small); free(large);
+} // fluo_alias_init
+
+/* fluo_alias_select: O(1) random index within 0 and n-1
+ *   index = fluo_alias_select(n, prob, alias);
+ */
+int fluo_alias_select(int n, double *prob, int *alias, struct fluo_rng_struct *rng)
+{
+  double u = fluo_rand01(rng)*n;
+  int    i = (int)u;
+
+  if (i >= n) i = n-1;
+  return (u-i < prob[i] ? i : alias[i]);
+} // fluo_alias_select
+
+/* Fluorescence lines per element and excitation regime ===================== */
+
+/* fluo_line_width: line width from the levels which best match its energy.
+ * XRayLib does not expose the shells of a line, so we search the level pair
+ * whose edge difference gives the line energy. Fall back to the K level width.
+ */
+double fluo_line_width(double energy, double *edge, double *width)
+{
+  int    i, j;
+  double best=-1, w=width[K_SHELL];
+
+  for (i=0; i<FLUO_SHELL_MAX; i++) {
+    if (edge[i] <= 0) continue;
+    for (j=i+1; j<FLUO_SHELL_MAX; j++) {
+      double d;
+      if (edge[j] <= 0) continue;
+      d = fabs(edge[i]-edge[j]-energy);
+      if (best < 0 || d < best) { best = d; w = width[i]+width[j]; }
+    }
+  }
+  if (best < 0 || best > FLUO_LINES_MATCH*energy) w = width[K_SHELL];
+  return w;
+} // fluo_line_width
+
+/* fluo_lines_init: tabulate fluorescence lines of element Z for all regimes
+ * Return the total number of active lines.
+ */
+int fluo_lines_init(struct fluo_lines_struct *lines, int Z)
+{
+  double edges[FLUO_SHELL_MAX], level_edge[FLUO_SHELL_MAX], level_width[FLUO_SHELL_MAX];
+  double xs[XRAYLIB_LINES_MAX+1];
+  int    line[XRAYLIB_LINES_MAX+1];
+  int    k, shell, total=0;
+
+  memset(lines, 0, sizeof(struct fluo_lines_struct));
+  lines->Z          = Z;
+  lines->nb_regimes = fluo_get_edges(Z, edges);
+  if (!lines->nb_regimes) return 0;
+  lines->regime     = calloc(lines->nb_regimes, sizeof(struct fluo_lines_regime_struct));
+  if (!lines->regime)
+    exit(fprintf(stderr, "%s: ERROR: can not allocate fluorescence lines for Z=%i\n", __FILE__, Z));
+
+  // level energies and widths, used to identify the shells of each line
+  for (shell=K_SHELL; shell<FLUO_SHELL_MAX; shell++) {
+    level_edge[shell]  = EdgeEnergy(Z, shell, NULL);       /* XRayLib */
+    level_width[shell] = AtomicLevelWidth(Z, shell, NULL); /* XRayLib */
+  }
+
+  for (k=0; k<lines->nb_regimes; k++) {
+    struct fluo_lines_regime_struct *r = &lines->regime[k];
+    // line ratios within a regime are evaluated at its (geometric) centre
+    double E = (k < lines->nb_regimes-1 ? sqrt(edges[k]*edges[k+1])
+                                        : edges[k]*FLUO_LINES_TOP_RATIO);
+    int    i_line, n=0;
+
+    r->Emin = edges[k];
+    // line 0 is KA_LINE which sums KL1..KL3: only use IUPAC lines
+    for (i_line=1; i_line<=XRAYLIB_LINES_MAX; i_line++) {
+      double x = CSb_FluorLine(Z, -i_line, E, NULL); /* XRayLib */
+      // when a line is inactive: E=xs=0
+      if (x > 0) { xs[n] = x; line[n] = -i_line; n++; }
+    }
+    r->count = n;
+    if (!n) continue;
+    r->energy = malloc(n*sizeof(double));
+    r->width  = malloc(n*sizeof(double));
+    r->prob   = malloc(n*sizeof(double));
+    r->alias  = malloc(n*sizeof(int));
+    if (!r->energy || !r->width || !r->prob || !r->alias)
+      exit(fprintf(stderr, "%s: ERROR: can not allocate fluorescence lines for Z=%i\n", __FILE__, Z));
+    for (i_line=0; i_line<n; i_line++) {
+      r->energy[i_line] = LineEnergy(Z, line[i_line], NULL); /* XRayLib */
+      r->width[i_line]  = fluo_line_width(r->energy[i_line], level_edge, level_width);
+    }
+    fluo_alias_init(n, xs, r->prob, r->alias);
+    total += n;
+  }
+
+  return total;
+} // fluo_lines_init
+
+/* fluo_lines_select: select outgoing fluo photon energy, when incoming with 'E0'
+ *   Ef = fluo_lines_select(lines, E0, &dE);
+ * Same as XRMC_SelectFluorescenceEnergy, without any XRayLib call.
+ * dE is the line width (FWHM) [keV]. Return 0 when no line is excited.
+ */
+double fluo_lines_select(struct fluo_lines_struct *lines, double E0, double *dE,
+  struct fluo_rng_struct *rng)
+{
+  int lo=0, hi=lines->nb_regimes-1, i;
+  struct fluo_lines_regime_struct *r;
+
+  if (dE) *dE = 0;
+  if (!lines->nb_regimes || E0 < lines->regime[0].Emin) return 0;
+
+  // last regime with Emin <= E0
+  while (lo < hi) {
+    int im = (lo + hi + 1)/2;
+    if (lines->regime[im].Emin <= E0) lo=im;
+    else hi=im-1;
+  }
+  r = &lines->regime[lo];
+  if (!r->count) return 0;
+
+  i = fluo_alias_select(r->count, r->prob, r->alias, rng);
+  if (dE) *dE = r->width[i];
+  return r->energy[i];
+} // fluo_lines_select
+
+void fluo_lines_free(struct fluo_lines_struct *lines)
+{
+  int k;
+
+  if (!lines) return;
+  for (k=0; k<lines->nb_regimes; k++) {
+    struct fluo_lines_regime_struct *r = &lines->regime[k];
+    free(r->energy); free(r->width); free(r->prob); free(r->alias);
+  }
+  free(lines->regime);
+  memset(lines, 0, sizeof(struct fluo_lines_struct));
+} // fluo_lines_free
+
+/* Keyed caches for SPLIT and repeated energies ============================= */
+
+/* fluo_cache_hash: FNV-1a hash of 'n' doubles, used to select a cache slot */
+unsigned long fluo_cache_hash(double *key, int n)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned char *b = (unsigned char*)key;
+  int i;
+
+  for (i=0; i<n*(int)sizeof(double); i++) {
+    h ^= b[i];
+    h *= 1099511628211ULL;
+  }
+  return (unsigned long)(h ^ (h >> 32));
+} // fluo_cache_hash
+
+void fluo_cache_init(struct fluo_cache_struct *cache, int nElements)
+{
+  int i, n1=nElements+1;
+
+  memset(cache, 0, sizeof(struct fluo_cache_struct));
+  cache->nElements = nElements;
+  cache->storage   = calloc(3*n1*FLUO_CACHE_SIZE, sizeof(double));
+  if (!cache->storage)
+    exit(fprintf(stderr, "%s: ERROR: can not allocate cache (%i elements)\n", __FILE__, nElements));
+  for (i=0; i<FLUO_CACHE_SIZE; i++) {
+    cache->xs[i].cum_fluo     = cache->storage + 3*n1*i;
+    cache->xs[i].cum_Rayleigh = cache->xs[i].cum_fluo + n1;
+    cache->xs[i].cum_Compton  = cache->xs[i].cum_fluo + 2*n1;
+  }
+} // fluo_cache_init
+
+/* fluo_cache_geometry: get the geometry entry for a ray
+ *   entry = fluo_cache_geometry(cache, x,y,z, kx,ky,kz, &hit);
+ * When hit is 0, the entry key is set and its values must be filled in.
+ */
+struct fluo_geometry_cache_entry *fluo_cache_geometry(struct fluo_cache_struct *cache,
+  double x, double y, double z, double kx, double ky, double kz, int *hit)
+{
+  double key[6] = { x, y, z, kx, ky, kz };
+  struct fluo_geometry_cache_entry *entry =
+    &cache->geometry[fluo_cache_hash(key, 6) % FLUO_CACHE_SIZE];
+
+  *hit = (entry->valid
+    && entry->x  == x  && entry->y  == y  && entry->z  == z
+    && entry->kx == kx && entry->ky == ky && entry->kz == kz);
+  if (*hit) cache->geometry_hit++;
+  else {
+    cache->geometry_miss++;
+    entry->valid = 1;
+    entry->x  = x;  entry->y  = y;  entry->z  = z;
+    entry->kx = kx; entry->ky = ky; entry->kz = kz;
+  }
+  return entry;
+} // fluo_cache_geometry
+
+struct fluo_split_cache_entry *fluo_cache_split(struct fluo_cache_struct *cache,
+  unsigned long long ray, double x, double y, double z, double kx, double ky, double kz, int *hit)
+{
+  struct fluo_split_cache_entry *entry = &cache->split;
+
+  *hit = (entry->valid && entry->ray == ray
+    && entry->x  == x  && entry->y  == y  && entry->z  == z
+    && entry->kx == kx && entry->ky == ky && entry->kz == kz);
+  if (!*hit) {
+    entry->valid = 0;
+    entry->ray = ray;
+    entry->x  = x;  entry->y  = y;  entry->z  = z;
+    entry->kx = kx; entry->ky = ky; entry->kz = kz;
+  }
+  return entry;
+} // fluo_cache_split
+
+/* fluo_cache_xs: get the cross-section entry for energy E [keV]
+ *   entry = fluo_cache_xs(cache, E, &hit);
+ * When hit is 0, the entry key is set and its values must be filled in.
+ * The key is the exact energy, as the reachable powder lines depend on it: only
+ * SPLIT copies, secondary events and monochromatic beams hit.
+ */
+struct fluo_xs_cache_entry *fluo_cache_xs(struct fluo_cache_struct *cache, double E, int *hit)
+{
+  struct fluo_xs_cache_entry *entry =
+    &cache->xs[fluo_cache_hash(&E, 1) % FLUO_CACHE_SIZE];
+
+  *hit = (entry->valid && entry->E == E);
+  if (*hit) cache->xs_hit++;
+  else {
+    cache->xs_miss++;
+    entry->valid = 1;
+    entry->E     = E;
+  }
+  return entry;
+} // fluo_cache_xs
+
+/* fluo_cache_report: print hit rates summed over 'nb' (per-thread) caches */
+void fluo_cache_report(struct fluo_cache_struct *cache, int nb, char *compname)
+{
+  long geometry_hit=0, nb_geometry=0, xs_hit=0, nb_xs=0;
+  int  i;
+
+  for (i=0; i<nb; i++) {
+    geometry_hit += cache[i].geometry_hit;
+    nb_geometry  += cache[i].geometry_hit + cache[i].geometry_miss;
+    xs_hit       += cache[i].xs_hit;
+    nb_xs        += cache[i].xs_hit       + cache[i].xs_miss;
+  }
+  MPI_MASTER(
+    printf("%s: cache hit rates: geometry %.3g %% (%ld), cross sections %.3g %% (%ld)\n",
+      compname,
+      nb_geometry ? 100.0*geometry_hit/nb_geometry : 0, nb_geometry,
+      nb_xs       ? 100.0*xs_hit/nb_xs : 0,             nb_xs);
+  );
+} // fluo_cache_report
+
+void fluo_cache_free(struct fluo_cache_struct *cache)
+{
+  if (!cache) return;
+  free(cache->storage);
+  memset(cache, 0, sizeof(struct fluo_cache_struct));
+} // fluo_cache_free
+
+/* Per-process tallies ====================================================== */
+
+/* fluo_tally_merge: sum 'nb' per-thread tallies into 'total' */
+void fluo_tally_merge(struct fluo_tally_struct *tally, int nb, struct fluo_tally_struct *total)
+{
+  int i, j;
+
+  memset(total, 0, sizeof(struct fluo_tally_struct));
+  for (i=0; i<nb; i++) {
+    for (j=0; j<FLUO_PROCESS_MAX; j++) {
+      total->n[j] += tally[i].n[j];
+      total->p[j] += tally[i].p[j];
+    }
+    total->events          += tally[i].events;
+    total->absorb_disabled += tally[i].absorb_disabled;
+    for (j=0; j<FLUO_ORDER_MAX; j++) total->order[j] += tally[i].order[j];
+    for (j=0; j<FLUO_TIMER_MAX; j++) total->ticks[j] += tally[i].ticks[j];
+    total->delta_real       += tally[i].delta_real;
+    total->delta_virtual    += tally[i].delta_virtual;
+    total->delta_violations += tally[i].delta_violations;
+    total->split_shared     += tally[i].split_shared;
+  }
+} // fluo_tally_merge
+
+/* Instrumentation timers =================================================== */
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FLUO_TICKS_TSC
+#endif
+
+/* fluo_ticks: a few cycles with the TSC, a clock_gettime call elsewhere */
+unsigned long long fluo_ticks(void)
+{
+#ifdef FLUO_TICKS_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+} // fluo_ticks
+
+/* fluo_ticks_per_second: measured over 10 ms, once */
+double fluo_ticks_per_second(void)
+{
+  static double rate = 0;
+  struct timespec ts;
+  double t0, t1;
+  unsigned long long c0, c1;
+
+  if (rate > 0) return rate;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t0 = ts.tv_sec + 1e-9*ts.tv_nsec;
+  c0 = fluo_ticks();
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t1 = ts.tv_sec + 1e-9*ts.tv_nsec;
+  } while (t1 - t0 < 0.01);
+  c1   = fluo_ticks();
+  rate = (c1 - c0)/(t1 - t0);
+  return rate;
+} // fluo_ticks_per_second
+
+double fluo_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+} // fluo_seconds
+
 // Function removing spaces from string
 char * removeSpacesFromStr(char *string)
 {
@@ -147,7 +996,18 @@ char *cif2hkl(const char *infile, const char *options) {
   OUTFILE = malloc(1024);
   if (!OUTFILE) return infile;
 
-  strncpy(OUTFILE, tmpnam(NULL), 1024); // create an output temporary file name
+  // create a unique output temporary file
+#ifndef _WIN32
+  {
+    int fd;
+    snprintf(OUTFILE, 1024, "%s/cif2hkl_XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    fd = mkstemp(OUTFILE);
+    if (fd < 0) { free(OUTFILE); return(NULL); }
+    close(fd);
+  }
+#else
+  strncpy(OUTFILE, tmpnam(NULL), 1024);
+#endif
 
   // try in order the CIF2HKL env var, then the system cif2hkl, then the McCode one
   if (!found && getenv("CIF2HKL")) {
@@ -280,34 +1140,453 @@ int fluo_get_material(char *filename, char *formula) {
   return(ret);
 } // fluo_get_material
 
-int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
-  struct fluo_line_data *list = NULL;
-  int    size = 0;
-  t_Table sTable; /* sample data table structure from SC_file */
-  int    i=0;
-  int    mult_count  =0;
-  char   flag=0;
-  double q_count=0, j_count=0, F2_count=0;
-  char **parsing;
-  int    list_count=0;
-  double sum_F2=0;
-  char  *filename=NULL;
+/* Reflection list readers ================================================== */
 
-  if (!SC_file || !strlen(SC_file) || !strcmp(SC_file, "NULL")) {
-    printf("PowderN: %s: Using incoherent elastic scattering only.\n",
-        info->compname);
-    info->count = 0;
-    return(0);
+#define FLUO_CIF_RE 2.8179403262 /* classical electron radius [fm] */
+
+/* fluo_hkl_append: add a character string to a growing buffer */
+static void fluo_hkl_append(char **buffer, size_t *size, size_t *len, const char *text)
+{
+  size_t n = strlen(text);
+
+  if (*len + n + 1 > *size) {
+    *size  = 2*(*len + n + 1);
+    *buffer = realloc(*buffer, *size);
+    if (!*buffer)
+      exit(fprintf(stderr, "%s: ERROR allocating reflection header\n", __FILE__));
   }
-  filename = cif2hkl(SC_file, "--mode XRA");
-  long retval = Table_Read(&sTable, filename, 1); /* read 1st block data from SC_file into sTable*/
-  if (retval<0) {
-    fprintf(stderr,"PowderN: Could not open file %s - exiting!\n", filename);
-    exit(-1);
+  memcpy(*buffer + *len, text, n+1);
+  *len += n;
+} // fluo_hkl_append
+
+/* fluo_hkl_read: read a numerical reflection list, in a single pass
+ * Rows starting with a number are data, others (e.g. '#' comments) are header.
+ * The number of columns is set by the first data row.
+ */
+long fluo_hkl_read(char *filename, struct fluo_hkl_table *table) {
+  char    line[65535];
+  size_t  header_size=0, header_len=0;
+  long    allocated=0;
+  FILE   *file;
+
+  memset(table, 0, sizeof(struct fluo_hkl_table));
+  file = Open_File(filename, "r", NULL);
+  if (!file) return -1;
+  fluo_hkl_append(&table->header, &header_size, &header_len, "");
+
+  while (fgets(line, sizeof(line), file)) {
+    double value[64];
+    char  *start = line, *end;
+    long   n=0, j;
+
+    while (isspace(*start)) start++;
+    if (!*start) continue;
+    if (!strchr("#%;/", *start))
+      for (n=0; n<64; n++) {
+        value[n] = strtod(start, &end);
+        if (end == start) break;
+        start = end;
+      }
+    if (!n) {
+      fluo_hkl_append(&table->header, &header_size, &header_len, line);
+      continue;
+    }
+    if (!table->columns) table->columns = n;
+    if (table->rows >= allocated) {
+      allocated   = allocated ? 2*allocated : 1024;
+      table->data = realloc(table->data, allocated*table->columns*sizeof(double));
+      if (!table->data)
+        exit(fprintf(stderr, "%s: ERROR allocating %li reflections from %s\n",
+          __FILE__, allocated, filename));
+    }
+    for (j=0; j<table->columns; j++)
+      table->data[table->rows*table->columns+j] = (j < n ? value[j] : 0);
+    table->rows++;
   }
+  fclose(file);
+  return table->rows;
+} // fluo_hkl_read
 
-  /* parsing of header */
-  parsing = Table_ParseHeader(sTable.header,
+void fluo_hkl_free(struct fluo_hkl_table *table) {
+  if (!table) return;
+  free(table->data);
+  free(table->header);
+  memset(table, 0, sizeof(struct fluo_hkl_table));
+} // fluo_hkl_free
+
+/* CIF tokens: whitespace separated words, quoted strings and ';' text fields.
+ * The buffer is modified in place, and tokens point into it. */
+static long fluo_cif_tokens(char *buffer, char ***tokens)
+{
+  long  nb=0, allocated=0;
+  char *c = buffer;
+  int   bol = 1; /* at beginning of line */
+
+  *tokens = NULL;
+  while (*c) {
+    char *start, *end;
+    if (*c == '\n') { bol = 1; c++; continue; }
+    if (isspace(*c)) { bol = 0; c++; continue; }
+    if (*c == '#') { while (*c && *c != '\n') c++; continue; }
+    if (*c == ';' && bol) { // text field, up to the next line starting with ';'
+      start = ++c;
+      while (*c && !(*c == ';' && c[-1] == '\n')) c++;
+      end = c;
+      if (*c) c++;
+    } else if (*c == '\'' || *c == '"') { // quote closes when followed by a blank
+      char quote = *c;
+      start = ++c;
+      while (*c && !(*c == quote && (!c[1] || isspace(c[1])))) c++;
+      end = c;
+      if (*c) c++;
+    } else {
+      start = c;
+      while (*c && !isspace(*c)) c++;
+      end = c;
+    }
+    bol = 0;
+    if (nb >= allocated) {
+      allocated = allocated ? 2*allocated : 1024;
+      *tokens   = realloc(*tokens, allocated*sizeof(char*));
+      if (!*tokens)
+        exit(fprintf(stderr, "%s: ERROR allocating CIF tokens\n", __FILE__));
+    }
+    (*tokens)[nb++] = start;
+    if (end == c && *c) { bol = (*c == '\n'); c++; }
+    *end = '\0';
+  }
+  return nb;
+} // fluo_cif_tokens
+
+/* fluo_cif_symop: parse a symmetry operator such as '-x+1/2,y,z+1/2' */
+static int fluo_cif_symop(char *text, double *op)
+{
+  int    row=0;
+  double sign=1;
+  char  *c=text;
+
+  memset(op, 0, 12*sizeof(double)); /* rotation [3][3] then translation [3] */
+  while (*c && row < 3) {
+    char l = tolower(*c);
+    if (l == ',')      { row++; sign=1; c++; }
+    else if (l == '-') { sign=-1; c++; }
+    else if (l == '+') { sign= 1; c++; }
+    else if (l >= 'x' && l <= 'z') { op[row*3+(l-'x')] += sign; sign=1; c++; }
+    else if (isdigit(l) || l == '.') {
+      char  *end;
+      double num = strtod(c, &end), den = 1;
+      if (*end == '/') den = strtod(end+1, &end);
+      if (!den) return 0;
+      op[9+row] += sign*num/den; sign=1; c = end;
+    } else c++;
+  }
+  return row == 2;
+} // fluo_cif_symop
+
+/* fluo_cif_element: atomic number from a CIF type symbol or label, e.g. Fe2+, O1 */
+static int fluo_cif_element(char *text)
+{
+  char symbol[3]={0,0,0};
+  int  Z=0;
+
+  while (*text && !isalpha(*text)) text++;
+  if (!*text) return 0;
+  symbol[0] = toupper(text[0]);
+  if (islower(text[1])) {
+    symbol[1] = text[1];
+    Z = SymbolToAtomicNumber(symbol, NULL);
+  }
+  if (Z <= 0) {
+    symbol[1] = '\0';
+    Z = SymbolToAtomicNumber(symbol, NULL);
+  }
+  return Z > 0 ? Z : 0;
+} // fluo_cif_element
+
+/* fluo_cif_value: numerical CIF value, ignoring uncertainty, or 'def' when unknown */
+static double fluo_cif_value(char *text, double def)
+{
+  char  *end;
+  double value;
+
+  if (!text || !strcmp(text, "?") || !strcmp(text, ".")) return def;
+  value = strtod(text, &end);
+  return end == text ? def : value;
+} // fluo_cif_value
+
+struct fluo_cif_line { double d, F2; };
+
+static int fluo_cif_line_compare(void const *a, void const *b)
+{
+  struct fluo_cif_line const *pa = a;
+  struct fluo_cif_line const *pb = b;
+
+  if (pa->d != pb->d) return pa->d > pb->d ? -1 : 1; // increasing q
+  return (pa->F2 > pb->F2) - (pa->F2 < pb->F2);
+} // fluo_cif_line_compare
+
+static int fluo_cif_F2_compare(void const *a, void const *b)
+{
+  struct fluo_cif_line const *pa = a;
+  struct fluo_cif_line const *pb = b;
+
+  return (pa->F2 > pb->F2) - (pa->F2 < pb->F2);
+} // fluo_cif_F2_compare
+
+/* fluo_cif_read: compute F2(hkl) from a CIF, without temporary file
+ * Equivalent positions are generated from the symmetry operators, and
+ * F(hkl) = re sum occ f0(Z,s) exp(-B s^2) exp(2i PI h.r) with s=1/2d, using the
+ * XRayLib atomic form factors. Lines with equal d and F2 are merged into
+ * their multiplicity.
+ */
+long fluo_cif_read(char *filename, struct fluo_hkl_table *table, double d_min) {
+  const char *ext = filename ? strrchr(filename, '.') : NULL;
+  char   **token=NULL, *buffer=NULL;
+  long     nb_tokens, t, size;
+  double   cell[6]={0,0,0,90,90,90};
+  double  *ops=NULL, *sites=NULL;  /* sites: Z occ B x y z, one per atom in the CIF */
+  double  *pos=NULL;               /* equivalent positions: site x y z */
+  long     nb_ops=0, nb_sites=0, nb_pos=0;
+  double   G[9], Gs[9], det, V;
+  double  *f=NULL;
+  struct fluo_cif_line *lines=NULL;
+  long     nb_lines=0, allocated=0, i, n;
+  int      h, k, l, hmax, kmax, lmax;
+  double   F2max=0;
+  FILE    *file;
+  char     text[256];
+
+  memset(table, 0, sizeof(struct fluo_hkl_table));
+  if (!ext || strcasecmp(ext, ".cif")) return 0;
+  file = Open_File(filename, "r", NULL);
+  if (!file) return 0;
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  buffer = malloc(size+1);
+  if (!buffer || fread(buffer, 1, size, file) != (size_t)size) {
+    fclose(file); free(buffer);
+    return 0;
+  }
+  buffer[size] = '\0';
+  fclose(file);
+
+  // scan the first data block: cell, symmetry operators, atom sites
+  nb_tokens = fluo_cif_tokens(buffer, &token);
+  for (t=0; t<nb_tokens; t++) {
+    char *tag = token[t];
+    if (!strncasecmp(tag, "data_", 5)) {
+      if (t) break;
+      continue;
+    }
+    if (!strcasecmp(tag, "loop_")) {
+      long nb_tags=0, first, rows, r;
+      int  col_op=-1, col_type=-1, col_label=-1, col_x=-1, col_y=-1, col_z=-1;
+      int  col_occ=-1, col_U=-1, col_B=-1;
+      for (first=t+1; first<nb_tokens && token[first][0] == '_'; first++) {
+        char *name = token[first];
+        if (!strcasecmp(name, "_symmetry_equiv_pos_as_xyz")
+         || !strcasecmp(name, "_space_group_symop_operation_xyz"))  col_op   = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_type_symbol"))        col_type = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_label"))              col_label= nb_tags;
+        else if (!strcasecmp(name, "_atom_site_fract_x"))            col_x    = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_fract_y"))            col_y    = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_fract_z"))            col_z    = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_occupancy"))          col_occ  = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_U_iso_or_equiv"))     col_U    = nb_tags;
+        else if (!strcasecmp(name, "_atom_site_B_iso_or_equiv"))     col_B    = nb_tags;
+        nb_tags++;
+      }
+      for (t=first; t<nb_tokens && token[t][0] != '_'
+        && strcasecmp(token[t], "loop_") && strncasecmp(token[t], "data_", 5); t++);
+      rows = nb_tags ? (t-first)/nb_tags : 0;
+      t--; // back on the last value
+      if (col_op >= 0 && !nb_ops) {
+        ops = calloc(rows, 12*sizeof(double));
+        for (r=0; ops && r<rows; r++)
+          if (fluo_cif_symop(token[first+r*nb_tags+col_op], ops+12*nb_ops)) nb_ops++;
+      } else if (col_x >= 0 && col_y >= 0 && col_z >= 0 && !nb_sites) {
+        sites = calloc(rows, 6*sizeof(double));
+        for (r=0; sites && r<rows; r++) {
+          char  **row = token+first+r*nb_tags;
+          double *s   = sites+6*nb_sites;
+          s[0] = col_type  >= 0 ? fluo_cif_element(row[col_type])  : 0;
+          if (!s[0] && col_label >= 0) s[0] = fluo_cif_element(row[col_label]);
+          if (!s[0]) continue;
+          s[1] = col_occ >= 0 ? fluo_cif_value(row[col_occ], 1) : 1;
+          s[2] = col_B   >= 0 ? fluo_cif_value(row[col_B],   0) : 0;
+          if (col_U >= 0) s[2] = 8*PI*PI*fluo_cif_value(row[col_U], 0);
+          s[3] = fluo_cif_value(row[col_x], 0);
+          s[4] = fluo_cif_value(row[col_y], 0);
+          s[5] = fluo_cif_value(row[col_z], 0);
+          nb_sites++;
+        }
+      }
+      continue;
+    }
+    if (t+1 < nb_tokens) {
+      if      (!strcasecmp(tag, "_cell_length_a"))    cell[0] = fluo_cif_value(token[++t], 0);
+      else if (!strcasecmp(tag, "_cell_length_b"))    cell[1] = fluo_cif_value(token[++t], 0);
+      else if (!strcasecmp(tag, "_cell_length_c"))    cell[2] = fluo_cif_value(token[++t], 0);
+      else if (!strcasecmp(tag, "_cell_angle_alpha")) cell[3] = fluo_cif_value(token[++t], 90);
+      else if (!strcasecmp(tag, "_cell_angle_beta"))  cell[4] = fluo_cif_value(token[++t], 90);
+      else if (!strcasecmp(tag, "_cell_angle_gamma")) cell[5] = fluo_cif_value(token[++t], 90);
+    }
+  }
+  free(token);
+  free(buffer);
+
+  if (!nb_ops || !nb_sites || cell[0] <= 0 || cell[1] <= 0 || cell[2] <= 0 || d_min <= 0) {
+    MPI_MASTER(
+    printf("%s: INFO: %s has no cell/symmetry operators/atom sites. Using cif2hkl.\n",
+      __FILE__, filename);
+    );
+    free(ops); free(sites);
+    return 0;
+  }
+
+  // generate the distinct equivalent positions of each site, in the unit cell
+  pos = calloc(nb_ops*nb_sites, 4*sizeof(double));
+  if (!pos)
+    exit(fprintf(stderr, "%s: ERROR allocating CIF positions (%s)\n", __FILE__, filename));
+  for (i=0; i<nb_sites; i++) {
+    long first = nb_pos, o;
+    double *s = sites+6*i;
+    for (o=0; o<nb_ops; o++) {
+      double *op = ops+12*o, r[3];
+      long    p;
+      int     c;
+      for (c=0; c<3; c++) {
+        r[c] = op[3*c]*s[3] + op[3*c+1]*s[4] + op[3*c+2]*s[5] + op[9+c];
+        r[c] -= floor(r[c]);
+      }
+      for (p=first; p<nb_pos; p++) {
+        double dx = fabs(pos[4*p+1]-r[0]), dy = fabs(pos[4*p+2]-r[1]), dz = fabs(pos[4*p+3]-r[2]);
+        if (fmin(dx, 1-dx) < 1e-3 && fmin(dy, 1-dy) < 1e-3 && fmin(dz, 1-dz) < 1e-3) break;
+      }
+      if (p < nb_pos) continue;
+      pos[4*nb_pos] = i; pos[4*nb_pos+1] = r[0]; pos[4*nb_pos+2] = r[1]; pos[4*nb_pos+3] = r[2];
+      nb_pos++;
+    }
+  }
+
+  // direct and reciprocal metric tensors
+  {
+    double ca=cos(cell[3]*DEG2RAD), cb=cos(cell[4]*DEG2RAD), cg=cos(cell[5]*DEG2RAD);
+    G[0] = cell[0]*cell[0];    G[1] = cell[0]*cell[1]*cg; G[2] = cell[0]*cell[2]*cb;
+    G[3] = G[1];               G[4] = cell[1]*cell[1];    G[5] = cell[1]*cell[2]*ca;
+    G[6] = G[2];               G[7] = G[5];               G[8] = cell[2]*cell[2];
+  }
+  det = G[0]*(G[4]*G[8]-G[5]*G[7]) - G[1]*(G[3]*G[8]-G[5]*G[6]) + G[2]*(G[3]*G[7]-G[4]*G[6]);
+  if (det <= 0)
+    exit(fprintf(stderr, "%s: ERROR invalid cell in %s\n", __FILE__, filename));
+  V = sqrt(det);
+  Gs[0] = (G[4]*G[8]-G[5]*G[7])/det; Gs[1] = (G[2]*G[7]-G[1]*G[8])/det; Gs[2] = (G[1]*G[5]-G[2]*G[4])/det;
+  Gs[3] = Gs[1];                     Gs[4] = (G[0]*G[8]-G[2]*G[6])/det; Gs[5] = (G[2]*G[3]-G[0]*G[5])/det;
+  Gs[6] = Gs[2];                     Gs[7] = Gs[5];                     Gs[8] = (G[0]*G[4]-G[1]*G[3])/det;
+
+  // structure factors for all hkl with d > d_min
+  f    = calloc(nb_sites, sizeof(double));
+  hmax = (int)(cell[0]/d_min); kmax = (int)(cell[1]/d_min); lmax = (int)(cell[2]/d_min);
+  for (h=-hmax; h<=hmax; h++)
+  for (k=-kmax; k<=kmax; k++)
+  for (l=-lmax; l<=lmax; l++) {
+    double inv_d2 = h*h*Gs[0] + k*k*Gs[4] + l*l*Gs[8] + 2*(h*k*Gs[1] + h*l*Gs[2] + k*l*Gs[5]);
+    double s, Fr=0, Fi=0;
+    if ((!h && !k && !l) || inv_d2*d_min*d_min > 1) continue;
+    s = sqrt(inv_d2)/2; /* sin(theta)/lambda */
+    for (i=0; i<nb_sites; i++) {
+      double *site = sites+6*i;
+      f[i] = site[1]*FF_Rayl((int)site[0], s, NULL)*exp(-site[2]*s*s);
+    }
+    for (i=0; i<nb_pos; i++) {
+      double phase = 2*PI*(h*pos[4*i+1] + k*pos[4*i+2] + l*pos[4*i+3]);
+      Fr += f[(long)pos[4*i]]*cos(phase);
+      Fi += f[(long)pos[4*i]]*sin(phase);
+    }
+    if (nb_lines >= allocated) {
+      allocated = allocated ? 2*allocated : 4096;
+      lines     = realloc(lines, allocated*sizeof(struct fluo_cif_line));
+      if (!lines)
+        exit(fprintf(stderr, "%s: ERROR allocating CIF reflections (%s)\n", __FILE__, filename));
+    }
+    lines[nb_lines].d  = 1/sqrt(inv_d2);
+    lines[nb_lines].F2 = (Fr*Fr + Fi*Fi)*FLUO_CIF_RE*FLUO_CIF_RE/100; /* fm^2 -> barn */
+    if (lines[nb_lines].F2 > F2max) F2max = lines[nb_lines].F2;
+    nb_lines++;
+  }
+  free(f); free(pos); free(ops); free(sites);
+
+  // merge lines with same d and F2 into their multiplicity, skip extinct ones
+  if (nb_lines) qsort(lines, nb_lines, sizeof(struct fluo_cif_line), fluo_cif_line_compare);
+  table->columns = 3;
+  table->data    = calloc(nb_lines ? nb_lines : 1, 3*sizeof(double));
+  if (!table->data)
+    exit(fprintf(stderr, "%s: ERROR allocating CIF reflections (%s)\n", __FILE__, filename));
+  for (i=0; i<nb_lines; i=n) {
+    long first=i, j;
+    // group of same d (within rounding), then sorted by F2
+    for (n=i+1; n<nb_lines && lines[n].d > lines[first].d*(1-1e-9); n++);
+    if (n-first > 1) qsort(lines+first, n-first, sizeof(struct fluo_cif_line), fluo_cif_F2_compare);
+    for (j=first; j<n; ) {
+      long m;
+      double *row;
+      for (m=j+1; m<n && fabs(lines[m].F2-lines[j].F2) <= 1e-6*lines[j].F2; m++);
+      if (lines[j].F2 > 1e-9*F2max) {
+        row    = table->data + 3*table->rows++;
+        row[0] = m-j;
+        row[1] = lines[j].d;
+        row[2] = lines[j].F2;
+      }
+      j = m;
+    }
+  }
+  free(lines);
+
+  snprintf(text, sizeof(text),
+    "# F2(hkl) computed from %s for X-rays\n# Vc %.10g\n# column_j 1\n# column_d 2\n# column_F2 3\n",
+    filename, V);
+  table->header = strdup(text);
+  MPI_MASTER(
+  printf("%s: INFO: Computed %li F2(hkl) lines from %s (%li atoms in cell, d > %g Angs)\n",
+    __FILE__, table->rows, filename, nb_pos, d_min);
+  );
+  return table->rows;
+} // fluo_cif_read
+
+int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
+  struct fluo_line_data *list = NULL;
+  int    size = 0;
+  struct fluo_hkl_table sTable; /* reflections from SC_file, before merging */
+  int    i=0;
+  int    mult_count  =0;
+  char   flag=0;
+  double q_count=0, j_count=0, F2_count=0;
+  char **parsing;
+  int    list_count=0;
+  double sum_F2=0;
+  char  *filename=NULL;
+
+  if (!SC_file || !strlen(SC_file) || !strcmp(SC_file, "NULL")) {
+    printf("PowderN: %s: Using incoherent elastic scattering only.\n",
+        info->compname);
+    info->count = 0;
+    return(0);
+  }
+  // CIF: F2(hkl) computed in-process. Other crystallographic formats (and CIF
+  // without symmetry operators) are converted with cif2hkl.
+  filename = SC_file;
+  if (fluo_cif_read(SC_file, &sTable, FLUO_CIF_DMIN) <= 0) {
+    filename = cif2hkl(SC_file, "--mode XRA");
+    if (!filename || fluo_hkl_read(filename, &sTable) < 0) {
+      fprintf(stderr,"PowderN: Could not open file %s - exiting!\n",
+        filename ? filename : SC_file);
+      exit(-1);
+    }
+  }
+
+  /* parsing of header */
+  parsing = Table_ParseHeader(sTable.header,
       "Vc","V_0",
       "column_j",
       "column_d",
@@ -356,7 +1635,6 @@ int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
   else
     size = sTable.rows;
 
-  Table_Info(sTable);
   printf("PowderN: %s: Reading %d rows from %s\n",
       info->compname, size, SC_file);
 
@@ -384,25 +1662,25 @@ int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
     /* get data from table using columns {j d F2 DW Dd inv2d q F} */
     /* column indexes start at 1, thus need to substract 1 */
     if (info->column_order[0] >0)
-      j = Table_Index(sTable, i, info->column_order[0]-1);
+      j = FLUO_HKL(sTable, i, info->column_order[0]-1);
     if (info->column_order[1] >0)
-      d = Table_Index(sTable, i, info->column_order[1]-1);
+      d = FLUO_HKL(sTable, i, info->column_order[1]-1);
     if (info->column_order[2] >0)
-      F2 = Table_Index(sTable, i, info->column_order[2]-1);
+      F2 = FLUO_HKL(sTable, i, info->column_order[2]-1);
     if (info->column_order[3] >0)
-      DWfactor = Table_Index(sTable, i, info->column_order[3]-1);
+      DWfactor = FLUO_HKL(sTable, i, info->column_order[3]-1);
     if (info->column_order[4] >0)
-      w = Table_Index(sTable, i, info->column_order[4]-1);
+      w = FLUO_HKL(sTable, i, info->column_order[4]-1);
     if (info->column_order[5] >0 && !(info->column_order[1] >0)) // Only use if d not read already
-    { d = Table_Index(sTable, i, info->column_order[5]-1);
+    { d = FLUO_HKL(sTable, i, info->column_order[5]-1);
       d = (d > 0? 1/d/2 : 0); }
     if (info->column_order[6] >0 && !(info->column_order[1] >0)) // Only use if d not read already
-    { q = Table_Index(sTable, i, info->column_order[6]-1);
+    { q = FLUO_HKL(sTable, i, info->column_order[6]-1);
       d = (q > 0 ? 2*PI/q : 0); }
     if (info->column_order[7] >0  && !F2)
-    { F2 = Table_Index(sTable, i, info->column_order[7]-1); F2 *= F2; }
+    { F2 = FLUO_HKL(sTable, i, info->column_order[7]-1); F2 *= F2; }
     if (info->column_order[8] >0  && !Epsilon)
-    { Epsilon = Table_Index(sTable, i, info->column_order[8]-1)*1e-6; }
+    { Epsilon = FLUO_HKL(sTable, i, info->column_order[8]-1)*1e-6; }
 
     /* assign and check values */
     j        = (j > 0 ? j : 0);
@@ -460,7 +1738,7 @@ int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
     list_count++;
   } /* end for */
 
-  Table_Free(&sTable);
+  fluo_hkl_free(&sTable);
 
   if (!sum_F2) {
     MPI_MASTER(
@@ -479,58 +1757,2362 @@ int fluo_read_line_data(char *SC_file, struct fluo_line_info_struct *info) {
   if (filename && filename != SC_file)
     unlink(filename);
 
-  info->list  = list;
-  info->count = list_count;
+  // move the reflections into the aligned structure of arrays
+  fluo_line_store_init(info, list, list_count);
+  free(list);
 
   return(list_count);
 } /* fluo_read_line_data */
 
 
-/* computes the number of possible reflections (return value), and the total xsection 'sum' */
-/* this routine looks for a pre-computed value in the Nq and sum cache tables               */
-/* when found, the earch starts from the corresponding lower element in the table           */
-int fluo_calc_xsect(double k, double *q, double *my_s_k2, int count, double *sum,
-    struct fluo_line_info_struct *line_info) {
-  int    Nq = 0, line=0, line0=0;
-  /*sinth for tthmax=180 is 1.*/
-  double sinth=1.0;//sin(DEG2RAD*tth_max*0.5);
-  *sum=0;
-
-  /* check if a line_info element has been recorded already - not on OpenACC */
-  if (k >= line_info->k_min && k <= line_info->k_max && line_info->photon_passed >= CHAR_BUF_LENGTH) {
-    line = (int)floor(k - line_info->k_min)*CHAR_BUF_LENGTH/(line_info->k_max - line_info->k_min);
-    Nq    = line_info->xs_Nq[line];
-    *sum  = line_info->xs_sum[line];
-    if (!Nq && *sum == 0) {
-      /* not yet set: we compute the sum up to the corresponding wavevector in the table cache */
-      double line_k = line_info->k_min + line*(line_info->k_max - line_info->k_min)/CHAR_BUF_LENGTH;
-      for(line0=0; line0<count; line0++) {
-        if (q[line0] <= 2*line_k*sinth) { /* q < 2*kf: restrict structural range */
-          *sum += my_s_k2[line0];
-          if (Nq < line0+1) Nq=line0+1; /* determine maximum line index which can scatter */
-        } else break;
-      }
-      line_info->xs_Nq[line] = Nq;
-      line_info->xs_sum[line]= *sum;
-      line_info->xs_compute++;
-    } else line_info->xs_reuse++;
-    line0 = Nq;
+/* Powder reflection store and vectorised kernels ========================== */
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__AVX512F__) || defined(__AVX2__)) && FLUO_LINE_ALIGN == 64
+#define FLUO_LINE_SIMD
+#include <immintrin.h>
+#endif
+
+/* fluo_line_weights_kernel: out[i] = factor*DW[i]*j[i]*F2[i]/q[i] over n lines
+ * arrays are aligned on FLUO_LINE_ALIGN and n is a multiple of FLUO_LINE_BLOCK.
+ */
+static void fluo_line_weights_kernel(int n, double factor,
+  const double *q, const double *j, const double *F2, const double *DW, double *out) {
+  int i=0;
+#if defined(FLUO_LINE_SIMD) && defined(__AVX512F__)
+  __m512d f = _mm512_set1_pd(factor);
+  for (; i+8<=n; i+=8) {
+    __m512d num = _mm512_mul_pd(_mm512_mul_pd(f, _mm512_load_pd(DW+i)),
+                    _mm512_mul_pd(_mm512_load_pd(j+i), _mm512_load_pd(F2+i)));
+    _mm512_store_pd(out+i, _mm512_div_pd(num, _mm512_load_pd(q+i)));
+  }
+#elif defined(FLUO_LINE_SIMD)
+  __m256d f = _mm256_set1_pd(factor);
+  for (; i+4<=n; i+=4) {
+    __m256d num = _mm256_mul_pd(_mm256_mul_pd(f, _mm256_load_pd(DW+i)),
+                    _mm256_mul_pd(_mm256_load_pd(j+i), _mm256_load_pd(F2+i)));
+    _mm256_store_pd(out+i, _mm256_div_pd(num, _mm256_load_pd(q+i)));
   }
+#endif
+  for (; i<n; i++)
+    out[i] = factor*DW[i]*(j[i]*F2[i])/q[i];
+} // fluo_line_weights_kernel
+
+/* fluo_line_count_below: number of lines with q < q_max in one aligned block of
+ * FLUO_LINE_BLOCK lines. As q is sorted, this is the index of the first line above.
+ */
+static int fluo_line_count_below(const double *q, double q_max) {
+#if defined(FLUO_LINE_SIMD) && defined(__AVX512F__)
+  __mmask8 m = _mm512_cmp_pd_mask(_mm512_load_pd(q), _mm512_set1_pd(q_max), _CMP_LT_OQ);
+  return __builtin_popcount((unsigned int)m);
+#elif defined(FLUO_LINE_SIMD)
+  __m256d qm = _mm256_set1_pd(q_max);
+  int     m  = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(q),   qm, _CMP_LT_OQ))
+             | _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(q+4), qm, _CMP_LT_OQ)) << 4;
+  return __builtin_popcount((unsigned int)m);
+#else
+  int i, n=0;
+  for (i=0; i<FLUO_LINE_BLOCK; i++) n += (q[i] < q_max);
+  return n;
+#endif
+} // fluo_line_count_below
+
+/* fluo_line_store_init: copy 'count' reflections sorted by q into the aligned store
+ * All arrays are carved from a single allocation, each padded to FLUO_LINE_BLOCK.
+ */
+int fluo_line_store_init(struct fluo_line_info_struct *line_info,
+  struct fluo_line_data *list, int count) {
+  int    i, padded;
+  size_t size;
+  char  *block;
+  double *arrays;
+
+  line_info->count  = 0;
+  line_info->padded = 0;
+  line_info->store  = NULL;
+  line_info->store_mapped = 0;
+  line_info->q = line_info->j = line_info->F2 = line_info->DW = NULL;
+  line_info->w = line_info->strain = line_info->my_s_k2 = line_info->my_s_k2_cum = NULL;
+  if (count <= 0 || !list) return 0;
+
+  // 7 arrays of 'padded' lines, and the prefix sums which need one more element
+  padded = (count + FLUO_LINE_BLOCK - 1)/FLUO_LINE_BLOCK*FLUO_LINE_BLOCK;
+  size   = (7*(size_t)padded + padded + FLUO_LINE_BLOCK)*sizeof(double);
+  block  = malloc(size + FLUO_LINE_ALIGN);
+  if (!block)
+    exit(fprintf(stderr, "%s: ERROR allocating powder line store (%i lines)\n",
+      __FILE__, count));
+  arrays = (double*)(block + FLUO_LINE_ALIGN - ((size_t)block % FLUO_LINE_ALIGN));
+  memset(arrays, 0, size);
+
+  line_info->store       = block;
+  line_info->count       = count;
+  line_info->padded      = padded;
+  line_info->q           = arrays;
+  line_info->j           = arrays + 1*padded;
+  line_info->F2          = arrays + 2*padded;
+  line_info->DW          = arrays + 3*padded;
+  line_info->w           = arrays + 4*padded;
+  line_info->strain      = arrays + 5*padded;
+  line_info->my_s_k2     = arrays + 6*padded;
+  line_info->my_s_k2_cum = arrays + 7*padded;
+
+  for (i=0; i<padded; i++) {
+    if (i < count) {
+      line_info->q[i]       = list[i].q;
+      line_info->j[i]       = list[i].j;
+      line_info->F2[i]      = list[i].F2;
+      line_info->DW[i]      = list[i].DWfactor ? list[i].DWfactor : 1;
+      line_info->w[i]       = list[i].w;
+      line_info->strain[i]  = list[i].Epsilon;
+      if (i && line_info->q[i] < line_info->q[i-1])
+        exit(fprintf(stderr, "%s: ERROR powder lines are not sorted by q (line %i)\n",
+          __FILE__, i));
+    } else {
+      // padding: never reachable, and harmless in the weight kernel
+      line_info->q[i]  = HUGE_VAL;
+      line_info->DW[i] = 1;
+    }
+  }
+  return count;
+} // fluo_line_store_init
+
+/* fluo_line_store_weights: compute per-line cross sections and their prefix sums
+ * my_s_k2_cum[i] is the sum of my_s_k2[0..i-1], so that the powder cross section
+ * for a wavenumber k is my_s_k2_cum[Nq]*k*k.
+ */
+int fluo_line_store_weights(struct fluo_line_info_struct *line_info, double packing_factor) {
+  int i;
+
+  if (!line_info->count || !line_info->store || line_info->V_0 <= 0) {
+    line_info->my_s_k2_cum = NULL;
+    return 0;
+  }
+  fluo_line_weights_kernel(line_info->padded,
+    4*PI*PI*PI*packing_factor/(line_info->V_0*line_info->V_0),
+    line_info->q, line_info->j, line_info->F2, line_info->DW, line_info->my_s_k2);
+
+  // the prefix sum is sequential, and only done once
+  line_info->my_s_k2_cum[0] = 0;
+  for (i=0; i<line_info->count; i++)
+    line_info->my_s_k2_cum[i+1] = line_info->my_s_k2_cum[i] + line_info->my_s_k2[i];
+  return line_info->count;
+} // fluo_line_store_weights
+
+void fluo_line_store_free(struct fluo_line_info_struct *line_info) {
+  if (!line_info) return;
+#ifndef _WIN32
+  if (line_info->store_mapped)
+    munmap(line_info->store, line_info->store_mapped);
+  else
+#endif
+  free(line_info->store);
+  line_info->store = NULL;
+  line_info->store_mapped = 0;
+  line_info->count = line_info->padded = 0;
+  line_info->q = line_info->j = line_info->F2 = line_info->DW = NULL;
+  line_info->w = line_info->strain = line_info->my_s_k2 = line_info->my_s_k2_cum = NULL;
+} // fluo_line_store_free
 
-  line_info->xs_calls++;
+/* fluo_line_index_Nq: number of lines which can scatter (q < 2k), in O(log N)
+ * Bisect on aligned blocks, then count within the last block.
+ */
+int fluo_line_index_Nq(struct fluo_line_info_struct *line_info, double k) {
+  int id=0, iu, Nq;
+  double q_max=2*k; /* sinth for tthmax=180 is 1. */
 
-  for(line=line0; line<count; line++) {
-    if (q[line] <= 2*k*sinth) { /* q < 2*kf: restrict structural range */
-      *sum += my_s_k2[line];
-      if (Nq < line+1) Nq=line+1; /* determine maximum line index which can scatter */
-    } else break;
+  if (!line_info->my_s_k2_cum) return 0;
+  // first block which starts above q_max
+  iu = line_info->padded/FLUO_LINE_BLOCK;
+  while (id < iu) {
+    int im = (id + iu)/2;
+    if (line_info->q[im*FLUO_LINE_BLOCK] < q_max) id=im+1;
+    else iu=im;
   }
+  if (!id) return 0;
+  id = (id-1)*FLUO_LINE_BLOCK;
+  Nq = id + fluo_line_count_below(line_info->q + id, q_max);
+  return Nq < line_info->count ? Nq : line_info->count;
+} // fluo_line_index_Nq
+
+/* fluo_calc_xsect: number of reachable lines (return value) and total powder
+ * cross section 'sum' [barn/atom] for wavenumber k [Angs-1]
+ */
+int fluo_calc_xsect(struct fluo_line_info_struct *line_info, double k, double *sum) {
+  int Nq = fluo_line_index_Nq(line_info, k);
+
+  *sum = Nq ? line_info->my_s_k2_cum[Nq]*k*k : 0;
 
   return(Nq);
-} /* fluo_calc_xsect */
+} // fluo_calc_xsect
+
+/* XRMC_SelectPowderLineQ: select a powder line among the Nq reachable ones,
+ * with probability proportional to its cross section. The k*k factor is common
+ * to all lines and cancels out.
+ */
+int XRMC_SelectPowderLineQ(struct fluo_line_info_struct *line_info, int Nq, double *Q,
+  struct fluo_rng_struct *rng) {
+  int i_q;
+
+  if (Nq <= 0 || !line_info->my_s_k2_cum) return -1;
+  i_q = XRMC_SelectFromDistribution(line_info->my_s_k2_cum, Nq+1, rng);
+  if (i_q >= Nq) i_q = Nq-1;
+  if (Q) *Q = line_info->q[i_q];
+  return i_q;
+} // XRMC_SelectPowderLineQ
+
+/* fluo_line_sample_q: q of line i_q, broadened by its relative width w (Gaussian) */
+double fluo_line_sample_q(struct fluo_line_info_struct *line_info, int i_q,
+  struct fluo_rng_struct *rng) {
+  double q = line_info->q[i_q];
+
+  if (line_info->w[i_q] > 0) q *= 1 + line_info->w[i_q]*fluo_randnorm(rng);
+  return q;
+} // fluo_line_sample_q
+
+int fluo_powder_focus_init(struct fluo_powder_focus_struct *focus, double d_phi,
+  double focus_r, double focus_xw, double focus_yh, double focus_aw, double focus_ah) {
+  memset(focus, 0, sizeof(struct fluo_powder_focus_struct));
+  if (d_phi > 0 && d_phi < 180) {
+    focus->mode     = FLUO_FOCUS_DPHI;
+    focus->sin_dphi = sin(d_phi*DEG2RAD/2);
+  } else if (focus_aw && focus_ah) {
+    focus->mode     = FLUO_FOCUS_TARGET;
+    focus->psi      = sqrt(focus_aw*focus_aw + focus_ah*focus_ah)/2*DEG2RAD;
+    if (focus->psi >= PI) focus->mode = FLUO_FOCUS_NONE;
+  } else if (focus_xw && focus_yh) {
+    focus->mode     = FLUO_FOCUS_TARGET;
+    focus->radius   = sqrt(focus_xw*focus_xw + focus_yh*focus_yh)/2;
+  } else if (focus_r > 0) {
+    focus->mode     = FLUO_FOCUS_TARGET;
+    focus->radius   = focus_r;
+  }
+  return focus->mode;
+} // fluo_powder_focus_init
 
-int XRMC_SelectPowderLineQ(struct fluo_line_info_struct *line_info, double Ei, double *Q){
-  // given an energy in - select a line and return its number - additionally return the q-value of that line.
-  // This basicaly amounts to a call to SelectFromDistribution
+/* fluo_cone_direction: random unit vector kf at angle a from k, within the focus window
+ * kf = cos(a) u + sin(a) (cos(alpha) e1 + sin(alpha) e2), with u along k and
+ * e1 horizontal. Without focusing alpha is uniform in [-PI,PI]. Otherwise alpha
+ * is uniform in the window(s) which may reach the target, of total width 2 PI w.
+ * When the cone can not reach the target at all, the full cone is used.
+ * Returns w, the fraction of the cone sampled.
+ */
+static double fluo_cone_direction(double kx, double ky, double kz, double c2, double s2,
+  struct fluo_powder_focus_struct *focus, double ax, double ay, double az, double *kf,
+  struct fluo_rng_struct *rng) {
+  double ki = sqrt(kx*kx+ky*ky+kz*kz), u[3], e1[3], e2[3], h, alpha, w=1;
+  int    i;
+
+  u[0] = kx/ki; u[1] = ky/ki; u[2] = kz/ki;
+  // e1 = y x u (horizontal), or x x u when k is vertical
+  h = sqrt(u[0]*u[0] + u[2]*u[2]);
+  if (h > 1e-6) { e1[0] = u[2]/h; e1[1] = 0;        e1[2] = -u[0]/h; }
+  else          { h = sqrt(u[1]*u[1] + u[2]*u[2]);
+                  e1[0] = 0;      e1[1] = -u[2]/h;  e1[2] = u[1]/h; }
+  vec_prod(e2[0],e2[1],e2[2], u[0],u[1],u[2], e1[0],e1[1],e1[2]);
+
+  alpha = PI*fluo_randpm1(rng);
+  if (focus && focus->mode == FLUO_FOCUS_DPHI && fabs(s2*e2[1]) > 1e-12) {
+    // |kf_y| <= sin(d_phi/2), with kf_y = c2 u_y + s2 e2_y sin(alpha): two symmetric arcs
+    double lo = (-focus->sin_dphi - c2*u[1])/(s2*e2[1]);
+    double hi = ( focus->sin_dphi - c2*u[1])/(s2*e2[1]);
+    if (lo > hi) { double t = lo; lo = hi; hi = t; }
+    if (lo < -1) lo = -1;
+    if (hi >  1) hi =  1;
+    if (lo < hi) {
+      double a_lo = asin(lo), width = asin(hi)-a_lo;
+      alpha = a_lo + width*fluo_rand01(rng);
+      if (fluo_rand01(rng) < 0.5) alpha = PI-alpha;
+      w     = width/PI;
+    }
+  } else if (focus && focus->mode == FLUO_FOCUS_TARGET) {
+    // angle to the target <= psi: cos(alpha-alpha_c) >= c
+    double a = sqrt(ax*ax+ay*ay+az*az), a_u, a1, a2, ap, psi, c;
+    if (a > 0) {
+      a_u = scalar_prod(ax,ay,az, u[0],u[1],u[2])/a;
+      a1  = scalar_prod(ax,ay,az, e1[0],e1[1],e1[2])/a;
+      a2  = scalar_prod(ax,ay,az, e2[0],e2[1],e2[2])/a;
+      ap  = sqrt(a1*a1 + a2*a2);
+      psi = focus->psi ? focus->psi : atan2(focus->radius, a);
+      c   = ap*s2 > 1e-12 ? (cos(psi) - c2*a_u)/(s2*ap) : -2;
+      if (c > -1 && c < 1) {
+        double delta = acos(c);
+        alpha = atan2(a2, a1) + delta*fluo_randpm1(rng);
+        w     = delta/PI;
+      }
+    }
+  }
+  h = s2*cos(alpha); s2 *= sin(alpha);
+  for (i=0; i<3; i++) kf[i] = c2*u[i] + h*e1[i] + s2*e2[i];
+  return w;
+} // fluo_cone_direction
+
+/* fluo_powder_cone: random outgoing direction on the Debye-Scherrer cone of q
+ * at 2 theta from k, with theta = asin(q/2k) the Bragg angle (returned).
+ */
+double fluo_powder_cone(double kx, double ky, double kz, double q,
+  struct fluo_powder_focus_struct *focus, double ax, double ay, double az,
+  double *kf_x, double *kf_y, double *kf_z, double *w, struct fluo_rng_struct *rng) {
+  double sin_theta = q/(2.0*sqrt(kx*kx+ky*ky+kz*kz)), theta, kf[3];
+
+  if (sin_theta > 1) sin_theta = 1;
+  theta = asin(sin_theta);
+  *w    = fluo_cone_direction(kx,ky,kz, 1-2*sin_theta*sin_theta, sin(2*theta),
+    focus, ax,ay,az, kf, rng);
+  *kf_x = kf[0]; *kf_y = kf[1]; *kf_z = kf[2];
+  return theta;
+} // fluo_powder_cone
+
+/* Persistent reflection cache ============================================== */
+
+#define FLUO_LINE_CACHE_MAGIC   "FLUOLINE"
+#define FLUO_LINE_CACHE_VERSION 2
+
+/* binary cache file header. The line store follows at 'offset', as a single
+ * block laid out as in fluo_line_store_init, so that it can be mapped as is */
+struct fluo_line_cache_header {
+  char   magic[8];
+  int    version;
+  int    align;         /* FLUO_LINE_ALIGN of the writer */
+  int    endian;        /* 0x01020304 in the writer byte order */
+  int    count;
+  int    padded;
+  int    pad;
+  long long offset;     /* start of the line store, multiple of FLUO_LINE_ALIGN */
+  long long size;       /* size of the line store [bytes] */
+  double V_0, Dd, DWfactor, pow_density, at_weight, at_nb; /* values read from the file header */
+};
+
+/* fluo_line_cache_fnv: FNV-1a 64 bits hash, continued from 'h' */
+static unsigned long long fluo_line_cache_fnv(unsigned long long h, void *data, size_t n)
+{
+  unsigned char *b = (unsigned char*)data;
+  size_t i;
+
+  for (i=0; i<n; i++) {
+    h ^= b[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+} // fluo_line_cache_fnv
+
+/* fluo_line_cache_store_size: bytes in the line store for 'padded' lines */
+static size_t fluo_line_cache_store_size(int padded)
+{
+  return (7*(size_t)padded + padded + FLUO_LINE_BLOCK)*sizeof(double);
+} // fluo_line_cache_store_size
+
+/* fluo_line_cache_path: name of the binary cache file for a reflection list
+ * <dir>/<reflections basename>-<hash>.fluo, hashing the file content, the
+ * parameters used when reading it, and the cache format.
+ */
+int fluo_line_cache_path(char *path, char *dir, char *reflections,
+  struct fluo_line_info_struct *line_info, double packing_factor) {
+  unsigned long long h = 14695981039346656037ULL;
+  double params[8];
+  char   buffer[65536];
+  char  *base;
+  size_t n;
+  int    version = FLUO_LINE_CACHE_VERSION;
+  FILE  *file;
+
+  if (!path) return 0;
+  path[0] = '\0';
+  if (!dir || !strlen(dir) || !strcmp(dir, "NULL")) dir = getenv("FLUO_CACHE_DIR");
+  if (!dir || !strlen(dir)) return 0;
+  if (!reflections || !strlen(reflections) || !strcmp(reflections, "NULL")) return 0;
+
+  // content hash. Files which are only found in the McXtrace data directories
+  // are not hashed, and thus not cached.
+  file = fopen(reflections, "rb");
+  if (!file) return 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    h = fluo_line_cache_fnv(h, buffer, n);
+  fclose(file);
+
+  params[0] = line_info->V_0;
+  params[1] = line_info->DWfactor;
+  params[2] = line_info->Dd;
+  params[3] = line_info->Epsilon;
+  params[4] = line_info->pow_density;
+  params[5] = line_info->at_weight;
+  params[6] = line_info->at_nb;
+  params[7] = packing_factor;
+  h = fluo_line_cache_fnv(h, params, sizeof(params));
+  h = fluo_line_cache_fnv(h, &version, sizeof(version));
+  h = fluo_line_cache_fnv(h, "--mode XRA", strlen("--mode XRA")); // cif2hkl options
+
+  base = strrchr(reflections, '/');
+  base = base ? base+1 : reflections;
+  n = snprintf(path, 1024, "%s/%s-%016llx.fluo", dir, base, h);
+  if (n >= 1024) { path[0] = '\0'; return 0; }
+  return 1;
+} // fluo_line_cache_path
+
+/* fluo_line_cache_map: map a line store file (cache or node segment), without copy
+ * The mapping is read-only and shared between processes on the same host.
+ */
+static int fluo_line_cache_map(struct fluo_line_info_struct *line_info, char *path) {
+#ifndef _WIN32
+  struct fluo_line_cache_header header;
+  struct stat st;
+  double *arrays;
+  void   *map;
+  int     fd, padded;
+
+  if (!path || !strlen(path)) return 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) || read(fd, &header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    return 0;
+  }
+  padded = header.padded;
+  if (memcmp(header.magic, FLUO_LINE_CACHE_MAGIC, sizeof(header.magic))
+    || header.version != FLUO_LINE_CACHE_VERSION
+    || header.align   != FLUO_LINE_ALIGN
+    || header.endian  != 0x01020304
+    || header.count <= 0 || padded < header.count || padded % FLUO_LINE_BLOCK
+    || header.offset % FLUO_LINE_ALIGN
+    || header.size   != (long long)fluo_line_cache_store_size(padded)
+    || st.st_size    != header.offset + header.size) {
+    close(fd);
+    fprintf(stderr, "%s: WARNING: ignoring invalid reflection cache %s\n", __FILE__, path);
+    return 0;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  fluo_line_store_free(line_info);
+  arrays = (double*)((char*)map + header.offset);
+  line_info->store        = map;
+  line_info->store_mapped = st.st_size;
+  line_info->count        = header.count;
+  line_info->padded       = padded;
+  line_info->q            = arrays;
+  line_info->j            = arrays + 1*padded;
+  line_info->F2           = arrays + 2*padded;
+  line_info->DW           = arrays + 3*padded;
+  line_info->w            = arrays + 4*padded;
+  line_info->strain       = arrays + 5*padded;
+  line_info->my_s_k2      = arrays + 6*padded;
+  line_info->my_s_k2_cum  = arrays + 7*padded;
+  line_info->V_0          = header.V_0;
+  line_info->Dd           = header.Dd;
+  line_info->DWfactor     = header.DWfactor;
+  line_info->pow_density  = header.pow_density;
+  line_info->at_weight    = header.at_weight;
+  line_info->at_nb        = header.at_nb;
+  return line_info->count;
+#else
   return 0;
-}
+#endif
+} // fluo_line_cache_map
+
+int fluo_line_cache_load(struct fluo_line_info_struct *line_info, char *path) {
+  if (!fluo_line_cache_map(line_info, path)) return 0;
+  MPI_MASTER(
+  printf("PowderN: %s: Mapped %i reflections from cache '%s'\n",
+      line_info->compname, line_info->count, path);
+  );
+  return line_info->count;
+} // fluo_line_cache_load
+
+/* fluo_line_cache_write: write a line store file, which fluo_line_cache_map reads */
+static int fluo_line_cache_write(struct fluo_line_info_struct *line_info, char *path) {
+#ifndef _WIN32
+  struct fluo_line_cache_header header;
+  char   tmp[1100], dir[1024], *slash;
+  char   zero[FLUO_LINE_ALIGN];
+  FILE  *file;
+  int    ok;
+
+  if (!path || !strlen(path) || !line_info->count || line_info->store_mapped
+    || !line_info->my_s_k2_cum) return 0;
+
+  // create the cache directory if needed (one level)
+  strncpy(dir, path, sizeof(dir)-1); dir[sizeof(dir)-1] = '\0';
+  slash = strrchr(dir, '/');
+  if (slash && slash != dir) { *slash = '\0'; mkdir(dir, 0755); }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FLUO_LINE_CACHE_MAGIC, sizeof(header.magic));
+  header.version     = FLUO_LINE_CACHE_VERSION;
+  header.align       = FLUO_LINE_ALIGN;
+  header.endian      = 0x01020304;
+  header.count       = line_info->count;
+  header.padded      = line_info->padded;
+  header.offset      = (sizeof(header) + FLUO_LINE_ALIGN - 1)/FLUO_LINE_ALIGN*FLUO_LINE_ALIGN;
+  header.size        = fluo_line_cache_store_size(line_info->padded);
+  header.V_0         = line_info->V_0;
+  header.Dd          = line_info->Dd;
+  header.DWfactor    = line_info->DWfactor;
+  header.pow_density = line_info->pow_density;
+  header.at_weight   = line_info->at_weight;
+  header.at_nb       = line_info->at_nb;
+  memset(zero, 0, sizeof(zero));
+
+  // write aside, then rename atomically over any previous version
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+  file = fopen(tmp, "wb");
+  if (!file) return 0;
+  ok = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(zero, header.offset - sizeof(header), 1, file) <= 1
+    && fwrite(line_info->q, header.size, 1, file) == 1;
+  ok = !fclose(file) && ok;
+  if (!ok || rename(tmp, path)) {
+    unlink(tmp);
+    fprintf(stderr, "%s: WARNING: could not write reflection cache %s\n", __FILE__, path);
+    return 0;
+  }
+  return 1;
+#else
+  return 0;
+#endif
+} // fluo_line_cache_write
+
+/* fluo_line_cache_save: store sorted lines and their weights for later runs
+ * Failures are not fatal: the cache is only an accelerator.
+ */
+int fluo_line_cache_save(struct fluo_line_info_struct *line_info, char *path) {
+  if (!fluo_line_cache_write(line_info, path)) return 0;
+  printf("PowderN: %s: Stored %i reflections into cache '%s'\n",
+      line_info->compname, line_info->count, path);
+  return 1;
+} // fluo_line_cache_save
+
+/* Process registry ========================================================= */
+
+/* fluo_processes_init: empty registry, all processes disabled */
+void fluo_processes_init(struct fluo_processes_struct *processes)
+{
+  int type;
+
+  memset(processes, 0, sizeof(struct fluo_processes_struct));
+  for (type=0; type<FLUO_PROCESS_MAX; type++)
+    processes->process[type].type = type;
+} // fluo_processes_init
+
+/* fluo_process_register: add a process to the registry, and update the list of
+ * enabled processes.
+ */
+int fluo_process_register(struct fluo_processes_struct *processes, int type, char *name,
+  int enabled, int in_total, int nElements, fluo_xsect_func xsect, fluo_sample_func sample,
+  void *data)
+{
+  struct fluo_process_struct *process;
+  int i;
+
+  if (type < 0 || type >= FLUO_PROCESS_MAX || type == TRANSMISSION)
+    exit(fprintf(stderr, "%s: ERROR: invalid process type %i (%s)\n", __FILE__, type, name));
+  process = &processes->process[type];
+  process->name      = name;
+  process->type      = type;
+  process->enabled   = (enabled && FLUO_PROCESS_COMPILED(type) && xsect && sample);
+  process->in_total  = in_total;
+  process->nElements = nElements;
+  process->xsect     = xsect;
+  process->sample    = sample;
+  process->data      = data;
+
+  processes->nb = 0;
+  for (i=0; i<FLUO_PROCESS_MAX; i++)
+    if (processes->process[i].enabled) processes->active[processes->nb++] = i;
+
+  return process->enabled;
+} // fluo_process_register
+
+/* fluo_processes_xsect: fill entry E, xs[type], sigma and Nq for energy E [keV] */
+double fluo_processes_xsect(struct fluo_processes_struct *processes,
+  struct fluo_xs_table_struct *table, double E, struct fluo_xs_cache_entry *entry)
+{
+  int i, type;
+
+  // compound cross sections: needed for attenuation, even when all are disabled
+  entry->E     = E;
+  entry->sigma = fluo_xs_table_eval(table, E, NULL,
+    entry->cum_fluo, entry->cum_Rayleigh, entry->cum_Compton); // Photo+Compton+Rayleigh
+  entry->Nq    = 0;
+  for (type=0; type<FLUO_PROCESS_MAX; type++) entry->xs[type] = 0;
+
+  for (i=0; i<processes->nb; i++) {
+    struct fluo_process_struct *process = &processes->process[processes->active[i]];
+    type = process->type;
+    entry->xs[type] = process->xsect(process, entry);
+    if (!process->in_total) entry->sigma += entry->xs[type];
+  }
+  return entry->sigma;
+} // fluo_processes_xsect
+
+/* fluo_processes_select: select an enabled process from cross sections 'xs' */
+int fluo_processes_select(struct fluo_processes_struct *processes, double *xs,
+  struct fluo_rng_struct *rng)
+{
+  double cum_xs[FLUO_PROCESS_MAX+1];
+  int    i;
+
+  if (!processes->nb) return -1;
+  cum_xs[0] = 0;
+  for (i=0; i<processes->nb; i++)
+    cum_xs[i+1] = cum_xs[i] + xs[processes->active[i]];
+  if (cum_xs[processes->nb] <= 0) return -1;
+
+  return processes->active[XRMC_SelectFromDistribution(cum_xs, processes->nb+1, rng)];
+} // fluo_processes_select
+
+/* fluo_processes_report: print the enabled processes */
+void fluo_processes_report(struct fluo_processes_struct *processes, char *compname)
+{
+  int i;
+
+  MPI_MASTER(
+    printf("%s: processes:", compname);
+    for (i=0; i<processes->nb; i++)
+      printf(" %s", processes->process[processes->active[i]].name);
+    if (!processes->nb) printf(" none (absorption only)");
+    printf("\n");
+  );
+} // fluo_processes_report
+
+/* fluo_xs_cum: cumulated per-element cross sections of a process type */
+static double *fluo_xs_cum(struct fluo_xs_cache_entry *entry, int type)
+{
+  switch (type) {
+    case FLUORESCENCE: return entry->cum_fluo;
+    case RAYLEIGH:     return entry->cum_Rayleigh;
+    case COMPTON:      return entry->cum_Compton;
+  }
+  return NULL;
+} // fluo_xs_cum
+
+/* fluo_xsect_element: cross section summed over the compound elements */
+double fluo_xsect_element(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry)
+{
+  double *cum = fluo_xs_cum(entry, process->type);
+  return cum ? cum[process->nElements] : 0;
+} // fluo_xsect_element
+
+/* fluo_sample_element: select the scattering element, taking into account mass-fractions */
+int fluo_sample_element(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry, struct fluo_rng_struct *rng)
+{
+  double *cum = fluo_xs_cum(entry, process->type);
+  return cum ? XRMC_SelectFromDistribution(cum, process->nElements+1, rng) : -1;
+} // fluo_sample_element
+
+/* fluo_xsect_powder: sum over the reachable powder lines, also sets entry->Nq */
+double fluo_xsect_powder(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry)
+{
+  double xs=0;
+  entry->Nq = fluo_calc_xsect((struct fluo_line_info_struct*)process->data, entry->E*E2K, &xs);
+  return xs;
+} // fluo_xsect_powder
+
+/* fluo_sample_powder: select one of the entry->Nq reachable powder lines */
+int fluo_sample_powder(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry, struct fluo_rng_struct *rng)
+{
+  return XRMC_SelectPowderLineQ((struct fluo_line_info_struct*)process->data, entry->Nq, NULL, rng);
+} // fluo_sample_powder
+
+/* Mesh bounding volume hierarchy =========================================== */
+
+/* triangle bounds and centroids, used while building */
+struct fluo_bvh_build {
+  double *bmin, *bmax, *centroid; /* [3 per triangle] */
+  long   *index;                  /* triangle permutation */
+};
+
+static void fluo_bvh_bounds(struct fluo_bvh_build *b, long first, long count,
+  double *bmin, double *bmax, double *cmin, double *cmax)
+{
+  long i;
+  int  a;
+
+  for (a=0; a<3; a++) {
+    bmin[a] = cmin[a] =  HUGE_VAL;
+    bmax[a] = cmax[a] = -HUGE_VAL;
+  }
+  for (i=first; i<first+count; i++) {
+    long t = b->index[i];
+    for (a=0; a<3; a++) {
+      bmin[a] = fmin(bmin[a], b->bmin[3*t+a]);
+      bmax[a] = fmax(bmax[a], b->bmax[3*t+a]);
+      cmin[a] = fmin(cmin[a], b->centroid[3*t+a]);
+      cmax[a] = fmax(cmax[a], b->centroid[3*t+a]);
+    }
+  }
+} // fluo_bvh_bounds
+
+static double fluo_bvh_area(double *bmin, double *bmax)
+{
+  double dx = bmax[0]-bmin[0], dy = bmax[1]-bmin[1], dz = bmax[2]-bmin[2];
+  return (dx < 0 || dy < 0 || dz < 0) ? 0 : dx*dy + dy*dz + dz*dx;
+} // fluo_bvh_area
+
+/* fluo_bvh_split: build node 'n' over index[first..first+count-1], recursively
+ * The split plane is chosen with the surface area heuristic over binned centroids.
+ */
+static void fluo_bvh_split(struct fluo_bvh_struct *bvh, struct fluo_bvh_build *b,
+  long n, long first, long count, int depth)
+{
+  struct fluo_bvh_node *node = &bvh->nodes[n];
+  double cmin[3], cmax[3], best_cost, extent;
+  long   best_split=-1, i, j, mid;
+  int    a, best_axis=-1;
+
+  fluo_bvh_bounds(b, first, count, node->bmin, node->bmax, cmin, cmax);
+  for (a=0; a<3; a++) { // pad for rounding in the slab test
+    extent = 1e-9*(node->bmax[a]-node->bmin[a] + fabs(node->bmax[a]) + fabs(node->bmin[a]));
+    node->bmin[a] -= extent;
+    node->bmax[a] += extent;
+  }
+  node->first = first;
+  node->count = count;
+  if (depth > bvh->depth) bvh->depth = depth;
+  if (count <= FLUO_BVH_LEAF || depth >= FLUO_BVH_STACK-2) return;
+
+  // cost of a leaf, in units of triangle tests (a node traversal counts as 1)
+  best_cost = count*fluo_bvh_area(node->bmin, node->bmax);
+  for (a=0; a<3; a++) {
+    double bin_min[FLUO_BVH_BINS][3], bin_max[FLUO_BVH_BINS][3];
+    long   bin_count[FLUO_BVH_BINS];
+    double scale;
+
+    if (cmax[a] <= cmin[a]) continue;
+    scale = FLUO_BVH_BINS/(cmax[a]-cmin[a]);
+    for (i=0; i<FLUO_BVH_BINS; i++) {
+      bin_count[i] = 0;
+      for (j=0; j<3; j++) { bin_min[i][j] = HUGE_VAL; bin_max[i][j] = -HUGE_VAL; }
+    }
+    for (i=first; i<first+count; i++) {
+      long t = b->index[i];
+      int  k = (int)((b->centroid[3*t+a]-cmin[a])*scale);
+      if (k >= FLUO_BVH_BINS) k = FLUO_BVH_BINS-1;
+      bin_count[k]++;
+      for (j=0; j<3; j++) {
+        bin_min[k][j] = fmin(bin_min[k][j], b->bmin[3*t+j]);
+        bin_max[k][j] = fmax(bin_max[k][j], b->bmax[3*t+j]);
+      }
+    }
+    // sweep the bins: right-hand areas first, then the cost of splitting after bin i
+    {
+      double lmin[3], lmax[3], rmin[3], rmax[3], right_area[FLUO_BVH_BINS], cost;
+      long   nl=0, nr=0, right_count[FLUO_BVH_BINS];
+      for (j=0; j<3; j++) { lmin[j] = rmin[j] = HUGE_VAL; lmax[j] = rmax[j] = -HUGE_VAL; }
+      for (i=FLUO_BVH_BINS-1; i>0; i--) {
+        nr += bin_count[i];
+        for (j=0; j<3; j++) { rmin[j] = fmin(rmin[j], bin_min[i][j]); rmax[j] = fmax(rmax[j], bin_max[i][j]); }
+        right_count[i-1] = nr;
+        right_area[i-1]  = fluo_bvh_area(rmin, rmax);
+      }
+      for (i=0; i<FLUO_BVH_BINS-1; i++) {
+        nl += bin_count[i];
+        for (j=0; j<3; j++) { lmin[j] = fmin(lmin[j], bin_min[i][j]); lmax[j] = fmax(lmax[j], bin_max[i][j]); }
+        if (!nl || !right_count[i]) continue;
+        cost = fluo_bvh_area(node->bmin, node->bmax)
+             + nl*fluo_bvh_area(lmin, lmax) + right_count[i]*right_area[i];
+        if (cost < best_cost) { best_cost = cost; best_axis = a; best_split = i; }
+      }
+    }
+  }
+  if (best_axis < 0) return; // a leaf is cheaper
+
+  // partition the triangles on the chosen bin boundary
+  {
+    double scale = FLUO_BVH_BINS/(cmax[best_axis]-cmin[best_axis]);
+    i = first; j = first+count-1;
+    while (i <= j) {
+      long t = b->index[i];
+      int  k = (int)((b->centroid[3*t+best_axis]-cmin[best_axis])*scale);
+      if (k >= FLUO_BVH_BINS) k = FLUO_BVH_BINS-1;
+      if (k <= best_split) i++;
+      else { b->index[i] = b->index[j]; b->index[j--] = t; }
+    }
+    mid = i;
+  }
+  if (mid == first || mid == first+count) return;
+
+  node->first = bvh->nb_nodes;
+  node->count = 0;
+  bvh->nb_nodes += 2;
+  fluo_bvh_split(bvh, b, node->first,   first, mid-first,       depth+1);
+  fluo_bvh_split(bvh, b, node->first+1, mid,   first+count-mid, depth+1);
+} // fluo_bvh_split
+
+/* fluo_bvh_init: build a SAH BVH over polygonal faces (fan triangulated) */
+long fluo_bvh_init(struct fluo_bvh_struct *bvh, double *vertices, long nb_vertices,
+  unsigned long *faces, long faces_size) {
+  struct fluo_bvh_build b;
+  double *tri;
+  long    i, f, t, nb=0;
+
+  memset(bvh, 0, sizeof(struct fluo_bvh_struct));
+  if (!vertices || !faces || nb_vertices <= 0 || faces_size <= 0) return 0;
+
+  // count triangles
+  for (i=0; i<faces_size; i += faces[i]+1)
+    if (faces[i] >= 3) nb += faces[i]-2;
+  if (!nb) return 0;
+
+  tri       = malloc(9*nb*sizeof(double));
+  bvh->face = malloc(nb*sizeof(long));
+  b.bmin    = malloc(3*nb*sizeof(double));
+  b.bmax    = malloc(3*nb*sizeof(double));
+  b.centroid= malloc(3*nb*sizeof(double));
+  b.index   = malloc(nb*sizeof(long));
+  bvh->nodes= calloc(2*nb, sizeof(struct fluo_bvh_node));
+  if (!tri || !bvh->face || !b.bmin || !b.bmax || !b.centroid || !b.index || !bvh->nodes)
+    exit(fprintf(stderr, "%s: ERROR allocating BVH for %ld triangles\n", __FILE__, nb));
+
+  // fan triangulation of each face, as v0, e1, e2
+  for (i=0, f=0, t=0; i<faces_size; i += faces[i]+1, f++) {
+    unsigned long k;
+    for (k=2; k<faces[i]; k++, t++) {
+      double *v0 = vertices+3*faces[i+1], *v1 = vertices+3*faces[i+k], *v2 = vertices+3*faces[i+k+1];
+      int a;
+      for (a=0; a<3; a++) {
+        tri[9*t+a]   = v0[a];
+        tri[9*t+3+a] = v1[a]-v0[a];
+        tri[9*t+6+a] = v2[a]-v0[a];
+        b.bmin[3*t+a]     = fmin(v0[a], fmin(v1[a], v2[a]));
+        b.bmax[3*t+a]     = fmax(v0[a], fmax(v1[a], v2[a]));
+        b.centroid[3*t+a] = (v0[a]+v1[a]+v2[a])/3;
+      }
+      bvh->face[t] = f;
+      b.index[t]   = t;
+    }
+  }
+  bvh->nb_triangles = nb;
+  bvh->nb_nodes     = 1;
+  fluo_bvh_split(bvh, &b, 0, 0, nb, 0);
+
+  // store the triangles in leaf order, for contiguous leaf tests
+  bvh->triangles = malloc(9*nb*sizeof(double));
+  {
+    long *face = malloc(nb*sizeof(long));
+    if (!bvh->triangles || !face)
+      exit(fprintf(stderr, "%s: ERROR allocating BVH for %ld triangles\n", __FILE__, nb));
+    for (i=0; i<nb; i++) {
+      memcpy(bvh->triangles+9*i, tri+9*b.index[i], 9*sizeof(double));
+      face[i] = bvh->face[b.index[i]];
+    }
+    free(bvh->face);
+    bvh->face = face;
+  }
+  free(tri); free(b.bmin); free(b.bmax); free(b.centroid); free(b.index);
+  bvh->enabled = 1;
+  return bvh->nb_nodes;
+} // fluo_bvh_init
+
+/* fluo_bvh_intersect: first two intersections of a line with the mesh
+ * All intersections along the (infinite) line are collected, as in the
+ * interoff-lib face scan, then sorted. Hits on a triangle edge, which the
+ * reference resolves with its own cleaning rules, are reported as ambiguous.
+ */
+int fluo_bvh_intersect(struct fluo_bvh_struct *bvh, double *l0, double *l3,
+  double x, double y, double z, double kx, double ky, double kz) {
+  int    stack[FLUO_BVH_STACK], top=0, nb=0, i, j;
+  double hit[FLUO_BVH_HITS];
+  double o[3]={x,y,z}, d[3], inv[3];
+  double k = sqrt(kx*kx+ky*ky+kz*kz);
+  const double eps = 1e-9;
+
+  if (!bvh->enabled || !k) return -1;
+  d[0] = kx/k; d[1] = ky/k; d[2] = kz/k;
+  for (i=0; i<3; i++) inv[i] = d[i] ? 1/d[i] : HUGE_VAL;
+
+  stack[top++] = 0;
+  while (top) {
+    struct fluo_bvh_node *node = &bvh->nodes[stack[--top]];
+    double tmin=-HUGE_VAL, tmax=HUGE_VAL;
+    int    a;
+
+    // slab test for the whole line
+    for (a=0; a<3; a++) {
+      if (d[a]) {
+        double t1 = (node->bmin[a]-o[a])*inv[a], t2 = (node->bmax[a]-o[a])*inv[a];
+        tmin = fmax(tmin, fmin(t1, t2));
+        tmax = fmin(tmax, fmax(t1, t2));
+      } else if (o[a] < node->bmin[a] || o[a] > node->bmax[a]) tmax = -HUGE_VAL;
+    }
+    if (tmin > tmax) continue;
+
+    if (node->count) { // leaf: Moller-Trumbore on contiguous triangles
+      long t;
+      for (t=node->first; t<node->first+node->count; t++) {
+        double *v0 = bvh->triangles+9*t, *e1 = v0+3, *e2 = v0+6;
+        double p[3], s[3], q[3], det, u, v, w;
+        vec_prod(p[0],p[1],p[2], d[0],d[1],d[2], e2[0],e2[1],e2[2]);
+        det = scalar_prod(e1[0],e1[1],e1[2], p[0],p[1],p[2]);
+        if (!det) continue; // parallel to the face, skipped as in interoff-lib
+        s[0] = o[0]-v0[0]; s[1] = o[1]-v0[1]; s[2] = o[2]-v0[2];
+        u = scalar_prod(s[0],s[1],s[2], p[0],p[1],p[2])/det;
+        if (u < -eps || u > 1+eps) continue;
+        vec_prod(q[0],q[1],q[2], s[0],s[1],s[2], e1[0],e1[1],e1[2]);
+        v = scalar_prod(d[0],d[1],d[2], q[0],q[1],q[2])/det;
+        if (v < -eps || u+v > 1+eps) continue;
+        w = 1-u-v;
+        if (u < eps || v < eps || w < eps) return -1; // on an edge or vertex
+        if (nb >= FLUO_BVH_HITS) return -1;
+        hit[nb++] = scalar_prod(e2[0],e2[1],e2[2], q[0],q[1],q[2])/det;
+      }
+    } else {
+      if (top+2 > FLUO_BVH_STACK) return -1;
+      stack[top++] = node->first+1;
+      stack[top++] = node->first;
+    }
+  }
+  if (nb % 2) return -1; // not a closed surface along this line
+
+  // sort the (few) intersection distances
+  for (i=1; i<nb; i++) {
+    double h = hit[i];
+    for (j=i; j>0 && hit[j-1] > h; j--) hit[j] = hit[j-1];
+    hit[j] = h;
+  }
+  if (nb) {
+    if (l0) *l0 = hit[0];
+    if (l3) *l3 = hit[1];
+  }
+  return nb;
+} // fluo_bvh_intersect
+
+void fluo_bvh_free(struct fluo_bvh_struct *bvh) {
+  if (!bvh) return;
+  free(bvh->triangles);
+  free(bvh->face);
+  free(bvh->nodes);
+  memset(bvh, 0, sizeof(struct fluo_bvh_struct));
+} // fluo_bvh_free
+
+#ifdef USE_OFF
+/* fluo_bvh_init_off: build the BVH for an interoff-lib geometry, and check it
+ * The check fires random lines through the mesh bounds, and compares with
+ * off_x_intersect. Any disagreement disables the BVH.
+ */
+long fluo_bvh_init_off(struct fluo_bvh_struct *bvh, off_struct *data, long nb_check) {
+  struct fluo_bvh_node *root;
+  double *vertices;
+  long    i, nb_mismatch=0, nb_ambiguous=0, nodes;
+
+  if (!data || !data->vtxSize || !data->faceSize) {
+    memset(bvh, 0, sizeof(struct fluo_bvh_struct));
+    return 0;
+  }
+  vertices = malloc(3*data->vtxSize*sizeof(double));
+  if (!vertices)
+    exit(fprintf(stderr, "%s: ERROR allocating BVH vertices\n", __FILE__));
+  for (i=0; i<data->vtxSize; i++) {
+    vertices[3*i]   = data->vtxArray[i].x;
+    vertices[3*i+1] = data->vtxArray[i].y;
+    vertices[3*i+2] = data->vtxArray[i].z;
+  }
+  nodes = fluo_bvh_init(bvh, vertices, data->vtxSize, data->faceArray, data->faceSize);
+  free(vertices);
+  if (!nodes) return 0;
+
+  root = &bvh->nodes[0];
+  for (i=0; i<nb_check; i++) {
+    double o[3], k[3], l0=0, l3=0, r0=0, r3=0, scale, cos_t=randpm1(), phi=2*PI*rand01();
+    int    a, n, r;
+    for (a=0; a<3; a++)
+      o[a] = root->bmin[a] + (root->bmax[a]-root->bmin[a])*(1.5*rand01()-0.25);
+    k[0] = sqrt(1-cos_t*cos_t)*cos(phi); k[1] = sqrt(1-cos_t*cos_t)*sin(phi); k[2] = cos_t;
+    n = fluo_bvh_intersect(bvh, &l0, &l3, o[0],o[1],o[2], k[0],k[1],k[2]);
+    if (n < 0) { nb_ambiguous++; continue; }
+    r = off_x_intersect(&r0, &r3, NULL, NULL, o[0],o[1],o[2], k[0],k[1],k[2], *data);
+    scale = 1e-6*(1 + fabs(r0) + fabs(r3));
+    if ((n > 0) != (r > 0) || (n && (fabs(l0-r0) > scale || fabs(l3-r3) > scale)))
+      nb_mismatch++;
+  }
+  MPI_MASTER(
+    printf("%s: BVH: %ld faces, %ld triangles, %ld nodes, depth %d",
+      __FILE__, data->polySize, bvh->nb_triangles, bvh->nb_nodes, bvh->depth);
+    if (nb_check)
+      printf(", check: %ld lines, %ld ambiguous, %ld mismatches", nb_check, nb_ambiguous, nb_mismatch);
+    printf("\n");
+  );
+  if (nb_mismatch) {
+    MPI_MASTER(
+      fprintf(stderr, "%s: WARNING: BVH does not match off_x_intersect. Using the face scan.\n", __FILE__);
+    );
+    bvh->enabled = 0;
+  }
+  return bvh->enabled ? bvh->nb_nodes : 0;
+} // fluo_bvh_init_off
+
+/* fluo_off_intersect: off_x_intersect with the BVH, or the face scan */
+int fluo_off_intersect(struct fluo_bvh_struct *bvh, double *l0, double *l3,
+  double x, double y, double z, double kx, double ky, double kz, off_struct *data) {
+  int n = bvh ? fluo_bvh_intersect(bvh, l0, l3, x,y,z, kx,ky,kz) : -1;
+
+  if (n < 0) n = off_x_intersect(l0, l3, NULL, NULL, x,y,z, kx,ky,kz, *data);
+  return n;
+} // fluo_off_intersect
+#endif
+
+/* Sample shapes ============================================================ */
+
+/* fluo_shape_init: resolve the sample dimensions into a shape descriptor */
+int fluo_shape_init(struct fluo_shape_struct *shape, int type, double radius,
+  double xwidth, double yheight, double zdepth, double thickness) {
+  /* inner: dimensions reduced by a positive thickness, when they stay positive */
+  double r_in = radius - fabs(thickness);
+  double w_in = xwidth -2*fabs(thickness) > 0 ? xwidth -2*fabs(thickness) : xwidth;
+  double h_in = yheight-2*fabs(thickness) > 0 ? yheight-2*fabs(thickness) : yheight;
+  double d_in = zdepth -2*fabs(thickness) > 0 ? zdepth -2*fabs(thickness) : zdepth;
+
+  memset(shape, 0, sizeof(struct fluo_shape_struct));
+  shape->type   = type;
+  shape->hollow = thickness != 0;
+  if (thickness < 0) { /* shell around the given dimensions */
+    r_in = radius; w_in = xwidth; h_in = yheight; d_in = zdepth;
+    radius -= thickness; xwidth -= 2*thickness; yheight -= 2*thickness; zdepth -= 2*thickness;
+  }
+  switch (type) {
+  case FLUO_SHAPE_CYLINDER:
+    shape->outer[0] = radius; shape->outer[1] = yheight/2;
+    shape->inner[0] = r_in;   shape->inner[1] = h_in/2;
+    shape->intersect = fluo_shape_cylinder;
+    break;
+  case FLUO_SHAPE_BOX:
+    shape->outer[0] = xwidth/2; shape->outer[1] = yheight/2; shape->outer[2] = zdepth/2;
+    shape->inner[0] = w_in/2;   shape->inner[1] = h_in/2;    shape->inner[2] = d_in/2;
+    shape->intersect = fluo_shape_box;
+    break;
+  case FLUO_SHAPE_SPHERE:
+    shape->outer[0] = radius;
+    shape->inner[0] = r_in;
+    shape->intersect = fluo_shape_sphere;
+    break;
+  default:
+    shape->type = FLUO_SHAPE_NONE;
+  }
+  return shape->type;
+} // fluo_shape_init
+
+/* fluo_shape_cylinder: vertical cylinder, with an optional coaxial hole */
+int fluo_shape_cylinder(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz) {
+  double k = sqrt(kx*kx+ky*ky+kz*kz), A, B, rho2, t_in[2], t_out[2];
+  int    i;
+
+  if (!k) return 0;
+  kx /= k; ky /= k; kz /= k;
+  A    = kx*kx + kz*kz; /* radial quadratic, shared by both surfaces */
+  B    = x*kx + z*kz;
+  rho2 = x*x + z*z;
+  for (i=0; i <= shape->hollow; i++) {
+    double *size = i ? shape->inner : shape->outer, r2 = size[0]*size[0], h = size[1];
+    if (A) {
+      double D = B*B - A*(rho2 - r2);
+      if (D < 0) break;
+      D = sqrt(D);
+      t_in[i]  = (-B - D)/A;
+      t_out[i] = (-B + D)/A;
+    } else if (rho2 > r2) break;
+    else { t_in[i] = -HUGE_VAL; t_out[i] = HUGE_VAL; }
+    if (ky) { /* caps */
+      double c0 = (-h - y)/ky, c1 = (h - y)/ky;
+      t_in[i]  = fmax(t_in[i],  fmin(c0, c1));
+      t_out[i] = fmin(t_out[i], fmax(c0, c1));
+    } else if (fabs(y) > h) break;
+    if (t_in[i] >= t_out[i]) break;
+  }
+  if (!i) return 0;
+  *l0 = t_in[0]; *l3 = t_out[0];
+  if (i == 2) { *l1 = t_in[1]; *l2 = t_out[1]; }
+  else *l1 = *l2 = *l3; /* no empty space inside */
+  return 1;
+} // fluo_shape_cylinder
+
+/* fluo_shape_box: centred box, with an optional centred hole */
+int fluo_shape_box(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz) {
+  double k = sqrt(kx*kx+ky*ky+kz*kz), o[3]={x,y,z}, inv[3], t_in[2], t_out[2];
+  int    i, a;
+
+  if (!k) return 0;
+  inv[0] = k/kx; inv[1] = k/ky; inv[2] = k/kz; /* shared by both surfaces, inf when 0 */
+  for (i=0; i <= shape->hollow; i++) {
+    double *size = i ? shape->inner : shape->outer;
+    t_in[i] = -HUGE_VAL; t_out[i] = HUGE_VAL;
+    for (a=0; a<3; a++) { /* slabs */
+      if (isinf(inv[a])) {
+        if (fabs(o[a]) > size[a]) break;
+      } else {
+        double s0 = (-size[a] - o[a])*inv[a], s1 = (size[a] - o[a])*inv[a];
+        if (s0 > s1) { double s = s0; s0 = s1; s1 = s; }
+        if (s0 > t_in[i])  t_in[i]  = s0;
+        if (s1 < t_out[i]) t_out[i] = s1;
+        if (t_in[i] >= t_out[i]) break;
+      }
+    }
+    if (a < 3) break;
+  }
+  if (!i) return 0;
+  *l0 = t_in[0]; *l3 = t_out[0];
+  if (i == 2) { *l1 = t_in[1]; *l2 = t_out[1]; }
+  else *l1 = *l2 = *l3;
+  return 1;
+} // fluo_shape_box
+
+/* fluo_shape_sphere: centred sphere, with an optional concentric hole */
+int fluo_shape_sphere(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz) {
+  double k = sqrt(kx*kx+ky*ky+kz*kz), B, C, D;
+
+  if (!k) return 0;
+  B = (x*kx + y*ky + z*kz)/k; /* shared by both surfaces */
+  C = x*x + y*y + z*z;
+  D = B*B - C + shape->outer[0]*shape->outer[0];
+  if (D < 0) return 0;
+  D = sqrt(D);
+  *l0 = -B - D; *l3 = -B + D;
+  D = B*B - C + shape->inner[0]*shape->inner[0];
+  if (shape->hollow && D >= 0) {
+    D = sqrt(D);
+    *l1 = -B - D; *l2 = -B + D;
+  } else *l1 = *l2 = *l3;
+  return 1;
+} // fluo_shape_sphere
+
+#ifdef USE_OFF
+/* fluo_shape_off: OFF/PLY mesh, through the BVH when available */
+static int fluo_shape_off(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz) {
+  int intersect = fluo_off_intersect(shape->bvh, l0, l3, x,y,z, kx,ky,kz, (off_struct*)shape->off);
+  *l1 = *l2 = *l3;
+  return intersect;
+} // fluo_shape_off
+
+int fluo_shape_init_off(struct fluo_shape_struct *shape, struct fluo_bvh_struct *bvh,
+  off_struct *off) {
+  memset(shape, 0, sizeof(struct fluo_shape_struct));
+  shape->type      = FLUO_SHAPE_OFF;
+  shape->bvh       = bvh;
+  shape->off       = off;
+  shape->intersect = fluo_shape_off;
+  return shape->type;
+} // fluo_shape_init_off
+#endif
+
+/* fluo_shape_inside: 0 outside, 1 in the material, 2 in the hole, -1 not supported */
+int fluo_shape_inside(struct fluo_shape_struct *shape, double x, double y, double z) {
+  int i;
+
+  for (i=0; i <= shape->hollow; i++) {
+    double *size = i ? shape->inner : shape->outer;
+    int     in;
+    switch (shape->type) {
+    case FLUO_SHAPE_CYLINDER:
+      in = x*x + z*z <= size[0]*size[0] && fabs(y) <= size[1];
+      break;
+    case FLUO_SHAPE_BOX:
+      in = fabs(x) <= size[0] && fabs(y) <= size[1] && fabs(z) <= size[2];
+      break;
+    case FLUO_SHAPE_SPHERE:
+      in = x*x + y*y + z*z <= size[0]*size[0];
+      break;
+    default:
+      return -1;
+    }
+    if (!in) return i; /* outside, or in the material around the hole */
+  }
+  return shape->hollow ? 2 : 1;
+} // fluo_shape_inside
+
+/* Delta tracking =========================================================== */
+
+int fluo_majorant_init(struct fluo_majorant_struct *majorant,
+  struct fluo_processes_struct *processes, struct fluo_xs_table_struct *table,
+  double Emin, double Emax) {
+  memset(majorant, 0, sizeof(struct fluo_majorant_struct));
+  majorant->nb        = FLUO_MAJORANT_DECADES*FLUO_MAJORANT_BINS;
+  majorant->sigma     = calloc(majorant->nb, sizeof(double));
+  majorant->processes = processes;
+  majorant->table     = table;
+  if (!majorant->sigma)
+    exit(fprintf(stderr, "%s: ERROR allocating majorant table\n", __FILE__));
+#ifdef _OPENMP
+  // no lazy bins when threads share the table: compute them all now
+  if (!(Emin > 0 && Emax > Emin)) {
+    Emin = FLUO_XS_TABLE_EMIN;
+    Emax = FLUO_XS_TABLE_EMAX;
+  }
+#endif
+  if (Emin > 0 && Emin < Emax) {
+    double E;
+    for (E=Emin; E < Emax*pow(10, 1.0/FLUO_MAJORANT_BINS); E *= pow(10, 1.0/FLUO_MAJORANT_BINS))
+      fluo_majorant(majorant, E);
+  }
+  return majorant->nb;
+} // fluo_majorant_init
+
+/* fluo_majorant_raise: set a bin to at least sigma, return its value
+ * Threads may raise the same bin: the update is serialised, and the bin read
+ * and written atomically.
+ */
+static double fluo_majorant_raise(struct fluo_majorant_struct *majorant, long bin, double sigma) {
+#ifdef _OPENMP
+#pragma omp critical (fluo_majorant)
+#endif
+  {
+    double current;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+    current = majorant->sigma[bin];
+    if (current < sigma) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      majorant->sigma[bin] = sigma;
+    } else sigma = current;
+  }
+  return sigma;
+} // fluo_majorant_raise
+
+/* fluo_majorant: the bin maximum is sampled on a grid and just above each edge */
+double fluo_majorant(struct fluo_majorant_struct *majorant, double E) {
+  struct fluo_xs_cache_entry entry;
+  double logE = log10(E), E_lo, E_hi, sigma=0;
+  long   bin  = (long)floor((logE - FLUO_MAJORANT_LOGE_MIN)*FLUO_MAJORANT_BINS);
+  int    i, n;
+
+  if (!(E > 0) || bin < 0 || bin >= majorant->nb) return 0;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+  sigma = majorant->sigma[bin];
+  if (sigma) return sigma;
+
+  n = majorant->table->nElements+1;
+  entry.cum_fluo     = malloc(3*n*sizeof(double));
+  if (!entry.cum_fluo)
+    exit(fprintf(stderr, "%s: ERROR allocating majorant entry\n", __FILE__));
+  entry.cum_Rayleigh = entry.cum_fluo+n;
+  entry.cum_Compton  = entry.cum_fluo+2*n;
+  E_lo = pow(10, FLUO_MAJORANT_LOGE_MIN + (double)bin/FLUO_MAJORANT_BINS);
+  E_hi = pow(10, FLUO_MAJORANT_LOGE_MIN + (double)(bin+1)/FLUO_MAJORANT_BINS);
+  for (i=0; i<=FLUO_MAJORANT_POINTS; i++)
+    sigma = fmax(sigma, fluo_processes_xsect(majorant->processes, majorant->table,
+      E_lo*pow(E_hi/E_lo, (double)i/FLUO_MAJORANT_POINTS), &entry));
+  for (i=0; i<majorant->table->nb_edges; i++) {
+    double edge = majorant->table->edges[i];
+    if (edge >= E_lo && edge < E_hi)
+      sigma = fmax(sigma, fluo_processes_xsect(majorant->processes, majorant->table,
+        edge*(1+1e-9), &entry));
+  }
+  free(entry.cum_fluo);
+  return fluo_majorant_raise(majorant, bin, sigma*FLUO_MAJORANT_MARGIN);
+} // fluo_majorant
+
+void fluo_majorant_free(struct fluo_majorant_struct *majorant) {
+  if (!majorant) return;
+  free(majorant->sigma);
+  majorant->sigma = NULL;
+} // fluo_majorant_free
+
+/* fluo_delta_track: one flight, with virtual collisions and point location only */
+int fluo_delta_track(struct fluo_majorant_struct *majorant, struct fluo_shape_struct *shape,
+  struct fluo_cache_struct *cache, struct fluo_tally_struct *tally, double rho, double E,
+  double x, double y, double z, double kx, double ky, double kz,
+  double *dl, struct fluo_xs_cache_entry **entry, struct fluo_rng_struct *rng) {
+  double sigma_max = fluo_majorant(majorant, E), mu_max, k, s=0;
+  int    hit;
+
+  k = sqrt(kx*kx+ky*ky+kz*kz);
+  if (!sigma_max || !k || shape->type < FLUO_SHAPE_CYLINDER || shape->type > FLUO_SHAPE_SPHERE)
+    return -1;
+  kx /= k; ky /= k; kz /= k;
+
+  // the material is homogeneous: sigma(E) is the same at every collision
+  *entry = fluo_cache_xs(cache, E, &hit);
+  if (!hit) fluo_processes_xsect(majorant->processes, majorant->table, E, *entry);
+  if ((*entry)->sigma > sigma_max) {
+    // the majorant is too low: raise it before this flight is sampled
+    tally->delta_violations++;
+    sigma_max = fluo_majorant_raise(majorant,
+      (long)floor((log10(E) - FLUO_MAJORANT_LOGE_MIN)*FLUO_MAJORANT_BINS),
+      (*entry)->sigma*FLUO_MAJORANT_MARGIN);
+  }
+  mu_max = rho*100*sigma_max; /* [1/m], as in TRACE */
+
+  for (;;) {
+    int where;
+    s    += -log(1-fluo_rand01(rng))/mu_max;
+    where = fluo_shape_inside(shape, x+s*kx, y+s*ky, z+s*kz);
+    if (!where) return 0;         /* left the (convex) sample */
+    if (where == 2) { tally->delta_virtual++; continue; }
+    if (fluo_rand01(rng)*sigma_max < (*entry)->sigma) {
+      tally->delta_real++;
+      *dl = s;
+      return 1;
+    }
+    tally->delta_virtual++;
+  }
+} // fluo_delta_track
+
+/* Differential cross section sampling ====================================== */
+
+int fluo_dcs_init(struct fluo_dcs_struct *dcs, struct compoundData *compound,
+  double Emin, double Emax) {
+  int i;
+
+  memset(dcs, 0, sizeof(struct fluo_dcs_struct));
+  dcs->nElements = compound->nElements;
+  dcs->nb        = FLUO_DCS_DECADES*FLUO_DCS_BINS;
+  dcs->Z         = malloc(dcs->nElements*sizeof(int));
+  dcs->mu        = calloc(2*dcs->nElements*dcs->nb, sizeof(double*));
+  if (!dcs->Z || !dcs->mu)
+    exit(fprintf(stderr, "%s: ERROR allocating DCS tables\n", __FILE__));
+  for (i=0; i<dcs->nElements; i++) dcs->Z[i] = compound->Elements[i];
+#ifdef _OPENMP
+  // no lazy bins when threads share the tables: compute them all now
+  if (!(Emin > 0 && Emax > Emin)) {
+    Emin = FLUO_XS_TABLE_EMIN;
+    Emax = FLUO_XS_TABLE_EMAX;
+  }
+#endif
+  if (Emin > 0 && Emin < Emax) {
+    double E;
+    for (E=Emin; E < Emax*pow(10, 1.0/FLUO_DCS_BINS); E *= pow(10, 1.0/FLUO_DCS_BINS))
+      for (i=0; i<dcs->nElements; i++) {
+        double kx=0, ky=0, kz=1, kf[3], sa;
+        fluo_dcs_sample(dcs, RAYLEIGH, i, E, kx,ky,kz, &kf[0],&kf[1],&kf[2], &sa, NULL);
+        fluo_dcs_sample(dcs, COMPTON,  i, E, kx,ky,kz, &kf[0],&kf[1],&kf[2], &sa, NULL);
+      }
+  }
+  return dcs->nb;
+} // fluo_dcs_init
+
+/* fluo_dcs_quantiles: cos(theta) quantiles of the DCS at energy E [keV]
+ * The DCS is integrated over cos(theta) on a regular theta grid, so that
+ * forward peaks are resolved, then the CDF is inverted linearly.
+ */
+static double *fluo_dcs_quantiles(int type, int Z, double E) {
+  double *cdf = malloc((FLUO_DCS_GRID+1)*sizeof(double));
+  double *mu  = malloc((FLUO_DCS_QUANTILES+1)*sizeof(double));
+  double  d0, d1, c0, c1;
+  int     g, j;
+
+  if (!cdf || !mu)
+    exit(fprintf(stderr, "%s: ERROR allocating DCS quantiles\n", __FILE__));
+  // from theta=PI (cos=-1) to theta=0 (cos=1)
+  cdf[0] = 0;
+  c0 = -1;
+  d0 = type == RAYLEIGH ? DCSb_Rayl(Z, E, PI, NULL) : DCSb_Compt(Z, E, PI, NULL);
+  for (g=1; g<=FLUO_DCS_GRID; g++) {
+    double theta = PI*(FLUO_DCS_GRID-g)/FLUO_DCS_GRID;
+    c1 = cos(theta);
+    d1 = type == RAYLEIGH ? DCSb_Rayl(Z, E, theta, NULL) : DCSb_Compt(Z, E, theta, NULL);
+    cdf[g] = cdf[g-1] + (d0 > 0 ? d0 : 0)/2*(c1-c0) + (d1 > 0 ? d1 : 0)/2*(c1-c0);
+    c0 = c1; d0 = d1;
+  }
+  if (!(cdf[FLUO_DCS_GRID] > 0)) {
+    // no DCS here: uniform
+    for (j=0; j<=FLUO_DCS_QUANTILES; j++) mu[j] = -1 + 2.0*j/FLUO_DCS_QUANTILES;
+    free(cdf);
+    return mu;
+  }
+  mu[0] = -1;
+  for (g=0, j=1; j<FLUO_DCS_QUANTILES; j++) {
+    double u = cdf[FLUO_DCS_GRID]*j/FLUO_DCS_QUANTILES;
+    while (g < FLUO_DCS_GRID-1 && cdf[g+1] < u) g++;
+    c0 = cos(PI*(FLUO_DCS_GRID-g)/FLUO_DCS_GRID);
+    c1 = cos(PI*(FLUO_DCS_GRID-g-1)/FLUO_DCS_GRID);
+    mu[j] = cdf[g+1] > cdf[g] ? c0 + (c1-c0)*(u-cdf[g])/(cdf[g+1]-cdf[g]) : c0;
+    if (mu[j] < mu[j-1]) mu[j] = mu[j-1];
+  }
+  mu[FLUO_DCS_QUANTILES] = 1;
+  free(cdf);
+  return mu;
+} // fluo_dcs_quantiles
+
+/* fluo_dcs_sample: cos(theta) from the inverse CDF, then a uniform azimuth.
+ * The density in cos(theta) is 1/(N dmu) in the quantile interval dmu.
+ */
+double fluo_dcs_sample(struct fluo_dcs_struct *dcs, int type, int i_Z, double E,
+  double kx, double ky, double kz, double *kf_x, double *kf_y, double *kf_z,
+  double *solid_angle, struct fluo_rng_struct *rng) {
+  long   bin = (long)floor((log10(E) - FLUO_DCS_LOGE_MIN)*FLUO_DCS_BINS), j;
+  double **table, *mu, u, c, kf[3];
+  double k = sqrt(kx*kx+ky*ky+kz*kz);
+
+  if (!(E > 0) || bin < 0 || bin >= dcs->nb || i_Z < 0 || i_Z >= dcs->nElements
+    || (type != RAYLEIGH && type != COMPTON) || !(k > 0)) return -1;
+  table = &dcs->mu[(2*i_Z+type-RAYLEIGH)*dcs->nb + bin];
+  if (!*table)
+    *table = fluo_dcs_quantiles(type, dcs->Z[i_Z],
+      pow(10, FLUO_DCS_LOGE_MIN + (bin+0.5)/FLUO_DCS_BINS));
+  mu = *table;
+
+  u = fluo_rand01(rng)*FLUO_DCS_QUANTILES;
+  j = (long)u;
+  if (j >= FLUO_DCS_QUANTILES) j = FLUO_DCS_QUANTILES-1;
+  c = mu[j] + (u-j)*(mu[j+1]-mu[j]);
+  fluo_cone_direction(kx,ky,kz, c, sqrt(fmax(0, 1-c*c)), NULL, 0,0,0, kf, rng);
+  *solid_angle = 2*PI*FLUO_DCS_QUANTILES*(mu[j+1]-mu[j]);
+  *kf_x = kf[0]; *kf_y = kf[1]; *kf_z = kf[2];
+  return acos(c);
+} // fluo_dcs_sample
+
+void fluo_dcs_free(struct fluo_dcs_struct *dcs) {
+  long i;
+
+  if (!dcs || !dcs->mu) return;
+  for (i=0; i<2*dcs->nElements*dcs->nb; i++) free(dcs->mu[i]);
+  free(dcs->mu);
+  free(dcs->Z);
+  dcs->mu = NULL;
+  dcs->Z  = NULL;
+} // fluo_dcs_free
+
+/* Shared materials ========================================================= */
+
+static struct fluo_material_struct *fluo_materials = NULL; /* registry, for the process */
+
+struct fluo_material_struct *fluo_material_acquire(char *material, char *reflections,
+  double *par, int nb_par) {
+  struct fluo_material_struct *entry;
+
+  if (nb_par > FLUO_MATERIAL_PAR) nb_par = FLUO_MATERIAL_PAR;
+  if (reflections && (!strlen(reflections) || !strcmp(reflections, "NULL") || !strcmp(reflections, "0")))
+    reflections = NULL;
+  for (entry = fluo_materials; entry; entry = entry->next) {
+    if (strcmp(entry->name, material) || entry->nb_par != nb_par
+     || (entry->reflections ? !reflections || strcmp(entry->reflections, reflections) : reflections != NULL)
+     || memcmp(entry->par, par, nb_par*sizeof(double)))
+      continue;
+    entry->refcount++;
+    return entry;
+  }
+  entry = calloc(1, sizeof(struct fluo_material_struct));
+  if (!entry || !(entry->name = strdup(material))
+   || (reflections && !(entry->reflections = strdup(reflections))))
+    exit(fprintf(stderr, "%s: ERROR allocating material %s\n", __FILE__, material));
+  entry->nb_par   = nb_par;
+  memcpy(entry->par, par, nb_par*sizeof(double));
+  entry->refcount = 1;
+  entry->next     = fluo_materials;
+  fluo_materials  = entry;
+  return entry;
+} // fluo_material_acquire
+
+void fluo_material_release(struct fluo_material_struct *entry) {
+  struct fluo_material_struct **prev;
+  int i;
+
+  if (!entry || --entry->refcount > 0) return;
+  for (prev = &fluo_materials; *prev && *prev != entry; prev = &(*prev)->next) ;
+  if (*prev) *prev = entry->next;
+  fluo_dcs_free(&entry->dcs);
+  fluo_line_store_free(&entry->line_info);
+  if (entry->lines) {
+    for (i=0; i<entry->compound->nElements; i++) fluo_lines_free(&entry->lines[i]);
+    free(entry->lines);
+  }
+  fluo_xs_table_free(&entry->xs_table);
+  if (entry->compound) FreeCompoundData(entry->compound);
+  free(entry->reflections);
+  free(entry->name);
+  free(entry);
+} // fluo_material_release
+
+/* Node-shared tables ======================================================= */
+
+#ifdef USE_MPI
+static MPI_Comm fluo_node_comm  = MPI_COMM_NULL; /* ranks of this host */
+#endif
+static int      fluo_node_me    = -1;            /* rank on the host, -1 until set */
+static int      fluo_node_ranks = 1;
+static int      fluo_node_segments = 0;          /* segments created, for their names */
+
+int fluo_node_rank(int *size)
+{
+  if (fluo_node_me < 0) {
+    fluo_node_me = 0;
+#ifdef USE_MPI
+    int flag = 0;
+    MPI_Initialized(&flag);
+    if (flag && MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mpi_node_rank,
+        MPI_INFO_NULL, &fluo_node_comm) == MPI_SUCCESS) {
+      MPI_Comm_rank(fluo_node_comm, &fluo_node_me);
+      MPI_Comm_size(fluo_node_comm, &fluo_node_ranks);
+    }
+#endif
+  }
+  if (size) *size = fluo_node_ranks;
+  return fluo_node_me;
+} // fluo_node_rank
+
+int fluo_node_bcast(int value)
+{
+#ifdef USE_MPI
+  if (fluo_node_rank(NULL) >= 0 && fluo_node_ranks > 1)
+    MPI_Bcast(&value, 1, MPI_INT, 0, fluo_node_comm);
+#endif
+  return value;
+} // fluo_node_bcast
+
+#if defined(USE_MPI) && !defined(_WIN32)
+/* fluo_node_barrier: wait for all ranks of the host */
+static void fluo_node_barrier(void)
+{
+  if (fluo_node_rank(NULL) >= 0 && fluo_node_ranks > 1)
+    MPI_Barrier(fluo_node_comm);
+} // fluo_node_barrier
+#endif
+
+void fluo_node_path(char *path, char *name)
+{
+  // the leader process id tells this run apart from others on the host
+  int pid = fluo_node_bcast((int)getpid());
+  snprintf(path, 1024, "%s/fluo-%d-%d-%s", FLUO_NODE_DIR, pid, fluo_node_segments++, name);
+} // fluo_node_path
+
+void fluo_node_unmap(void *map, size_t size)
+{
+#ifndef _WIN32
+  if (map && size) munmap(map, size);
+#endif
+} // fluo_node_unmap
+
+int fluo_line_store_share(struct fluo_line_info_struct *line_info)
+{
+#if defined(USE_MPI) && !defined(_WIN32)
+  char path[1024];
+  int  nodes, rank = fluo_node_rank(&nodes), ok = 0;
+
+  if (nodes < 2) return line_info->count;
+  // nothing to do when the leader has no lines, or has them mapped from the cache
+  if (!fluo_node_bcast(line_info->count > 0 && !line_info->store_mapped))
+    return line_info->count;
+  fluo_node_path(path, "lines");
+  if (!rank) ok = fluo_line_cache_write(line_info, path);
+  if (fluo_node_bcast(ok)) {
+    fluo_line_cache_map(line_info, path); // keeps the own store, if any, on failure
+    // the segment is removed once all ranks have mapped it
+    fluo_node_barrier();
+    if (!rank) unlink(path);
+  }
+#endif
+  return line_info->count;
+} // fluo_line_store_share
+
+/* fluo_line_store_build: read and weight the lines, and store them in the cache */
+static int fluo_line_store_build(struct fluo_line_info_struct *line_info, char *reflections,
+  double packing_factor, char *cache_path)
+{
+  if (!fluo_read_line_data(reflections, line_info)) return 0;
+  // per-line cross sections and k-independent prefix sums, for O(log N)
+  // line cut-off and selection
+  fluo_line_store_weights(line_info, packing_factor);
+  if (cache_path) MPI_MASTER(fluo_line_cache_save(line_info, cache_path););
+  return line_info->count;
+} // fluo_line_store_build
+
+int fluo_line_store_read(struct fluo_line_info_struct *line_info, char *reflections,
+  double packing_factor, char *cache_dir)
+{
+  char cache_path[1024];
+  int  rank = fluo_node_rank(NULL), count = 0, cached;
+
+  // map the sorted lines and their weights from a previous run, when cached.
+  // The node leader decides for the host, so that all its ranks go the same way.
+  cached = fluo_line_cache_path(cache_path, cache_dir, reflections, line_info, packing_factor);
+  if (cached && !rank) count = fluo_line_cache_load(line_info, cache_path);
+  if (fluo_node_bcast(count > 0)) {
+    if (rank) count = fluo_line_cache_map(line_info, cache_path);
+  } else {
+    if (!rank) count = fluo_line_store_build(line_info, reflections, packing_factor,
+      cached ? cache_path : NULL);
+    count = fluo_line_store_share(line_info);
+  }
+  // without MPI sharing, each rank reads the reflections
+  if (!count && rank)
+    count = fluo_line_store_build(line_info, reflections, packing_factor, NULL);
+  return count;
+} // fluo_line_store_read
+
+#define FLUO_XS_SHARE_MAGIC "FLUOXSTB"
+
+/* node segment of a cross-section table: header, data[nE][stride], exact[nE] */
+struct fluo_xs_share_header {
+  char   magic[8];
+  int    stride;
+  int    pad;
+  long long i_min, nE;
+  double dlogE;
+};
+
+long fluo_xs_table_share(struct fluo_xs_table_struct *table)
+{
+#if defined(USE_MPI) && !defined(_WIN32)
+  struct fluo_xs_share_header header;
+  struct stat st;
+  char   path[1024];
+  void  *map;
+  FILE  *file;
+  int    nodes, rank = fluo_node_rank(&nodes), ok = 0, fd;
+
+  if (nodes < 2) return table->nE;
+  if (!fluo_node_bcast(table->nE > 0 && !table->mapped)) return table->nE;
+  fluo_node_path(path, "xs");
+  if (!rank) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FLUO_XS_SHARE_MAGIC, sizeof(header.magic));
+    header.stride = table->stride;
+    header.i_min  = table->i_min;
+    header.nE     = table->nE;
+    header.dlogE  = table->dlogE;
+    file = fopen(path, "wb");
+    if (file) {
+      ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(table->data, sizeof(double), table->nE*table->stride, file) == (size_t)(table->nE*table->stride)
+        && fwrite(table->exact, 1, table->nE, file) == (size_t)table->nE;
+      ok = !fclose(file) && ok;
+    }
+    if (!ok) {
+      unlink(path);
+      fprintf(stderr, "%s: WARNING: could not write shared table %s\n", __FILE__, path);
+    }
+  }
+  if (!fluo_node_bcast(ok)) return table->nE;
+
+  fd  = open(path, O_RDONLY);
+  map = MAP_FAILED;
+  if (fd >= 0) {
+    if (!fstat(fd, &st) && st.st_size >= (long long)sizeof(header))
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  if (map != MAP_FAILED) {
+    struct fluo_xs_share_header *h = (struct fluo_xs_share_header*)map;
+    if (!memcmp(h->magic, FLUO_XS_SHARE_MAGIC, sizeof(h->magic)) && h->stride == table->stride
+      && h->dlogE == table->dlogE && st.st_size == (long long)(sizeof(header)
+        + h->nE*table->stride*sizeof(double) + h->nE)) {
+      free(table->data); free(table->exact);
+      table->data   = (double*)(h+1);
+      table->exact  = (char*)(table->data + h->nE*table->stride);
+      table->i_min  = h->i_min;
+      table->nE     = h->nE;
+      table->map    = map;
+      table->mapped = st.st_size;
+    } else munmap(map, st.st_size);
+  }
+  // the segment is removed once all ranks have mapped it
+  fluo_node_barrier();
+  if (!rank) unlink(path);
+#endif
+  return table->nE;
+} // fluo_xs_table_share
+
+void fluo_node_report(struct fluo_material_struct *material, double t0, char *compname)
+{
+  struct fluo_line_info_struct *lines = &material->line_info;
+  struct fluo_xs_table_struct  *table = &material->xs_table;
+  double bytes[2] = { 0, 0 }; /* allocated by this rank, mapped (one copy per host) */
+  double single, seconds = fluo_seconds()-t0;
+  int    nodes = 1;
+
+  if (lines->count) {
+    if (lines->store_mapped) bytes[1] += lines->store_mapped;
+    else bytes[0] += fluo_line_cache_store_size(lines->padded);
+  }
+  if (table->nE) {
+    if (table->mapped) bytes[1] += table->mapped;
+    else bytes[0] += table->nE*(table->stride*sizeof(double)+1);
+  }
+  single = bytes[0]+bytes[1];
+#ifdef USE_MPI
+  fluo_node_rank(&nodes);
+  if (nodes > 1) {
+    MPI_Allreduce(MPI_IN_PLACE, &bytes[0], 1, MPI_DOUBLE, MPI_SUM, fluo_node_comm);
+    MPI_Allreduce(MPI_IN_PLACE, &bytes[1], 1, MPI_DOUBLE, MPI_MAX, fluo_node_comm);
+    MPI_Allreduce(MPI_IN_PLACE, &single,   1, MPI_DOUBLE, MPI_MAX, fluo_node_comm);
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &seconds, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+  MPI_MASTER(
+  printf("%s: material tables %.3g MB per host (%i rank%s, %.3g MB without sharing), "
+    "initialisation %.3g s\n", compname, (bytes[0]+bytes[1])/1e6, nodes, nodes > 1 ? "s" : "",
+    nodes*single/1e6, seconds);
+  );
+} // fluo_node_report
+
+/* Multi-phase samples ====================================================== */
+
+/* fluo_phase_field: copy the next field of 'spec' (up to 'sep' or end) without
+ * surrounding spaces, and return the position after the separator */
+static char *fluo_phase_field(char *spec, char sep, char *field, size_t size) {
+  char  *end = spec;
+  size_t n;
+
+  while (*end && *end != sep) end++;
+  while (spec < end && isspace((unsigned char)*spec)) spec++;
+  n = end - spec;
+  while (n && isspace((unsigned char)spec[n-1])) n--;
+  if (n >= size) n = size-1;
+  memcpy(field, spec, n);
+  field[n] = '\0';
+  return *end ? end+1 : end;
+} // fluo_phase_field
+
+int fluo_phases_parse(char *spec, struct fluo_phase_struct *phase, int max) {
+  char   item[4096], field[1024], *next, *pos;
+  double rest = 1;
+  int    nb = 0, nb_unset = 0, i, f;
+
+  if (!spec || !strlen(spec) || !strcmp(spec, "NULL") || !strcmp(spec, "0")) return 0;
+  for (next = spec; *next && nb < max; ) {
+    next = fluo_phase_field(next, ';', item, sizeof(item));
+    if (!strlen(item)) continue;
+    memset(&phase[nb], 0, sizeof(struct fluo_phase_struct));
+    pos = fluo_phase_field(item, ',', phase[nb].material, sizeof(phase[nb].material));
+    pos = fluo_phase_field(pos,  ',', phase[nb].reflections, sizeof(phase[nb].reflections));
+    if (!strcmp(phase[nb].reflections, "NULL") || !strcmp(phase[nb].reflections, "0"))
+      phase[nb].reflections[0] = '\0';
+    for (f=0; f<3; f++) { /* fraction, packing, density */
+      double value;
+      pos   = fluo_phase_field(pos, ',', field, sizeof(field));
+      value = strlen(field) ? atof(field) : 0;
+      if (f == 0)      phase[nb].fraction = value;
+      else if (f == 1) phase[nb].packing  = value > 0 && value < 1 ? value : 1;
+      else             phase[nb].density  = value;
+    }
+    if (!strlen(phase[nb].material) || phase[nb].fraction < 0) {
+      fprintf(stderr, "%s: ERROR invalid phase '%s' in '%s'\n", __FILE__, item, spec);
+      return 0;
+    }
+    if (phase[nb].fraction) rest -= phase[nb].fraction;
+    else nb_unset++;
+    nb++;
+  }
+  if (*next)
+    fprintf(stderr, "%s: WARNING only the first %i phases of '%s' are used\n", __FILE__, max, spec);
+  // phases without fraction share the rest of the volume
+  for (i=0; i<nb; i++)
+    if (!phase[i].fraction) phase[i].fraction = rest > 0 ? rest/nb_unset : 0;
+  return nb;
+} // fluo_phases_parse
+
+int fluo_phase_init(struct fluo_phase_struct *phase, double DW, double delta_d_d,
+  char *cache_dir, char *compname) {
+  struct fluo_line_info_struct *line_info = &phase->line_info;
+  char       formula[65536];
+  xrl_error *error = NULL;
+  FILE      *file;
+  int        i;
+
+  // a structure file holds the formula
+  strncpy(formula, phase->material, sizeof(formula)-1);
+  formula[sizeof(formula)-1] = '\0';
+  if ((file = Open_File(phase->material, "r", NULL)) != NULL) {
+    fclose(file);
+    formula[0] = '\0';
+    if (!fluo_get_material(phase->material, formula))
+      exit(fprintf(stderr, "ERROR: %s: file %s does not contain material formulae.\n",
+        compname, phase->material));
+  }
+  phase->compound = CompoundParser(formula, &error);
+  if (error != NULL || !phase->compound)
+    exit(fprintf(stderr, "ERROR: %s: Invalid phase material %s: %s\n",
+      compname, phase->material, error ? error->message : ""));
+  xrl_error_free(error);
+  phase->weight = phase->compound->molarMass;
+  if (phase->density <= 0)
+    for (i=0; i<phase->compound->nElements; i++)
+      phase->density += phase->compound->massFractions[i]*ElementDensity(phase->compound->Elements[i], NULL);
+
+  // powder lines, weighted with the packing of the phase
+  memset(line_info, 0, sizeof(struct fluo_line_info_struct));
+  if (!strlen(phase->reflections)) return 1;
+  line_info->Dd          = delta_d_d;
+  line_info->DWfactor    = DW;
+  line_info->pow_density = phase->density;
+  line_info->at_weight   = phase->weight;
+  line_info->at_nb       = 1;
+  line_info->flag_barns  = 1;
+  strncpy(line_info->compname, compname, sizeof(line_info->compname)-1);
+  if (!fluo_line_store_read(line_info, phase->reflections, phase->packing, cache_dir))
+    exit(fprintf(stderr, "FluoPowder %s: reflection file %s is not valid.\n"
+      "ERROR    Please check file format.\n", compname, phase->reflections));
+  // without unit cell volume the lines get no cross section, and would be lost
+  if (!line_info->my_s_k2_cum)
+    exit(fprintf(stderr, "FluoPowder %s: reflection file %s of phase %s has no unit cell volume.\n"
+      "ERROR    Please set Vc or V_0 in its header.\n", compname, phase->reflections, phase->material));
+  return 1;
+} // fluo_phase_init
+
+struct compoundData *fluo_compound_mix(struct compoundData **compound, double *w, int nb) {
+  struct compoundData *mix = calloc(1, sizeof(struct compoundData));
+  int    j, i, k, n = 0, size = 0;
+
+  for (j=0; j<nb; j++) size += compound[j]->nElements;
+  if (!mix || !(mix->Elements = calloc(size, sizeof(int)))
+   || !(mix->massFractions = calloc(size, sizeof(double)))
+   || !(mix->nAtoms = calloc(size, sizeof(double))))
+    exit(fprintf(stderr, "%s: ERROR allocating compound mixture\n", __FILE__));
+  // union of the elements, kept sorted by Z as from CompoundParser
+  for (j=0; j<nb; j++)
+    for (i=0; i<compound[j]->nElements; i++) {
+      int Z = compound[j]->Elements[i];
+      for (k=0; k<n && mix->Elements[k] < Z; k++) ;
+      if (k == n || mix->Elements[k] != Z) {
+        memmove(mix->Elements+k+1,      mix->Elements+k,      (n-k)*sizeof(int));
+        memmove(mix->massFractions+k+1, mix->massFractions+k, (n-k)*sizeof(double));
+        memmove(mix->nAtoms+k+1,        mix->nAtoms+k,        (n-k)*sizeof(double));
+        mix->Elements[k] = Z; mix->massFractions[k] = mix->nAtoms[k] = 0;
+        n++;
+      }
+      mix->massFractions[k] += w[j]*compound[j]->massFractions[i];
+      if (compound[j]->nAtoms) mix->nAtoms[k] += w[j]*compound[j]->nAtoms[i];
+    }
+  mix->nElements = n;
+  for (k=0; k<n; k++) mix->nAtomsAll += mix->nAtoms[k];
+  for (j=0; j<nb; j++) mix->molarMass += w[j]*compound[j]->molarMass;
+  return mix;
+} // fluo_compound_mix
+
+/* lines of all stores, with their scaled cross sections, to sort by q */
+struct fluo_line_merge {
+  struct fluo_line_data line; /* first, for fluo_PN_list_compare */
+  double my_s_k2;
+};
+
+int fluo_line_store_merge(struct fluo_line_info_struct *dest,
+  struct fluo_line_info_struct **src, double *w, int nb) {
+  struct fluo_line_merge *merge;
+  struct fluo_line_data  *list;
+  int    j, i, n = 0, size = 0;
+
+  for (j=0; j<nb; j++) if (src[j]->my_s_k2_cum) size += src[j]->count;
+  fluo_line_store_init(dest, NULL, 0);
+  if (!size) return 0;
+  merge = calloc(size, sizeof(struct fluo_line_merge));
+  list  = calloc(size, sizeof(struct fluo_line_data));
+  if (!merge || !list)
+    exit(fprintf(stderr, "%s: ERROR allocating merged powder lines (%i lines)\n", __FILE__, size));
+  for (j=0; j<nb; j++) {
+    if (!src[j]->my_s_k2_cum) continue; /* no weights, e.g. without Vc */
+    for (i=0; i<src[j]->count; i++, n++) {
+      merge[n].line.q        = src[j]->q[i];
+      merge[n].line.j        = src[j]->j[i];
+      merge[n].line.F2       = src[j]->F2[i];
+      merge[n].line.DWfactor = src[j]->DW[i];
+      merge[n].line.w        = src[j]->w[i];
+      merge[n].line.Epsilon  = src[j]->strain[i];
+      merge[n].my_s_k2       = w[j]*src[j]->my_s_k2[i];
+    }
+  }
+  qsort(merge, n, sizeof(struct fluo_line_merge), fluo_PN_list_compare);
+  for (i=0; i<n; i++) list[i] = merge[i].line;
+  fluo_line_store_init(dest, list, n);
+  dest->my_s_k2_cum[0] = 0;
+  for (i=0; i<n; i++) {
+    dest->my_s_k2[i]       = merge[i].my_s_k2;
+    dest->my_s_k2_cum[i+1] = dest->my_s_k2_cum[i] + dest->my_s_k2[i];
+  }
+  free(list);
+  free(merge);
+  return n;
+} // fluo_line_store_merge
+
+int fluo_phases_mix(struct fluo_phase_struct *phase, int nb,
+  struct fluo_material_struct *material, char *compname) {
+  struct compoundData          *compound[FLUO_PHASE_MAX];
+  struct fluo_line_info_struct *lines[FLUO_PHASE_MAX];
+  double w[FLUO_PHASE_MAX], sum_f = 0, sum_a = 0;
+  int    j;
+
+  if (nb <= 0 || nb > FLUO_PHASE_MAX) return 0;
+  for (j=0; j<nb; j++) sum_f += phase[j].fraction;
+  if (sum_f > 1) {
+    MPI_MASTER(printf("%s: phase fractions sum to %g. Scaled to 1.\n", compname, sum_f););
+    for (j=0; j<nb; j++) phase[j].fraction /= sum_f;
+  }
+  // atoms (formula units) per volume in each phase, up to Avogadro's number
+  material->density = 0;
+  for (j=0; j<nb; j++) {
+    double d = phase[j].fraction*phase[j].packing*phase[j].density;
+    phase[j].atoms = phase[j].weight > 0 ? d/phase[j].weight : 0;
+    material->density += d;
+    sum_a += phase[j].atoms;
+  }
+  if (sum_a <= 0)
+    exit(fprintf(stderr, "ERROR: %s: the phases contain no material.\n", compname));
+  material->weight = material->density/sum_a;
+  for (j=0; j<nb; j++) {
+    phase[j].atoms /= sum_a;
+    w[j]        = phase[j].atoms;
+    compound[j] = phase[j].compound;
+    lines[j]    = &phase[j].line_info;
+  }
+  material->compound = fluo_compound_mix(compound, w, nb);
+  material->compound->molarMass = material->weight;
+  fluo_line_store_merge(&material->line_info, lines, w, nb);
+
+  MPI_MASTER(
+    printf("%s: %i phases, density=%g [g/cm3], %i powder lines:\n",
+      compname, nb, material->density, material->line_info.count);
+    for (j=0; j<nb; j++)
+      printf("  | %-20s %6.2f %% volume, packing %4.2f, %8.3g [g/cm3], %6.2f %% atoms, %5i lines\n",
+        phase[j].material, phase[j].fraction*100, phase[j].packing, phase[j].density,
+        phase[j].atoms*100, phase[j].line_info.count);
+  )
+  return nb;
+} // fluo_phases_mix
+
+void fluo_phase_free(struct fluo_phase_struct *phase) {
+  if (!phase) return;
+  fluo_line_store_free(&phase->line_info);
+  if (phase->compound) FreeCompoundData(phase->compound);
+  phase->compound = NULL;
+} // fluo_phase_free
+
+/* Adaptive p_interact ====================================================== */
+
+/* fluo_adapt_index: log-energy bin of E [keV] */
+static int fluo_adapt_index(double E) {
+  int i = (int)floor(FLUO_ADAPT_BINS*log(E/FLUO_XS_TABLE_EMIN)/log(FLUO_XS_TABLE_EMAX/FLUO_XS_TABLE_EMIN));
+  return i < 0 ? 0 : (i >= FLUO_ADAPT_BINS ? FLUO_ADAPT_BINS-1 : i);
+} // fluo_adapt_index
+
+/* fluo_adapt_optimum: best forced fraction from the sums of both branches, or q
+ * when a branch has no photon yet */
+static double fluo_adapt_optimum(double *n, double *m2, double *ticks, double q) {
+  double a[2];
+  int    b;
+
+  for (b=0; b<2; b++) {
+    if (n[b] <= 0) return q;
+    a[b] = sqrt(m2[b]/n[b]/(ticks[b] > 0 ? ticks[b]/n[b] : 1));
+  }
+  if (!(a[0]+a[1] > 0)) return q;
+  q = a[1]/(a[0]+a[1]);
+  return q < FLUO_ADAPT_MIN ? FLUO_ADAPT_MIN : (q > FLUO_ADAPT_MAX ? FLUO_ADAPT_MAX : q);
+} // fluo_adapt_optimum
+
+void fluo_adapt_init(struct fluo_adapt_struct *adapt, double p_interact) {
+  int i;
+
+  memset(adapt, 0, sizeof(struct fluo_adapt_struct));
+  adapt->q0 = p_interact > 0 && p_interact <= 1 ? p_interact : FLUO_ADAPT_START;
+  if (adapt->q0 < FLUO_ADAPT_MIN) adapt->q0 = FLUO_ADAPT_MIN;
+  if (adapt->q0 > FLUO_ADAPT_MAX) adapt->q0 = FLUO_ADAPT_MAX;
+  for (i=0; i<FLUO_ADAPT_BINS; i++) adapt->bin[i].q = adapt->q0;
+} // fluo_adapt_init
+
+double fluo_adapt_get(struct fluo_adapt_struct *adapt, double E) {
+  return adapt->bin[fluo_adapt_index(E)].q;
+} // fluo_adapt_get
+
+void fluo_adapt_add(struct fluo_adapt_struct *adapt, double E, int branch, double q,
+  double w, double ticks) {
+  struct fluo_adapt_bin *bin;
+
+  if (!adapt || branch < 0) return; // the photon did not reach the first event
+  bin    = &adapt->bin[fluo_adapt_index(E)];
+  branch = branch ? 1 : 0;
+  bin->n[branch]++;
+  bin->m2[branch]    += (q*w)*(q*w);
+  bin->ticks[branch] += ticks;
+  if (++bin->since >= (bin->updates ? FLUO_ADAPT_PERIOD : FLUO_ADAPT_WARMUP)) {
+    bin->q     = fluo_adapt_optimum(bin->n, bin->m2, bin->ticks, bin->q);
+    bin->since = 0;
+    bin->updates++;
+  }
+} // fluo_adapt_add
+
+void fluo_adapt_report(struct fluo_adapt_struct *adapt, int nb, char *compname) {
+  double buffer[6*FLUO_ADAPT_BINS], n[2]={0,0}, m2[2]={0,0}, ticks[2]={0,0}, q0, total=0;
+  int    i, j, b;
+
+  if (!adapt || nb <= 0) return;
+  q0 = adapt[0].q0;
+  memset(buffer, 0, sizeof(buffer));
+  for (j=0; j<nb; j++)
+    for (i=0; i<FLUO_ADAPT_BINS; i++)
+      for (b=0; b<2; b++) {
+        buffer[6*i+b]   += adapt[j].bin[i].n[b];
+        buffer[6*i+2+b] += adapt[j].bin[i].m2[b];
+        buffer[6*i+4+b] += adapt[j].bin[i].ticks[b];
+      }
+#ifdef USE_MPI
+  mc_MPI_Sum(buffer, 6*FLUO_ADAPT_BINS);
+#endif
+  // the run value is the optimum of the sums pooled over all energy bins
+  for (i=0; i<FLUO_ADAPT_BINS; i++)
+    for (b=0; b<2; b++) {
+      n[b]     += buffer[6*i+b];
+      m2[b]    += buffer[6*i+2+b];
+      ticks[b] += buffer[6*i+4+b];
+    }
+  total = n[0]+n[1];
+  MPI_MASTER(
+    if (!total)
+      printf("%s: adaptive p_interact: no photon reached the sample\n", compname);
+    else {
+      printf("%s: adaptive p_interact=%.3g for this run (from %g, %.0f photons). Per energy:\n",
+        compname, fluo_adapt_optimum(n, m2, ticks, q0), q0, total);
+      for (i=0; i<FLUO_ADAPT_BINS; i++) {
+        double Emin = FLUO_XS_TABLE_EMIN*pow(FLUO_XS_TABLE_EMAX/FLUO_XS_TABLE_EMIN, (double)i/FLUO_ADAPT_BINS);
+        double Emax = Emin*pow(FLUO_XS_TABLE_EMAX/FLUO_XS_TABLE_EMIN, 1.0/FLUO_ADAPT_BINS);
+        if (buffer[6*i] + buffer[6*i+1] <= 0) continue;
+        printf("  | %8.3g - %8.3g [keV]: p_interact=%5.3f (%.0f transmitted, %.0f scattered)\n",
+          Emin, Emax, fluo_adapt_optimum(buffer+6*i, buffer+6*i+2, buffer+6*i+4, q0),
+          buffer[6*i], buffer[6*i+1]);
+      }
+    }
+  );
+} // fluo_adapt_report
+
+/* Event log ================================================================ */
+
+#include <stddef.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+/* fluo_event_keep: whole photon histories are kept, 1 in 'decimation', from a
+ * hash of the photon id compared to 2^32/decimation (no division per event) */
+static inline int fluo_event_keep(struct fluo_event_log *log, unsigned long long photon)
+{
+  return ((photon*0x9E3779B97F4A7C15ULL) >> 32) < log->threshold;
+} // fluo_event_keep
+
+/* fluo_event_drain: write the records of all rings, return their number */
+static long fluo_event_drain(struct fluo_event_log *log)
+{
+  long written = 0;
+  int  i;
+
+  for (i=0; i<log->nb; i++) {
+    struct fluo_event_ring *ring = &log->ring[i];
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+    while (tail != head) {
+      unsigned long first = tail & (FLUO_EVENT_RING-1), n = head - tail, j;
+      if (n > FLUO_EVENT_RING - first) n = FLUO_EVENT_RING - first; // up to the ring end
+      for (j=first; j<first+n; j++) ring->record[j].thread = i;
+      fwrite(&ring->record[first], sizeof(struct fluo_event_record), n, log->file);
+      tail    += n;
+      written += n;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+  log->count += written;
+  return written;
+} // fluo_event_drain
+
+#ifndef _WIN32
+/* fluo_event_writer: background thread, drains the rings until asked to stop */
+static void *fluo_event_writer(void *arg)
+{
+  struct fluo_event_log *log = (struct fluo_event_log*)arg;
+  struct timespec wait = { 0, 200000 }; /* 0.2 ms */
+
+  for (;;) {
+    int stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+    if (!fluo_event_drain(log)) {
+      if (stop) break; // nothing left after the last record was added
+      nanosleep(&wait, NULL);
+    }
+  }
+  return NULL;
+} // fluo_event_writer
+#endif
+
+struct fluo_event_log *fluo_event_open(char *filename, int nb, int decimation, char *compname)
+{
+  struct fluo_event_log   *log;
+  struct fluo_event_header header;
+  int i;
+
+  if (!filename || !strlen(filename) || !strcmp(filename, "NULL") || nb <= 0) return NULL;
+  log = calloc(1, sizeof(struct fluo_event_log));
+  if (!log) return NULL;
+  strncpy(log->filename, filename, sizeof(log->filename)-16);
+#ifdef USE_MPI
+  if (mpi_node_count > 1)
+    sprintf(log->filename+strlen(log->filename), "_%d", mpi_node_rank);
+#endif
+  log->nb         = nb;
+  log->decimation = decimation > 1 ? decimation : 1;
+  log->threshold  = (1ULL << 32)/log->decimation;
+  log->ring       = calloc(nb, sizeof(struct fluo_event_ring));
+  log->file       = fopen(log->filename, "wb");
+  for (i=0; log->ring && i<nb; i++) {
+    log->ring[i].record = calloc(FLUO_EVENT_RING, sizeof(struct fluo_event_record));
+    if (!log->ring[i].record) break;
+  }
+  if (!log->file || !log->ring || i < nb) {
+    fprintf(stderr, "%s: %s: WARNING: can not create the event log %s. Skipping.\n",
+      __FILE__, compname, log->filename);
+    if (log->file) fclose(log->file);
+    for (i=0; log->ring && i<nb; i++) free(log->ring[i].record);
+    free(log->ring); free(log);
+    return NULL;
+  }
+
+  // the record count is set at the end
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FLUO_EVENT_MAGIC, sizeof(header.magic));
+  header.version     = FLUO_EVENT_VERSION;
+  header.record_size = sizeof(struct fluo_event_record);
+  header.endian      = 0x01020304;
+  header.decimation  = log->decimation;
+  strncpy(header.compname, compname, sizeof(header.compname)-1);
+  fwrite(&header, sizeof(header), 1, log->file);
+
+#ifndef _WIN32
+  log->threaded = !pthread_create(&log->writer, NULL, fluo_event_writer, log);
+#endif
+  MPI_MASTER(
+  printf("%s: logging scattering events into %s (1 photon in %d)\n",
+    compname, log->filename, log->decimation);
+  );
+  return log;
+} // fluo_event_open
+
+void fluo_event_scatter(struct fluo_event_log *log, int thread, unsigned long long photon,
+  int type, int index, int Z, int order, double Ei, double Ef, double cos_theta, double p,
+  double x, double y, double z)
+{
+  struct fluo_event_ring   *ring;
+  struct fluo_event_record *record;
+  unsigned long head;
+
+  if (!log || !fluo_event_keep(log, photon)) return;
+  ring = &log->ring[thread];
+  head = ring->head;
+  // wait for the writer when the ring is full
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= FLUO_EVENT_RING) {
+    ring->stalls++;
+    if (log->threaded) {
+#ifndef _WIN32
+      sched_yield();
+#endif
+    } else {
+#ifdef _OPENMP
+#pragma omp critical (fluo_event_drain)
+#endif
+      fluo_event_drain(log);
+    }
+  }
+  // thread is set by the writer, pad stays 0 from the allocation
+  record = &ring->record[head & (FLUO_EVENT_RING-1)];
+  record->photon    = photon;
+  record->Ei        = Ei;
+  record->Ef        = Ef;
+  record->cos_theta = cos_theta;
+  record->p         = p;
+  record->x         = x; record->y = y; record->z = z;
+  record->index     = index;
+  record->Z         = Z;
+  record->type      = type;
+  record->order     = order < 255 ? order : 255;
+  __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+} // fluo_event_scatter
+
+void fluo_event_close(struct fluo_event_log *log, char *compname)
+{
+  long stalls = 0;
+  int  i;
+
+  if (!log) return;
+  __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+#ifndef _WIN32
+  if (log->threaded) pthread_join(log->writer, NULL);
+#endif
+  fluo_event_drain(log);
+  // record count in the header
+  fseek(log->file, (long)offsetof(struct fluo_event_header, count), SEEK_SET);
+  fwrite(&log->count, sizeof(log->count), 1, log->file);
+  fclose(log->file);
+  for (i=0; i<log->nb; i++) {
+    stalls += log->ring[i].stalls;
+    free(log->ring[i].record);
+  }
+  MPI_MASTER(
+  printf("%s: %lld events written into %s (%.3g MB, %ld stalls on full rings)\n",
+    compname, log->count, log->filename,
+    (sizeof(struct fluo_event_header) + log->count*sizeof(struct fluo_event_record))/1e6, stalls);
+  );
+  free(log->ring);
+  free(log);
+} // fluo_event_close
+
+long long fluo_event_map(char *filename, struct fluo_event_header **header,
+  struct fluo_event_record **records, size_t *mapped)
+{
+#ifndef _WIN32
+  struct fluo_event_header *map;
+  struct stat st;
+  long long   count;
+  int         fd;
+
+  *header = NULL; *records = NULL; *mapped = 0;
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) || st.st_size < (long long)sizeof(struct fluo_event_header)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  if (memcmp(map->magic, FLUO_EVENT_MAGIC, sizeof(map->magic))
+    || map->version     != FLUO_EVENT_VERSION
+    || map->record_size != sizeof(struct fluo_event_record)
+    || map->endian      != 0x01020304) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  // an interrupted run leaves count=0: use the records found in the file
+  count = (st.st_size - sizeof(struct fluo_event_header))/sizeof(struct fluo_event_record);
+  if (map->count > 0 && map->count < count) count = map->count;
+  *header  = map;
+  *records = (struct fluo_event_record*)(map+1);
+  *mapped  = st.st_size;
+  return count;
+#else
+  return -1;
+#endif
+} // fluo_event_map
+
+void fluo_event_unmap(struct fluo_event_header *header, size_t mapped)
+{
+#ifndef _WIN32
+  if (header && mapped) munmap(header, mapped);
+#endif
+} // fluo_event_unmap
+
+/* Instrumentation report =================================================== */
+
+/* values summed over MPI nodes, packed as doubles */
+#define FLUO_REPORT_TALLY  (2*FLUO_PROCESS_MAX+6+FLUO_ORDER_MAX+FLUO_TIMER_MAX)
+#define FLUO_REPORT_SIZE   (FLUO_REPORT_TALLY+6)
+
+/* fluo_tally_report: sum tallies and cache/table counters, print and save them
+ * Timers are converted to seconds on each node, then summed (CPU time).
+ */
+void fluo_tally_report(struct fluo_tally_struct *tally, int nb,
+  struct fluo_processes_struct *processes, struct fluo_cache_struct *cache,
+  struct fluo_xs_table_struct *table, char *compname, char *filename,
+  struct fluo_tally_struct *total)
+{
+  static const char *timers[FLUO_TIMER_MAX] = { "geometry", "xsect", "propagate", "sample" };
+  double buffer[FLUO_REPORT_SIZE];
+  int    timed = filename && strlen(filename) && strcmp(filename, "NULL");
+  double rate  = timed ? fluo_ticks_per_second() : 0; /* timers only run with a report */
+  double *order, *seconds, *counter;
+  int    i, j, nodes=1;
+  FILE  *file;
+
+  fluo_tally_merge(tally, nb, total);
+
+  // pack tallies, then cache and table counters
+  memset(buffer, 0, sizeof(buffer));
+  for (j=0; j<FLUO_PROCESS_MAX; j++) {
+    buffer[j]                  = total->n[j];
+    buffer[FLUO_PROCESS_MAX+j] = total->p[j];
+  }
+  buffer[2*FLUO_PROCESS_MAX]   = total->events;
+  buffer[2*FLUO_PROCESS_MAX+1] = total->absorb_disabled;
+  buffer[2*FLUO_PROCESS_MAX+2] = total->delta_real;
+  buffer[2*FLUO_PROCESS_MAX+3] = total->delta_virtual;
+  buffer[2*FLUO_PROCESS_MAX+4] = total->delta_violations;
+  buffer[2*FLUO_PROCESS_MAX+5] = total->split_shared;
+  order   = buffer + 2*FLUO_PROCESS_MAX+6;
+  seconds = order + FLUO_ORDER_MAX;
+  counter = buffer + FLUO_REPORT_TALLY;
+  for (j=0; j<FLUO_ORDER_MAX; j++) order[j]   = total->order[j];
+  for (j=0; j<FLUO_TIMER_MAX; j++) seconds[j] = rate > 0 ? total->ticks[j]/rate : 0;
+  for (i=0; cache && i<nb; i++) {
+    counter[0] += cache[i].geometry_hit;
+    counter[1] += cache[i].geometry_miss;
+    counter[2] += cache[i].xs_hit;
+    counter[3] += cache[i].xs_miss;
+  }
+  for (i=0; table && table->thread && i<table->nb_threads; i++) {
+    counter[4] += table->thread[i].nb_lookup;
+    counter[5] += table->thread[i].nb_direct;
+  }
+#ifdef USE_MPI
+  mc_MPI_Sum(buffer, FLUO_REPORT_SIZE);
+  nodes = mpi_node_count;
+#endif
+  // unpack the totals over nodes
+  for (j=0; j<FLUO_PROCESS_MAX; j++) {
+    total->n[j] = buffer[j];
+    total->p[j] = buffer[FLUO_PROCESS_MAX+j];
+  }
+  total->events          = buffer[2*FLUO_PROCESS_MAX];
+  total->absorb_disabled = buffer[2*FLUO_PROCESS_MAX+1];
+  total->delta_real      = buffer[2*FLUO_PROCESS_MAX+2];
+  total->delta_virtual   = buffer[2*FLUO_PROCESS_MAX+3];
+  total->delta_violations= buffer[2*FLUO_PROCESS_MAX+4];
+  total->split_shared    = buffer[2*FLUO_PROCESS_MAX+5];
+  for (j=0; j<FLUO_ORDER_MAX; j++) total->order[j] = order[j];
+
+  MPI_MASTER(
+    printf("%s: events: %ld", compname, total->events);
+    for (j=0; j<FLUO_PROCESS_MAX; j++)
+      if (total->n[j])
+        printf(" %s=%ld (p=%g)",
+          j == TRANSMISSION ? "transmission" : processes->process[j].name, total->n[j], total->p[j]);
+    if (total->absorb_disabled) printf(" absorbed(no process)=%ld", total->absorb_disabled);
+    printf("\n");
+    if (total->delta_real || total->delta_virtual)
+      printf("%s: delta tracking: real=%ld virtual=%ld majorant violations=%ld\n", compname,
+        total->delta_real, total->delta_virtual, total->delta_violations);
+    if (total->split_shared)
+      printf("%s: SPLIT copies sharing the first leg of their ray: %ld\n", compname,
+        total->split_shared);
+
+    if (timed) {
+      file = fopen(filename, "w");
+      if (!file)
+        fprintf(stderr, "%s: %s: WARNING: can not write report %s\n", __FILE__, compname, filename);
+      else {
+        fprintf(file, "{\n  \"component\": \"%s\",\n  \"nodes\": %d,\n  \"threads\": %d,\n"
+          "  \"events\": %ld,\n  \"processes\": [\n", compname, nodes, nb, total->events);
+        for (j=0; j<FLUO_PROCESS_MAX; j++)
+          fprintf(file, "    {\"type\": %d, \"name\": \"%s\", \"enabled\": %d, "
+            "\"events\": %ld, \"weight\": %g}%s\n", j,
+            j == TRANSMISSION ? "transmission" :
+              (processes->process[j].name ? processes->process[j].name : "none"),
+            j == TRANSMISSION ? 1 : processes->process[j].enabled,
+            total->n[j], total->p[j], j < FLUO_PROCESS_MAX-1 ? "," : "");
+        fprintf(file, "  ],\n  \"absorb_disabled\": %ld,\n"
+          "  \"delta_tracking\": {\"real\": %ld, \"virtual\": %ld, \"violations\": %ld},\n"
+          "  \"split_shared\": %ld,\n  \"scattering_order\": [", total->absorb_disabled,
+          total->delta_real, total->delta_virtual, total->delta_violations, total->split_shared);
+        for (j=0; j<FLUO_ORDER_MAX; j++)
+          fprintf(file, "%s%ld", j ? ", " : "", total->order[j]);
+        fprintf(file, "],\n  \"cache\": {\"geometry_hit\": %.0f, \"geometry_miss\": %.0f, "
+          "\"xs_hit\": %.0f, \"xs_miss\": %.0f},\n"
+          "  \"xs_table\": {\"lookups\": %.0f, \"direct\": %.0f},\n  \"seconds\": {",
+          counter[0], counter[1], counter[2], counter[3], counter[4], counter[5]);
+        for (j=0; j<FLUO_TIMER_MAX; j++)
+          fprintf(file, "%s\"%s\": %g", j ? ", " : "", timers[j], seconds[j]);
+        fprintf(file, "}\n}\n");
+        fclose(file);
+        printf("%s: performance report written into %s\n", compname, filename);
+      }
+    }
+  );
+} // fluo_tally_report
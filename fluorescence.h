@@ -7,6 +7,64 @@
  * https://github.com/golosio/xrmc src/photon/photon.cpp (c) Bruno Golosio    
  */
   
+/* process types, also used as indices in cross-section arrays and tally slots */
+#ifndef FLUORESCENCE
+#define FLUORESCENCE 0  // Fluo
+#define RAYLEIGH     1  // Coherent
+#define COMPTON      2  // Incoherent
+#define POWDER       3  // Powder scattering
+#define TRANSMISSION 4
+#endif
+#ifndef FLUO_PROCESS_MAX
+#define FLUO_PROCESS_MAX 5 /* number of process types, including transmission */
+#endif
+
+/* Random number streams ==================================================== */
+
+/* Counter-based generator (Philox4x32-10, Salmon et al. SC'11): the numbers
+ * are a pure function of a key (seed, MPI rank) and a counter (photon id,
+ * block, stream), so that any draw can be recomputed without a shared state.
+ * A photon stream only depends on the seed, rank, component instance and
+ * photon id: its history is the same whatever the number of threads, and can
+ * be replayed alone. Streams without a photon id (thread streams) are used for
+ * benchmarks.
+ * All sampling functions take a 'rng' stream; NULL uses the McCode rand01().
+ */
+struct fluo_rng_struct {
+  unsigned int key[2];      /* seed, mixed with the MPI rank */
+  unsigned int ctr[4];      /* photon id (2 words), block, instance|stream */
+  unsigned int out[4];      /* current block */
+  int          left;        /* numbers left in 'out' (0-2) */
+  unsigned int stream;      /* instance|thread+1, for draws without a photon id */
+  char         pad[64];     /* avoid false sharing between threads */
+};
+
+/* fluo_rng_init: thread stream 'thread' of component 'instance' for a seed and MPI rank */
+void fluo_rng_init(struct fluo_rng_struct *rng, unsigned long long seed, int rank,
+  int instance, int thread);
+
+/* fluo_rng_create: 'nb' per-thread streams for this MPI node, freed with free() */
+struct fluo_rng_struct *fluo_rng_create(unsigned long long seed, int instance, int nb);
+
+/* fluo_rng_photon: switch to the stream of photon 'id'. The stream goes on
+ * when the id did not change, e.g. for SPLIT copies of the same photon.
+ */
+void fluo_rng_photon(struct fluo_rng_struct *rng, unsigned long long id);
+
+/* fluo_rng_uniform: random number in [0,1), 53 bits */
+double fluo_rng_uniform(struct fluo_rng_struct *rng);
+
+/* fluo_rng_uniform_n: n random numbers in [0,1), a block per pair (vectorisable) */
+void fluo_rng_uniform_n(struct fluo_rng_struct *rng, double *r, long n);
+
+/* fluo_rng_normal: Gaussian random number, mean 0 and sigma 1 (Box-Muller) */
+double fluo_rng_normal(struct fluo_rng_struct *rng);
+
+/* draws from a stream, or from the McCode run-time when rng is NULL */
+#define fluo_rand01(rng)   ((rng) ? fluo_rng_uniform(rng) : rand01())
+#define fluo_randpm1(rng)  ((rng) ? 2*fluo_rng_uniform(rng)-1 : randpm1())
+#define fluo_randnorm(rng) ((rng) ? fluo_rng_normal(rng) : randnorm())
+
 /* XRMC_CrossSections: Compute interaction cross sections in [barn/atom]
  * Return total cross section, given Z and E0:
  *   total_xs = XRMC_CrossSections(Z, E0, xs[3]);
@@ -14,24 +72,294 @@
 double XRMC_CrossSections(int Z, double E0, double *xs);
 
 /* XRMC_SelectFromDistribution: select a random element from a distribution
- *   index = XRMC_SelectFromDistribution(cum_sum[N], N);
+ *   index = XRMC_SelectFromDistribution(cum_sum[N], N, rng);
  * index is returned within 0 and N-1
  * The x_arr must be a continuously increasing cumulated sum, which last element is the max
  */
-int XRMC_SelectFromDistribution(double x_arr[], int N);
+int XRMC_SelectFromDistribution(double x_arr[], int N, struct fluo_rng_struct *rng);
 
-/* XRMC_SelectInteraction: select interaction type Fluo/Compton/Rayleigh
- * Return the interaction type from a random choice within cross sections 'xs'
- *   type = XRMC_SelectInteraction(xs[3]);
- * 'xs' is computed with XRMC_CrossSections.
- * type is one of FLUORESCENCE | RAYLEIGH | COMPTON
+/* XRMC_SelectFluorescenceEnergy: select outgoing fluo photon energy, when incoming with 'E0'
+ *   Ef = XRMC_SelectFluorescenceEnergy(Z, E0, &dE, rng);
  */
-int XRMC_SelectInteraction(double *xs);
+double XRMC_SelectFluorescenceEnergy(int Z, double E0, double *dE, struct fluo_rng_struct *rng);
 
-/* XRMC_SelectFluorescenceEnergy: select outgoing fluo photon energy, when incoming with 'E0'
- *   Ef = XRMC_SelectFluorescenceEnergy(Z, E0, &dE);
+/* fluo_get_edges: get the sorted absorption edge energies of element Z [keV]
+ *   nb = fluo_get_edges(Z, edges[FLUO_SHELL_MAX]);
+ */
+#ifndef FLUO_SHELL_MAX
+#define FLUO_SHELL_MAX (Q3_SHELL+1)
+#endif
+int fluo_get_edges(int Z, double *edges);
+
+/* Threads ================================================================== */
+
+/* Mutable state (caches, counters, tallies) is kept per thread, indexed by
+ * fluo_thread_id(). Material, line and cross-section tables are shared read-only.
+ */
+
+#ifndef FLUO_THREAD_LIMIT
+#define FLUO_THREAD_LIMIT 1024 /* largest OMP_THREAD_LIMIT used to size the slots */
+#endif
+
+/* fluo_thread_id: index of the calling thread, 0 without OpenMP.
+ * Exits when the thread has no slot, e.g. after omp_set_num_threads raised the
+ * team size beyond fluo_thread_max().
+ */
+int fluo_thread_id(void);
+
+/* fluo_thread_max: number of per-thread slots to allocate, 1 without OpenMP.
+ * It is set on the first call, as the largest of the default team size, the
+ * number of processors and OMP_THREAD_LIMIT (when below FLUO_THREAD_LIMIT).
+ */
+int fluo_thread_max(void);
+
+/* Tabulated compound cross sections on a log-energy grid =================== */
+
+#ifndef FLUO_XS_TABLE_DLOGE_MAX
+#define FLUO_XS_TABLE_DLOGE_MAX 0.05  /* largest log-energy step */
+#define FLUO_XS_TABLE_DLOGE_MIN 1e-4  /* smallest log-energy step */
+#define FLUO_XS_TABLE_EMIN      0.1   /* [keV] lower bound for lazy extension */
+#define FLUO_XS_TABLE_EMAX      1000  /* [keV] upper bound for lazy extension */
+#define FLUO_XS_TABLE_MARGIN    1.1   /* energy ratio added when extending */
+#endif
+
+/* Each grid point stores in [barn/atom] the cumulated per-element
+ *   fluorescence, Rayleigh and Compton cross sections, weighted by mass fractions
+ *   (nElements+1 values each), and the total (photo+Rayleigh+Compton).
+ * Values in between are linearly interpolated, which keeps the cumulated arrays
+ * monotone. Intervals containing an absorption edge, or exceeding the
+ * tolerance at their mid-point, are flagged and computed directly.
+ * With OpenMP, the table is fully built at initialisation, as lazy extension
+ * would modify it while other threads read it.
+ */
+struct fluo_xs_table_thread {
+  long    nb_lookup, nb_direct, nb_check_fail;
+  double  check_maxdev;
+  double *check_row; /* scratch for check mode */
+  char    pad[64];   /* avoid false sharing between threads */
+};
+
+struct fluo_xs_table_struct {
+  int     nElements;
+  int    *Z;
+  double *frac;      /* mass fractions */
+  int     stride;    /* 3*(nElements+1)+1 values per grid point */
+  long    i_min;     /* grid index of first point: log(E)=(i_min+i)*dlogE */
+  long    nE;        /* number of grid points, 0 when not built yet */
+  double  dlogE;     /* log-energy step */
+  double  tolerance; /* relative interpolation tolerance. 0: no table */
+  int     check;     /* compare each lookup with direct xraylib values */
+  double *data;      /* [nE][stride] tabulated values */
+  char   *exact;     /* [nE-1] interval computed directly */
+  void   *map;       /* node-shared mapping holding data and exact, NULL when allocated */
+  size_t  mapped;    /* its size; a mapped table is not extended */
+  double *check_row; /* scratch for building the table */
+  int     nb_edges;
+  double *edges;     /* sorted edges of all elements [keV] */
+  long    nb_extend;
+  int     nb_threads;
+  struct fluo_xs_table_thread *thread; /* per-thread counters [nb_threads] */
+};
+
+/* fluo_xs_table_init: set-up cross-section table for a compound.
+ * When Emin<Emax the table is built for that range [keV], else it is built and
+ * extended lazily around looked-up energies. tolerance<=0 disables the table.
+ */
+int fluo_xs_table_init(struct fluo_xs_table_struct *table, struct compoundData *compound,
+  double Emin, double Emax, double tolerance, int check);
+
+/* fluo_xs_table_eval: get cross sections for energy E [keV]
+ *   sigma = fluo_xs_table_eval(table, E, xs, cum_fluo, cum_Rayleigh, cum_Compton);
+ * fills xs[FLUORESCENCE|RAYLEIGH|COMPTON] and cumulated arrays [nElements+1].
+ * Returns the total cross section (photo+Rayleigh+Compton) [barn/atom].
+ */
+double fluo_xs_table_eval(struct fluo_xs_table_struct *table, double E, double *xs,
+  double *cum_fluo, double *cum_Rayleigh, double *cum_Compton);
+
+/* fluo_xs_compound: direct xraylib computation, same output as fluo_xs_table_eval */
+double fluo_xs_compound(struct fluo_xs_table_struct *table, double E, double *xs,
+  double *cum_fluo, double *cum_Rayleigh, double *cum_Compton);
+
+void fluo_xs_table_report(struct fluo_xs_table_struct *table, char *compname);
+void fluo_xs_table_free(struct fluo_xs_table_struct *table);
+
+/* Alias sampling of discrete distributions (Walker/Vose) =================== */
+
+/* fluo_alias_init: build alias table from 'n' (un-normalised) weights 'w'
+ *   fluo_alias_init(n, w[n], prob[n], alias[n]);
+ */
+void fluo_alias_init(int n, double *w, double *prob, int *alias);
+
+/* fluo_alias_select: O(1) random index within 0 and n-1
+ *   index = fluo_alias_select(n, prob, alias, rng);
+ */
+int fluo_alias_select(int n, double *prob, int *alias, struct fluo_rng_struct *rng);
+
+/* Fluorescence lines per element and excitation regime ===================== */
+
+#ifndef FLUO_LINES_TOP_RATIO
+#define FLUO_LINES_TOP_RATIO 1.5  /* E/edge ratio to evaluate lines above the highest edge */
+#define FLUO_LINES_MATCH     0.05 /* relative tolerance to identify line shells from edges */
+#endif
+
+/* A regime spans energies between two consecutive absorption edges, for which
+ * the set of excited shells, and thus of emitted lines, does not change.
+ * Only lines with a non-zero cross section are kept.
+ */
+struct fluo_lines_regime_struct {
+  double  Emin;     /* lower bound of the regime: edge energy [keV] */
+  int     count;    /* number of active lines */
+  double *energy;   /* line energies [keV] */
+  double *width;    /* line widths (FWHM, sum of the two level widths) [keV] */
+  double *prob;     /* alias table acceptance probabilities */
+  int    *alias;    /* alias table indices */
+};
+
+struct fluo_lines_struct {
+  int    Z;
+  int    nb_regimes;
+  struct fluo_lines_regime_struct *regime; /* sorted by increasing Emin */
+};
+
+/* fluo_lines_init: tabulate fluorescence lines of element Z for all regimes
+ * Return the total number of active lines.
+ */
+int fluo_lines_init(struct fluo_lines_struct *lines, int Z);
+
+/* fluo_lines_select: select outgoing fluo photon energy, when incoming with 'E0'
+ *   Ef = fluo_lines_select(lines, E0, &dE, rng);
+ * Same as XRMC_SelectFluorescenceEnergy, without any XRayLib call.
+ * dE is the line width (FWHM) [keV]. Return 0 when no line is excited.
+ */
+double fluo_lines_select(struct fluo_lines_struct *lines, double E0, double *dE,
+  struct fluo_rng_struct *rng);
+
+void fluo_lines_free(struct fluo_lines_struct *lines);
+
+/* Keyed caches for SPLIT and repeated energies ============================= */
+
+#ifndef FLUO_CACHE_SIZE
+#define FLUO_CACHE_SIZE 32 /* number of entries in each cache */
+#endif
+
+/* intersection lengths, keyed on the full incoming ray */
+struct fluo_geometry_cache_entry {
+  int    valid;
+  double x, y, z, kx, ky, kz;
+  int    intersect;
+  double l0, l1, l2, l3;
+};
+
+/* cross sections, keyed on the energy */
+struct fluo_xs_cache_entry {
+  int     valid;
+  double  E;            /* [keV] */
+  double  sigma;        /* total cross section (photo+Rayleigh+Compton) [barn/atom] */
+  double  xs[FLUO_PROCESS_MAX]; /* per process cross sections [barn/atom] */
+  int     Nq;           /* number of reachable powder lines */
+  double *cum_fluo;     /* cumulated per element cross sections [nElements+1] */
+  double *cum_Rayleigh;
+  double *cum_Compton;
+};
+
+/* first leg of a ray, shared by its SPLIT copies, keyed on the particle id and ray */
+struct fluo_split_cache_entry {
+  int    valid;         /* set once the first leg is stored */
+  unsigned long long ray;
+  double x, y, z, kx, ky, kz;
+  int    scatter;       /* 1: interaction at (sx,sy,sz,st), 0: transmitted to it */
+  double sx, sy, sz, st;
+  double weight;        /* weight factor of the first leg */
+};
+
+struct fluo_cache_struct {
+  int    nElements;
+  struct fluo_geometry_cache_entry geometry[FLUO_CACHE_SIZE];
+  struct fluo_xs_cache_entry       xs[FLUO_CACHE_SIZE];
+  struct fluo_split_cache_entry    split; /* SPLIT copies of a ray are consecutive */
+  double *storage;      /* cumulated arrays of all xs entries */
+  long   geometry_hit, geometry_miss, xs_hit, xs_miss;
+  char   pad[64];       /* avoid false sharing when used per thread */
+};
+
+void fluo_cache_init(struct fluo_cache_struct *cache, int nElements);
+
+/* fluo_cache_geometry: get the geometry entry for a ray
+ *   entry = fluo_cache_geometry(cache, x,y,z, kx,ky,kz, &hit);
+ * When hit is 0, the entry key is set and its values must be filled in.
+ */
+struct fluo_geometry_cache_entry *fluo_cache_geometry(struct fluo_cache_struct *cache,
+  double x, double y, double z, double kx, double ky, double kz, int *hit);
+
+/* fluo_cache_xs: get the cross-section entry for energy E [keV]
+ *   entry = fluo_cache_xs(cache, E, &hit);
+ * When hit is 0, the entry key is set and its values must be filled in.
+ * The key is the exact energy, as the reachable powder lines depend on it: only
+ * SPLIT copies, secondary events and monochromatic beams hit.
+ */
+struct fluo_xs_cache_entry *fluo_cache_xs(struct fluo_cache_struct *cache, double E, int *hit);
+
+/* fluo_cache_split: get the first leg of a ray for its SPLIT copies
+ *   entry = fluo_cache_split(cache, ray, x,y,z, kx,ky,kz, &hit);
+ * When hit is 0, the entry key is set, and the entry must be filled in and
+ * made valid once the first leg is known.
  */
-double XRMC_SelectFluorescenceEnergy(int Z, double E0, double *dE);
+struct fluo_split_cache_entry *fluo_cache_split(struct fluo_cache_struct *cache,
+  unsigned long long ray, double x, double y, double z, double kx, double ky, double kz, int *hit);
+
+/* fluo_cache_report: print hit rates summed over 'nb' (per-thread) caches */
+void fluo_cache_report(struct fluo_cache_struct *cache, int nb, char *compname);
+void fluo_cache_free(struct fluo_cache_struct *cache);
+
+/* Per-process tallies ====================================================== */
+
+#ifndef FLUO_ORDER_MAX
+#define FLUO_ORDER_MAX 16     /* scattering orders in the histogram, the last one collects higher orders */
+#endif
+
+/* TRACE sections timed by the instrumentation */
+#define FLUO_TIMER_GEOMETRY  0
+#define FLUO_TIMER_XSECT     1
+#define FLUO_TIMER_PROPAGATE 2
+#define FLUO_TIMER_SAMPLE    3
+#define FLUO_TIMER_MAX       4
+
+#ifndef FLUO_ESCAPE_FLOOR
+#define FLUO_ESCAPE_FLOOR      0.5 /* lowest escape probability after an event, with escape_floor */
+#endif
+
+/* event counts and weights per process type, accumulated per thread */
+struct fluo_tally_struct {
+  long   n[FLUO_PROCESS_MAX];
+  double p[FLUO_PROCESS_MAX];
+  long   events;              /* photons entering the component */
+  long   absorb_disabled;     /* ABSORB as no enabled process or no line could be sampled */
+  long   order[FLUO_ORDER_MAX]; /* photons leaving after 0,1,2... scattering events */
+  unsigned long long ticks[FLUO_TIMER_MAX]; /* time spent per TRACE section [ticks] */
+  long   delta_real;          /* delta tracking: real and virtual collisions */
+  long   delta_virtual;
+  long   delta_violations;    /* cross section above the majorant */
+  long   split_shared;        /* SPLIT copies which used the first leg of their ray */
+  char   pad[64];       /* avoid false sharing between threads */
+};
+
+/* fluo_tally_merge: sum 'nb' per-thread tallies into 'total' */
+void fluo_tally_merge(struct fluo_tally_struct *tally, int nb, struct fluo_tally_struct *total);
+
+/* fluo_ticks: cheap time stamp (TSC on x86, else monotonic clock [ns]) */
+unsigned long long fluo_ticks(void);
+
+/* fluo_ticks_per_second: calibrate fluo_ticks against the monotonic clock */
+double fluo_ticks_per_second(void);
+
+/* fluo_seconds: monotonic wall clock [s] */
+double fluo_seconds(void);
+
+/* section timers, only active when 'on', e.g. the report is requested */
+#define FLUO_TIMER_START(on, t0) \
+  do { if (on) (t0) = fluo_ticks(); } while (0)
+#define FLUO_TIMER_STOP(on, tally, timer, t0) \
+  do { if (on) (tally)->ticks[timer] += fluo_ticks() - (t0); } while (0)
 
 /* Function removing spaces from string */
 char * removeSpacesFromStr(char *string);
@@ -49,9 +377,26 @@ struct fluo_line_data
     };
 
 
+#ifndef FLUO_LINE_ALIGN
+#define FLUO_LINE_ALIGN 64  /* byte alignment of the reflection arrays (one AVX-512 register) */
+#endif
+#define FLUO_LINE_BLOCK ((int)(FLUO_LINE_ALIGN/sizeof(double))) /* lines per aligned block */
+
 struct fluo_line_info_struct {
-  struct fluo_line_data *list;     /* Reflection array */
   int  count;                  /* Number of reflections */
+  int  padded;                 /* count rounded up to FLUO_LINE_BLOCK */
+  /* reflection store: structure of arrays [padded], aligned on FLUO_LINE_ALIGN,
+   * sorted by increasing q. Padding lines have q=HUGE_VAL and zero weight */
+  double *q;                   /* Qvector [Angs-1] */
+  double *j;                   /* Multiplicity */
+  double *F2;                  /* Value of structure factor */
+  double *DW;                  /* Debye-Waller factor */
+  double *w;                   /* Intrinsic line width delta_d/d */
+  double *strain;              /* Strain=delta_d_d/d shift (Epsilon) */
+  double *my_s_k2;             /* line cross section divided by k^2 */
+  double *my_s_k2_cum;         /* prefix sums of my_s_k2 [count+1], k-independent */
+  void   *store;               /* single allocation holding all arrays */
+  size_t  store_mapped;        /* size of the mapped cache file, 0 when 'store' is allocated */
   double Dd;
   double DWfactor;
   double V_0;
@@ -73,16 +418,8 @@ struct fluo_line_info_struct {
   double my_a;
   double my_inc;
   double lfree; // store mean free path for the last event;
-  double *w,*q, *my_s_k2;
   double radius_i,xwidth_i,yheight_i,zdepth_i;
-  double k; /* last wavenumber (cached) */
-  double Nq;
-  double xs_Nq[CHAR_BUF_LENGTH];
-  double xs_sum[CHAR_BUF_LENGTH];
   int    nb_reuses, nb_refl, nb_refl_count;
-  double k_min, k_max;
-  unsigned int photon_passed;
-  long   xs_compute, xs_reuse, xs_calls;
   t_Table mat_table;
   int mat_column_order[5]; /*column signification for the coeff. in material data file*/
 };
@@ -93,9 +430,757 @@ struct fluo_line_info_struct {
  */
 int fluo_get_material(char *filename, char *formula);
 
-int fluo_calc_xsect(double k, double *q, double *my_s_k2, int count, double *sum,
-          struct fluo_line_info_struct *line_info);
+/* reflection list as read from a text file or computed from a CIF, before
+ * line merging. 'header' holds the comment lines, for Table_ParseHeader */
+struct fluo_hkl_table {
+  long    rows;
+  long    columns;
+  double *data;                /* [rows*columns] */
+  char   *header;
+};
+#define FLUO_HKL(table, i, j) \
+  ((j) < (table).columns ? (table).data[(long)(i)*(table).columns+(j)] : 0)
+
+#ifndef FLUO_CIF_DMIN
+#define FLUO_CIF_DMIN 0.5      /* smallest d-spacing [Angs] of lines computed from a CIF */
+#endif
+
+/* fluo_hkl_read: read a numerical reflection list (hkl/lau/laz), in a single pass
+ *   rows = fluo_hkl_read(filename, &table);
+ * Returns -1 when the file can not be opened.
+ */
+long fluo_hkl_read(char *filename, struct fluo_hkl_table *table);
+
+/* fluo_cif_read: compute F2(hkl) [barn] from the cell, symmetry operators and
+ * atom sites of a CIF, for X-rays, with columns j d F2
+ *   rows = fluo_cif_read(filename, &table, d_min);
+ * Returns 0 when the file is not a CIF or lacks symmetry operators/atoms.
+ */
+long fluo_cif_read(char *filename, struct fluo_hkl_table *table, double d_min);
+
+void fluo_hkl_free(struct fluo_hkl_table *table);
 
 int fluo_read_line_data(char *reflections, struct fluo_line_info_struct *info);
 
-int XRMC_SelectPowderLineQ(struct fluo_line_info_struct *line_info, double Ei, double *Q);
+/* fluo_line_store_init: copy 'count' reflections sorted by q into the aligned store
+ *   count = fluo_line_store_init(line_info, list, count);
+ */
+int fluo_line_store_init(struct fluo_line_info_struct *line_info,
+  struct fluo_line_data *list, int count);
+
+/* fluo_line_store_weights: compute per-line cross sections and their prefix sums
+ *   ok = fluo_line_store_weights(line_info, packing_factor);
+ * my_s_k2 = 4 PI^3 packing_factor DW j F2 / (V_0^2 q), in [barn/atom] once times k^2
+ */
+int fluo_line_store_weights(struct fluo_line_info_struct *line_info, double packing_factor);
+
+void fluo_line_store_free(struct fluo_line_info_struct *line_info);
+
+/* fluo_line_cache_path: name of the binary cache file for a reflection list
+ *   ok = fluo_line_cache_path(path, dir, reflections, line_info, packing_factor);
+ * The name holds a hash of the file content and of the parameters which change
+ * the stored lines (Vc, DW, delta_d_d, strain, packing_factor), so that any
+ * change invalidates the cache. 'path' must hold 1024 chars. Returns 0 when
+ * caching is disabled (dir NULL/empty/"NULL" and FLUO_CACHE_DIR unset).
+ */
+int fluo_line_cache_path(char *path, char *dir, char *reflections,
+  struct fluo_line_info_struct *line_info, double packing_factor);
+
+/* fluo_line_cache_load: map a reflection cache file, without copy
+ *   count = fluo_line_cache_load(line_info, path);
+ * Returns 0 when the file is missing or does not match this build.
+ */
+int fluo_line_cache_load(struct fluo_line_info_struct *line_info, char *path);
+
+/* fluo_line_cache_save: store sorted lines and their weights for later runs
+ *   ok = fluo_line_cache_save(line_info, path);
+ * The file is written aside and renamed, so that concurrent runs never read it partially.
+ */
+int fluo_line_cache_save(struct fluo_line_info_struct *line_info, char *path);
+
+/* fluo_line_index_Nq: number of lines which can scatter (q < 2k), in O(log N)
+ *   Nq = fluo_line_index_Nq(line_info, k);
+ */
+int fluo_line_index_Nq(struct fluo_line_info_struct *line_info, double k);
+
+/* fluo_calc_xsect: number of reachable lines (return value) and total powder
+ * cross section 'sum' [barn/atom] for wavenumber k [Angs-1]
+ *   Nq = fluo_calc_xsect(line_info, k, &sum);
+ */
+int fluo_calc_xsect(struct fluo_line_info_struct *line_info, double k, double *sum);
+
+/* XRMC_SelectPowderLineQ: select a powder line among the Nq reachable ones
+ *   i_q = XRMC_SelectPowderLineQ(line_info, Nq, &Q, rng);
+ * Nq is returned by fluo_calc_xsect or fluo_line_index_Nq. Q is the line q [Angs-1].
+ * Return -1 when no line can scatter.
+ */
+int XRMC_SelectPowderLineQ(struct fluo_line_info_struct *line_info, int Nq, double *Q,
+  struct fluo_rng_struct *rng);
+
+/* fluo_line_sample_q: q of line i_q, broadened by its relative width w (Gaussian)
+ *   q = fluo_line_sample_q(line_info, i_q, rng);
+ */
+double fluo_line_sample_q(struct fluo_line_info_struct *line_info, int i_q,
+  struct fluo_rng_struct *rng);
+
+/* Debye-Scherrer cone focusing: only the azimuths which may reach the target
+ * are sampled, and the weight is the sampled fraction of the cone. */
+#define FLUO_FOCUS_NONE   0 /* full cone */
+#define FLUO_FOCUS_TARGET 1 /* within the angular radius of the target direction */
+#define FLUO_FOCUS_DPHI   2 /* within +/- d_phi/2 of the horizontal plane, as PowderN */
+
+struct fluo_powder_focus_struct {
+  int    mode;
+  double psi;           /* [rad] angular radius of the target, or 0 to use 'radius' */
+  double radius;        /* [m]   radius of the target area */
+  double sin_dphi;      /* sin(d_phi/2) */
+};
+
+/* fluo_powder_focus_init: azimuthal window from d_phi or from the focus area
+ *   mode = fluo_powder_focus_init(focus, d_phi, focus_r, focus_xw, focus_yh, focus_aw, focus_ah);
+ * d_phi [deg] has precedence. The area is enclosed in a circle, as seen from
+ * the scattering point. Returns FLUO_FOCUS_NONE for 4PI scattering.
+ */
+int fluo_powder_focus_init(struct fluo_powder_focus_struct *focus, double d_phi,
+  double focus_r, double focus_xw, double focus_yh, double focus_aw, double focus_ah);
+
+/* fluo_powder_cone: random outgoing direction on the Debye-Scherrer cone of q
+ *   theta = fluo_powder_cone(kx,ky,kz, q, focus, ax,ay,az, &kf_x,&kf_y,&kf_z, &w, rng);
+ * k is the incoming wavevector [Angs-1], kf is a unit vector, a points to the
+ * target. w is the fraction of the cone sampled, to multiply the weight with.
+ * 'focus' may be NULL for the full cone.
+ */
+double fluo_powder_cone(double kx, double ky, double kz, double q,
+  struct fluo_powder_focus_struct *focus, double ax, double ay, double az,
+  double *kf_x, double *kf_y, double *kf_z, double *w, struct fluo_rng_struct *rng);
+
+/* Process registry ========================================================= */
+
+/* Processes may be removed at compile time with e.g. -DFLUO_NO_COMPTON, which
+ * also lets the compiler drop their code in the components.
+ */
+#ifdef FLUO_NO_FLUORESCENCE
+#define FLUO_HAS_FLUORESCENCE 0
+#else
+#define FLUO_HAS_FLUORESCENCE 1
+#endif
+#ifdef FLUO_NO_RAYLEIGH
+#define FLUO_HAS_RAYLEIGH 0
+#else
+#define FLUO_HAS_RAYLEIGH 1
+#endif
+#ifdef FLUO_NO_COMPTON
+#define FLUO_HAS_COMPTON 0
+#else
+#define FLUO_HAS_COMPTON 1
+#endif
+#ifdef FLUO_NO_POWDER
+#define FLUO_HAS_POWDER 0
+#else
+#define FLUO_HAS_POWDER 1
+#endif
+#define FLUO_PROCESS_COMPILED(type) \
+  ((type) == FLUORESCENCE ? FLUO_HAS_FLUORESCENCE : (type) == RAYLEIGH ? FLUO_HAS_RAYLEIGH \
+ : (type) == COMPTON      ? FLUO_HAS_COMPTON      : (type) == POWDER   ? FLUO_HAS_POWDER : 0)
+
+struct fluo_process_struct;
+
+/* cross section [barn/atom] of a process at the energy entry->E [keV]. The
+ * compound cross sections (cumulated arrays, total) are already in 'entry' */
+typedef double (*fluo_xsect_func)(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry);
+
+/* select the scattering element (i_Z) or powder line (i_q), -1 when none */
+typedef int    (*fluo_sample_func)(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry, struct fluo_rng_struct *rng);
+
+struct fluo_process_struct {
+  char  *name;
+  int    type;        /* process index, and tally slot */
+  int    enabled;     /* run-time flag, and compiled in */
+  int    in_total;    /* cross section already in the compound total (photo+Rayleigh+Compton) */
+  int    nElements;   /* number of elements in the compound */
+  fluo_xsect_func  xsect;
+  fluo_sample_func sample;
+  void  *data;        /* process specific data, e.g. powder lines */
+};
+
+struct fluo_processes_struct {
+  int    nb;                                   /* number of enabled processes */
+  int    active[FLUO_PROCESS_MAX];             /* types of enabled processes */
+  struct fluo_process_struct process[FLUO_PROCESS_MAX]; /* indexed by type */
+};
+
+/* fluo_processes_init: empty registry, all processes disabled */
+void fluo_processes_init(struct fluo_processes_struct *processes);
+
+/* fluo_process_register: add a process to the registry
+ *   ok = fluo_process_register(processes, type, name, enabled, in_total, nElements,
+ *     xsect, sample, data);
+ * The process is only enabled when 'enabled' is set and it is compiled in.
+ * Return the 'enabled' state.
+ */
+int fluo_process_register(struct fluo_processes_struct *processes, int type, char *name,
+  int enabled, int in_total, int nElements, fluo_xsect_func xsect, fluo_sample_func sample,
+  void *data);
+
+/* fluo_processes_xsect: fill entry E, xs[type], sigma and Nq for energy E [keV]
+ *   sigma = fluo_processes_xsect(processes, table, E, entry);
+ * Disabled processes have a null cross section. sigma is the total cross section
+ * (photo+Rayleigh+Compton, plus processes not in it) [barn/atom].
+ */
+double fluo_processes_xsect(struct fluo_processes_struct *processes,
+  struct fluo_xs_table_struct *table, double E, struct fluo_xs_cache_entry *entry);
+
+/* fluo_processes_select: select an enabled process from cross sections 'xs'
+ *   type = fluo_processes_select(processes, xs, rng);
+ * Return -1 when no process can occur.
+ */
+int fluo_processes_select(struct fluo_processes_struct *processes, double *xs,
+  struct fluo_rng_struct *rng);
+
+/* fluo_processes_report: print the enabled processes */
+void fluo_processes_report(struct fluo_processes_struct *processes, char *compname);
+
+/* built-in callbacks: compound elements (fluorescence, Rayleigh, Compton) */
+double fluo_xsect_element(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry);
+int    fluo_sample_element(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry, struct fluo_rng_struct *rng);
+
+/* built-in callbacks: powder lines, with data=struct fluo_line_info_struct* */
+double fluo_xsect_powder(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry);
+int    fluo_sample_powder(struct fluo_process_struct *process,
+  struct fluo_xs_cache_entry *entry, struct fluo_rng_struct *rng);
+
+/* Mesh bounding volume hierarchy =========================================== */
+
+#ifndef FLUO_BVH_LEAF
+#define FLUO_BVH_LEAF 4   /* max triangles per leaf */
+#endif
+#define FLUO_BVH_BINS  16 /* SAH bins per split */
+#define FLUO_BVH_STACK 64 /* traversal stack depth */
+#define FLUO_BVH_HITS  64 /* max intersections along a line */
+
+/* flat node array, one cache line per node. Children are adjacent */
+struct fluo_bvh_node {
+  double bmin[3], bmax[3];
+  int    first;           /* leaf: first triangle, else first child (second is first+1) */
+  int    count;           /* leaf: number of triangles, 0 for an inner node */
+  char   pad[8];
+};
+
+struct fluo_bvh_struct {
+  long    nb_triangles;
+  long    nb_nodes;
+  double *triangles;      /* v0, e1=v1-v0, e2=v2-v0 [9 per triangle], in leaf order */
+  long   *face;           /* face index of each triangle */
+  struct fluo_bvh_node *nodes;
+  int     depth;
+  int     enabled;        /* 0 when not built or after a failed self-check */
+};
+
+/* fluo_bvh_init: build a SAH BVH over polygonal faces (fan triangulated)
+ *   nb_nodes = fluo_bvh_init(bvh, vertices, nb_vertices, faces, faces_size);
+ * vertices are x,y,z triplets, faces are {n, v1..vn} sequences as in OFF files.
+ */
+long fluo_bvh_init(struct fluo_bvh_struct *bvh, double *vertices, long nb_vertices,
+  unsigned long *faces, long faces_size);
+
+/* fluo_bvh_intersect: first two intersections of a line with the mesh
+ *   n = fluo_bvh_intersect(bvh, &l0, &l3, x,y,z, kx,ky,kz);
+ * l0 and l3 are signed distances along k, as off_x_intersect. n is the number
+ * of intersections, or -1 when ambiguous (edge hits, odd count, overflow): the
+ * caller should then use the reference off_x_intersect.
+ */
+int fluo_bvh_intersect(struct fluo_bvh_struct *bvh, double *l0, double *l3,
+  double x, double y, double z, double kx, double ky, double kz);
+
+void fluo_bvh_free(struct fluo_bvh_struct *bvh);
+
+#ifdef USE_OFF
+/* fluo_bvh_init_off: build the BVH for an interoff-lib geometry, and check it
+ * against off_x_intersect with 'nb_check' random lines. Disabled on mismatch.
+ */
+long fluo_bvh_init_off(struct fluo_bvh_struct *bvh, off_struct *data, long nb_check);
+
+/* fluo_off_intersect: off_x_intersect with the BVH, falling back to the linear
+ * face scan when the BVH is disabled or the result is ambiguous
+ *   intersect = fluo_off_intersect(bvh, &l0, &l3, x,y,z, kx,ky,kz, &offdata);
+ */
+int fluo_off_intersect(struct fluo_bvh_struct *bvh, double *l0, double *l3,
+  double x, double y, double z, double kx, double ky, double kz, off_struct *data);
+#endif
+
+/* Sample shapes ============================================================ */
+
+#define FLUO_SHAPE_NONE    -1
+#define FLUO_SHAPE_CYLINDER 0 /* vertical axis */
+#define FLUO_SHAPE_BOX      1
+#define FLUO_SHAPE_SPHERE   2
+#define FLUO_SHAPE_OFF      3 /* OFF/PLY mesh */
+
+struct fluo_shape_struct;
+
+/* shape kernel: all four distances along k, in a single call. l0/l3 are the
+ * outer surface, l1/l2 the hole of hollow shapes (l1=l2=l3 when not crossed).
+ * Returns 0 when the outer surface is missed.
+ */
+typedef int (*fluo_shape_func)(struct fluo_shape_struct *shape,
+  double *l0, double *l1, double *l2, double *l3,
+  double x, double y, double z, double kx, double ky, double kz);
+
+/* shape descriptor, resolved once at INITIALIZE */
+struct fluo_shape_struct {
+  int    type;            /* FLUO_SHAPE_* */
+  int    hollow;          /* 1 when there is a hole (thickness != 0) */
+  double outer[3];        /* half sizes: cylinder r,h/2; box w/2,h/2,d/2; sphere r */
+  double inner[3];        /* same for the hole */
+  fluo_shape_func intersect;
+  struct fluo_bvh_struct *bvh; /* OFF geometry */
+  void  *off;             /* off_struct of the OFF geometry */
+};
+
+/* fluo_shape_init: resolve the sample dimensions into a shape descriptor
+ *   shape_type = fluo_shape_init(&shape, type, radius, xwidth, yheight, zdepth, thickness);
+ * thickness > 0 makes a hole inside the given dimensions, thickness < 0 a
+ * shell around them, as for the historical Fluorescence/PowderN geometries.
+ */
+int fluo_shape_init(struct fluo_shape_struct *shape, int type, double radius,
+  double xwidth, double yheight, double zdepth, double thickness);
+
+#ifdef USE_OFF
+/* fluo_shape_init_off: shape descriptor for an OFF/PLY geometry (no hole) */
+int fluo_shape_init_off(struct fluo_shape_struct *shape, struct fluo_bvh_struct *bvh,
+  off_struct *off);
+#endif
+
+/* shape kernels, see fluo_shape_func */
+int fluo_shape_cylinder(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz);
+int fluo_shape_box(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz);
+int fluo_shape_sphere(struct fluo_shape_struct *shape, double *l0, double *l1,
+  double *l2, double *l3, double x, double y, double z, double kx, double ky, double kz);
+
+/* fluo_shape_inside: locate a point in a shape descriptor
+ *   where = fluo_shape_inside(shape, x,y,z);
+ * returns 0 outside, 1 in the material, 2 in the hole, -1 when not supported (OFF).
+ */
+int fluo_shape_inside(struct fluo_shape_struct *shape, double x, double y, double z);
+
+/* Delta tracking =========================================================== */
+
+#define FLUO_MAJORANT_LOGE_MIN -1  /* log10 of the lowest energy [keV] */
+#define FLUO_MAJORANT_DECADES   4  /* up to 1 MeV */
+#define FLUO_MAJORANT_BINS     64  /* energy bins per decade */
+#define FLUO_MAJORANT_POINTS    8  /* samples per bin, besides edges */
+#ifndef FLUO_MAJORANT_MARGIN
+#define FLUO_MAJORANT_MARGIN 1.05  /* safety factor on the sampled maximum */
+#endif
+
+/* majorant of the total cross section, per energy bin. Bins are computed
+ * lazily, or at initialisation for a given energy range (as needed with OpenMP).
+ */
+struct fluo_majorant_struct {
+  long    nb;               /* number of bins */
+  double *sigma;            /* [nb] majorant [barn/atom], 0 when not computed */
+  struct fluo_processes_struct *processes;
+  struct fluo_xs_table_struct  *table;
+};
+
+/* fluo_majorant_init: set-up the majorant table, computed over [Emin:Emax] [keV] when Emin<Emax */
+int fluo_majorant_init(struct fluo_majorant_struct *majorant,
+  struct fluo_processes_struct *processes, struct fluo_xs_table_struct *table,
+  double Emin, double Emax);
+
+/* fluo_majorant: majorant cross section at energy E [keV], 0 when out of range */
+double fluo_majorant(struct fluo_majorant_struct *majorant, double E);
+
+void fluo_majorant_free(struct fluo_majorant_struct *majorant);
+
+/* fluo_delta_track: delta (Woodcock) tracking of one flight in a homogeneous sample
+ *   status = fluo_delta_track(majorant, shape, cache, tally, rho, E, x,y,z, kx,ky,kz, &dl, &entry, rng);
+ * Tentative collisions are sampled with the majorant, and accepted with the
+ * ratio sigma/majorant in the material. Points in the hole are virtual.
+ * sigma(E) is looked up first: when above the majorant (a violation), the bin
+ * is raised before the flight is sampled, so that every flight is unbiased.
+ * Only the point location is needed, the outer surface being convex.
+ * Returns 1 for a real collision at distance dl, with the cross sections at E
+ * in entry; 0 when the photon escapes; -1 when there is no majorant for E or
+ * the shape is not supported.
+ */
+int fluo_delta_track(struct fluo_majorant_struct *majorant, struct fluo_shape_struct *shape,
+  struct fluo_cache_struct *cache, struct fluo_tally_struct *tally, double rho, double E,
+  double x, double y, double z, double kx, double ky, double kz,
+  double *dl, struct fluo_xs_cache_entry **entry, struct fluo_rng_struct *rng);
+
+/* Differential cross section sampling ====================================== */
+
+#define FLUO_DCS_LOGE_MIN   -1  /* log10 of the lowest energy [keV] */
+#define FLUO_DCS_DECADES     4  /* up to 1 MeV */
+#define FLUO_DCS_BINS       32  /* energy bins per decade */
+#define FLUO_DCS_GRID      512  /* scattering angles to integrate the DCS in a bin */
+#define FLUO_DCS_QUANTILES 128  /* equiprobable cos(theta) intervals */
+
+/* inverse CDF of cos(theta) for the Rayleigh and Compton DCS, per element and
+ * energy bin. Bins are computed lazily, or at initialisation for a given
+ * energy range (as needed with OpenMP).
+ */
+struct fluo_dcs_struct {
+  int     nElements;
+  int    *Z;                /* [nElements] */
+  long    nb;               /* energy bins */
+  double **mu;              /* [(2*i_Z+type-RAYLEIGH)*nb+bin] cos(theta) quantiles, NULL when not computed */
+};
+
+/* fluo_dcs_init: set-up the tables, computed over [Emin:Emax] [keV] when Emin<Emax */
+int fluo_dcs_init(struct fluo_dcs_struct *dcs, struct compoundData *compound,
+  double Emin, double Emax);
+
+/* fluo_dcs_sample: outgoing direction for a Rayleigh or Compton event, sampled from the DCS
+ *   theta = fluo_dcs_sample(dcs, type, i_Z, E, kx,ky,kz, &kf_x,&kf_y,&kf_z, &solid_angle, rng);
+ * The tabulated DCS of the closest energy bin is used, over 4PI: within a
+ * focus area, uniform directions have a better figure of merit. kf is a
+ * unit vector, theta the scattering angle. 'solid_angle' is the inverse of the
+ * sampling density [sr], so that the weight is solid_angle*DCS(E,theta)/xs
+ * as for uniform sampling. Returns -1 when E is out of range.
+ */
+double fluo_dcs_sample(struct fluo_dcs_struct *dcs, int type, int i_Z, double E,
+  double kx, double ky, double kz, double *kf_x, double *kf_y, double *kf_z,
+  double *solid_angle, struct fluo_rng_struct *rng);
+
+void fluo_dcs_free(struct fluo_dcs_struct *dcs);
+
+/* Shared materials ========================================================= */
+
+#define FLUO_MATERIAL_PAR 16  /* parameters in a material key */
+
+/* material data which do not change during TRACE, shared by the component
+ * instances (e.g. concentric copies) with the same material, reflections and
+ * parameters. Entries are reference counted and built by their first user.
+ * The registry is only modified at INITIALIZE/FINALLY, which are not threaded.
+ */
+struct fluo_material_struct {
+  char   *name;                            /* material as given (formula or file) */
+  char   *reflections;                     /* NULL when none */
+  int     nb_par;
+  double  par[FLUO_MATERIAL_PAR];          /* e.g. Vc, DW, delta_d_d, packing_factor, table range */
+  int     refcount;
+  struct compoundData         *compound;   /* NULL until built */
+  struct fluo_xs_table_struct  xs_table;
+  struct fluo_lines_struct    *lines;      /* [compound->nElements], or NULL */
+  struct fluo_line_info_struct line_info;  /* powder reflections, count=0 when none */
+  struct fluo_dcs_struct       dcs;        /* mu=NULL until fluo_dcs_init */
+  double  density;                         /* [g/cm^3] mixture of phases, 0 for a single material */
+  double  weight;                          /* [g/mol]  mixture of phases, per formula unit */
+  struct fluo_material_struct *next;
+};
+
+/* fluo_material_acquire: shared entry for a material key, created when new
+ *   entry = fluo_material_acquire(material, reflections, par, nb_par);
+ * A new entry has compound=NULL, and the caller fills it. Parameters are
+ * compared exactly.
+ */
+struct fluo_material_struct *fluo_material_acquire(char *material, char *reflections,
+  double *par, int nb_par);
+
+/* fluo_material_release: drop a reference, and free the entry with the last one */
+void fluo_material_release(struct fluo_material_struct *entry);
+
+/* Node-shared tables ======================================================= */
+
+#ifndef FLUO_NODE_DIR
+#define FLUO_NODE_DIR "/dev/shm"  /* POSIX shared memory, seen as files */
+#endif
+
+/* Under MPI, the read-only material tables (reflection store, cross-section
+ * table) are built by one rank per host (the node leader), written into a
+ * shared memory segment, and mapped read-only by all ranks of the host, so that
+ * a host holds a single copy and reads the reflection files once. The segment
+ * is unlinked as soon as it is mapped: it disappears with the last rank.
+ * All fluo_node_ functions are collective over the ranks of the host, and are
+ * only called at INITIALIZE, which all ranks run in the same order. Without
+ * MPI, or when the segment can not be created, each rank builds its own tables.
+ */
+
+/* fluo_node_rank: rank within the MPI ranks of this host, 0 without MPI
+ *   rank = fluo_node_rank(&size);
+ * The first call creates the host communicator. 'size' may be NULL.
+ */
+int fluo_node_rank(int *size);
+
+/* fluo_node_bcast: value of the node leader, on all ranks of the host */
+int fluo_node_bcast(int value);
+
+/* fluo_node_path: name of a new segment, the same on all ranks of the host
+ *   fluo_node_path(path, name);
+ * 'path' must hold 1024 chars.
+ */
+void fluo_node_path(char *path, char *name);
+
+void fluo_node_unmap(void *map, size_t size);
+
+/* fluo_line_store_share: replace a line store built by the node leader with a
+ * single mapped copy on the host
+ *   count = fluo_line_store_share(line_info);
+ * Other ranks may have built the same store, or not. Returns the number of
+ * lines now in line_info, 0 on the ranks which must still build their own.
+ */
+int fluo_line_store_share(struct fluo_line_info_struct *line_info);
+
+/* fluo_line_store_read: sorted lines and their weights, from the cache or the
+ * reflection file, read once per host
+ *   count = fluo_line_store_read(line_info, reflections, packing_factor, cache_dir);
+ * line_info holds the parameters used when reading (V_0, DWfactor, Dd...).
+ * Returns 0 when the reflection file is not valid.
+ */
+int fluo_line_store_read(struct fluo_line_info_struct *line_info, char *reflections,
+  double packing_factor, char *cache_dir);
+
+/* fluo_xs_table_share: replace a table built by the node leader with a single
+ * mapped copy on the host
+ *   nE = fluo_xs_table_share(table);
+ * Returns the number of points now in the table, 0 on the ranks which must
+ * still build their own.
+ */
+long fluo_xs_table_share(struct fluo_xs_table_struct *table);
+
+/* fluo_node_report: memory of the material tables per host, and the
+ * initialisation time (slowest rank) since 't0' (fluo_seconds)
+ *   fluo_node_report(material, t0, compname);
+ */
+void fluo_node_report(struct fluo_material_struct *material, double t0, char *compname);
+
+/* Multi-phase samples ====================================================== */
+
+#ifndef FLUO_PHASE_MAX
+#define FLUO_PHASE_MAX 16     /* phases in a sample */
+#endif
+
+/* A sample made of several phases (e.g. crystalline phases and a binder, a
+ * powder in its capillary) is handled as a single material: the compounds are
+ * merged into one compound, and the reflections into one line store, with the
+ * atom fraction of each phase as weight. The cross-section table, the process
+ * selection and the geometry then cover all phases at once.
+ * Each phase is given as "material,reflections,fraction,packing,density" and
+ * phases are separated by ';'. Only the material is required: no reflections
+ * when empty or NULL, the fraction defaults to an equal share of the remaining
+ * volume, the packing factor to 1 and the density [g/cm^3] to that of the
+ * elements.
+ */
+struct fluo_phase_struct {
+  char   material[1024];       /* formula, or structure file */
+  char   reflections[1024];    /* powder lines, empty when none */
+  double fraction;             /* volume fraction of the sample */
+  double packing;              /* packing factor within that volume */
+  double density;              /* [g/cm^3] bulk density */
+  double weight;               /* [g/mol] per formula unit */
+  double atoms;                /* fraction of the mixture atoms, set by fluo_phases_mix */
+  struct compoundData         *compound;
+  struct fluo_line_info_struct line_info;
+};
+
+/* fluo_phases_parse: split a phase list
+ *   nb = fluo_phases_parse(spec, phase[FLUO_PHASE_MAX], FLUO_PHASE_MAX);
+ * Returns the number of phases, 0 when the list is empty or invalid.
+ */
+int fluo_phases_parse(char *spec, struct fluo_phase_struct *phase, int max);
+
+/* fluo_phase_init: compound, density and powder lines of one phase
+ *   fluo_phase_init(phase, DW, delta_d_d, cache_dir, compname);
+ * DW and delta_d_d apply to all phases. Exits on invalid material or reflections,
+ * and when the reflections give no unit cell volume (Vc or V_0).
+ */
+int fluo_phase_init(struct fluo_phase_struct *phase, double DW, double delta_d_d,
+  char *cache_dir, char *compname);
+
+/* fluo_phases_mix: build the mixture into a (new) shared material
+ *   fluo_phases_mix(phase, nb, material, compname);
+ * Sets material->compound, line_info, density and weight. Fractions summing
+ * above 1 are scaled down, below 1 the rest of the volume is empty.
+ */
+int fluo_phases_mix(struct fluo_phase_struct *phase, int nb,
+  struct fluo_material_struct *material, char *compname);
+
+/* fluo_compound_mix: compound with the elements of 'nb' compounds, and mass
+ * fractions summed with the weights 'w' (which sum to 1). With the formula
+ * unit fractions as 'w' (fluo_phases_mix), massFractions then holds the weights
+ * of the element cross sections per formula unit of the mixture, which are not
+ * the mass fractions of the mixture. */
+struct compoundData *fluo_compound_mix(struct compoundData **compound, double *w, int nb);
+
+/* fluo_line_store_merge: lines of 'nb' stores, sorted by q, with their cross
+ * sections scaled by 'w'
+ *   count = fluo_line_store_merge(dest, src, w, nb);
+ */
+int fluo_line_store_merge(struct fluo_line_info_struct *dest,
+  struct fluo_line_info_struct **src, double *w, int nb);
+
+void fluo_phase_free(struct fluo_phase_struct *phase);
+
+/* Adaptive p_interact ====================================================== */
+
+#ifndef FLUO_ADAPT_BINS
+#define FLUO_ADAPT_BINS   32    /* log-energy bins between FLUO_XS_TABLE_EMIN and FLUO_XS_TABLE_EMAX */
+#define FLUO_ADAPT_START  0.5   /* forced fraction before the first update, without p_interact */
+#define FLUO_ADAPT_WARMUP 1000  /* photons in a bin before the first update */
+#define FLUO_ADAPT_PERIOD 1000  /* photons in a bin between updates */
+#define FLUO_ADAPT_MIN    0.02  /* bounds of the forced fraction, so that both branches stay sampled */
+#define FLUO_ADAPT_MAX    0.98
+#endif
+
+/* The first event either scatters, with probability q, or transmits. A photon
+ * which took branch b leaves the component with the weight ratio w, and has
+ * cost c (CPU ticks in the component). m_b = <(q_b w)^2> over branch b does not
+ * depend on q, and the figure of merit 1/(variance * time) is highest for
+ *   q = a_1/(a_0 + a_1), a_b = sqrt(m_b/c_b)
+ * (b=0 transmit, b=1 scatter). Each energy bin gets its own q, updated from its
+ * running sums. The weights stay exact for any q: the tuning only moves the
+ * variance. Sums are kept per thread, so that q is also tuned per thread.
+ */
+struct fluo_adapt_bin {
+  double n[2];        /* photons per branch (0 transmit, 1 scatter) */
+  double m2[2];       /* sum of (q_b w)^2 */
+  double ticks[2];    /* sum of the cost */
+  double q;           /* current forced fraction */
+  long   since;       /* photons since the last update */
+  int    updates;
+};
+
+struct fluo_adapt_struct {
+  double q0;          /* initial forced fraction */
+  struct fluo_adapt_bin bin[FLUO_ADAPT_BINS];
+  char   pad[64];     /* avoid false sharing between threads */
+};
+
+/* fluo_adapt_init: start from p_interact, or FLUO_ADAPT_START when it is not set */
+void fluo_adapt_init(struct fluo_adapt_struct *adapt, double p_interact);
+
+/* fluo_adapt_get: forced fraction of the first event at energy E [keV]
+ *   mc_scatt = fluo_adapt_get(adapt, E);
+ */
+double fluo_adapt_get(struct fluo_adapt_struct *adapt, double E);
+
+/* fluo_adapt_add: outcome of a photon which took 'branch' with probability q
+ *   fluo_adapt_add(adapt, E, branch, q, p_out/p_in, ticks);
+ */
+void fluo_adapt_add(struct fluo_adapt_struct *adapt, double E, int branch, double q,
+  double w, double ticks);
+
+/* fluo_adapt_report: sum 'nb' per-thread states over threads and MPI nodes, and
+ * print the tuned fractions: one for the whole run, to reuse as p_interact, and
+ * per energy bin. All MPI nodes must call it.
+ */
+void fluo_adapt_report(struct fluo_adapt_struct *adapt, int nb, char *compname);
+
+/* Event log ================================================================ */
+
+#ifndef FLUO_EVENT_RING
+#define FLUO_EVENT_RING   8192      /* records per thread ring, a power of 2 */
+#endif
+#define FLUO_EVENT_MAGIC   "FLUOEVNT"
+#define FLUO_EVENT_VERSION 2
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/* One record per scattering event, 64 bytes. The file is a header followed by
+ * the records of all threads, each thread in its own order, so that it can be
+ * mapped and read as an array. Photon histories are kept or dropped as a whole:
+ * with decimation N, 1 photon in N is logged, and weights must be multiplied by
+ * N (header.decimation) to estimate intensities.
+ */
+struct fluo_event_record {
+  unsigned long long photon;  /* McCode photon id, per MPI node */
+  double Ei, Ef;              /* incoming and outgoing energy [keV] */
+  double cos_theta;           /* cosine of the scattering angle, acos is left to the reader */
+  double p;                   /* weight after the event */
+  float  x, y, z;             /* position in the component frame [m] */
+  int    index;               /* element (i_Z) or powder line (i_q) index */
+  short  Z;                   /* element, 0 for powder lines */
+  unsigned char  type;        /* FLUORESCENCE, RAYLEIGH, COMPTON or POWDER */
+  unsigned char  order;       /* 1 for the first event of the photon, 2... */
+  unsigned short thread;      /* set by the writer */
+  unsigned short pad;         /* 0 */
+};
+
+struct fluo_event_header {
+  char   magic[8];
+  int    version;
+  int    record_size;         /* sizeof(struct fluo_event_record) */
+  int    endian;              /* 0x01020304 in the writer byte order */
+  int    decimation;
+  long long count;            /* records, set when the log is closed */
+  char   compname[96];
+};
+
+/* single producer (tracing thread) and single consumer (writer) ring */
+struct fluo_event_ring {
+  struct fluo_event_record *record;  /* [FLUO_EVENT_RING] */
+  unsigned long head;                /* records added, by the tracing thread */
+  char   pad0[64];
+  unsigned long tail;                /* records written, by the writer */
+  long   stalls;                     /* waits on a full ring */
+  char   pad1[64];
+};
+
+struct fluo_event_log {
+  FILE  *file;
+  char   filename[1024];
+  int    nb;                  /* rings, one per thread */
+  struct fluo_event_ring *ring;
+  int    decimation;
+  unsigned long long threshold; /* photon hashes below are kept */
+  long long count;            /* records written */
+  int    stop;                /* ask the writer to drain and exit */
+  int    threaded;            /* a writer thread runs, else rings are drained when full */
+#ifndef _WIN32
+  pthread_t writer;
+#endif
+};
+
+/* fluo_event_open: create the log file and start its writer thread
+ *   log = fluo_event_open(filename, nb_threads, decimation, compname);
+ * With MPI, each node writes its own file, with the node rank appended to the
+ * name. Returns NULL when the file can not be created.
+ */
+struct fluo_event_log *fluo_event_open(char *filename, int nb, int decimation, char *compname);
+
+/* fluo_event_scatter: log a scattering event of photon 'photon' from thread 'thread'
+ *   fluo_event_scatter(log, thread, photon, type, index, Z, order, Ei, Ef, cos_theta, p, x,y,z);
+ * The record is copied into the thread ring as given, without conversion; the
+ * call only waits when the ring is full, which is counted as a stall.
+ */
+void fluo_event_scatter(struct fluo_event_log *log, int thread, unsigned long long photon,
+  int type, int index, int Z, int order, double Ei, double Ef, double cos_theta, double p,
+  double x, double y, double z);
+
+/* fluo_event_close: drain the rings, stop the writer, set the record count, and free */
+void fluo_event_close(struct fluo_event_log *log, char *compname);
+
+/* fluo_event_map: map an event file read-only
+ *   count = fluo_event_map(filename, &header, &records, &mapped);
+ * Returns the number of records, or -1 when the file is missing or invalid.
+ * 'mapped' receives the mapped size (the file size), which may hold more than
+ * 'count' records after an interrupted run. Release with fluo_event_unmap(header, mapped).
+ */
+long long fluo_event_map(char *filename, struct fluo_event_header **header,
+  struct fluo_event_record **records, size_t *mapped);
+
+void fluo_event_unmap(struct fluo_event_header *header, size_t mapped);
+
+/* Instrumentation report ================================================== */
+
+/* fluo_tally_report: sum tallies and cache/table counters over threads and MPI
+ * nodes, print a summary, and write a JSON report when 'filename' is given
+ *   fluo_tally_report(tally, nb, processes, cache, xs_table, compname, filename, &total);
+ * 'total' receives the summed tallies. All MPI nodes must call it. The tick
+ * rate is only calibrated (10 ms) for the report, as the timers need it.
+ */
+void fluo_tally_report(struct fluo_tally_struct *tally, int nb,
+  struct fluo_processes_struct *processes, struct fluo_cache_struct *cache,
+  struct fluo_xs_table_struct *table, char *compname, char *filename,
+  struct fluo_tally_struct *total);